@@ -11,7 +11,10 @@
 
 namespace labhelper
 {
-bool Texture::load(const std::string& _directory, const std::string& _filename, int _components)
+bool Texture::load(const std::string& _directory,
+                   const std::string& _filename,
+                   int _components,
+                   bool upload_to_gpu)
 {
 	filename = _filename;
 	directory = _directory;
@@ -24,6 +27,10 @@ bool Texture::load(const std::string& _directory, const std::string& _filename,
 		          << "\n";
 		exit(1);
 	}
+	if(!upload_to_gpu)
+	{
+		return true;
+	}
 	glGenTextures(1, &gl_id);
 	glBindTexture(GL_TEXTURE_2D, gl_id);
 	GLenum format, internal_format;
@@ -62,6 +69,11 @@ bool Texture::load(const std::string& _directory, const std::string& _filename,
 ///////////////////////////////////////////////////////////////////////////
 Model::~Model()
 {
+	// Nothing to free on the GPU if the model was never uploaded
+	if(m_vaob == 0)
+	{
+		return;
+	}
 	for(auto& material : m_materials)
 	{
 		if(material.m_color_texture.valid)
@@ -80,9 +92,10 @@ Model::~Model()
 	glDeleteBuffers(1, &m_positions_bo);
 	glDeleteBuffers(1, &m_normals_bo);
 	glDeleteBuffers(1, &m_texture_coordinates_bo);
+	glDeleteVertexArrays(1, &m_vaob);
 }
 
-Model* loadModelFromOBJ(std::string path)
+Model* loadModelFromOBJ(std::string path, bool upload_to_gpu)
 {
 	///////////////////////////////////////////////////////////////////////
 	// Separate filename into directory, base filename and extension
@@ -143,32 +156,32 @@ Model* loadModelFromOBJ(std::string path)
 		material.m_color = glm::vec3(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
 		if(m.diffuse_texname != "")
 		{
-			material.m_color_texture.load(directory, m.diffuse_texname, 4);
+			material.m_color_texture.load(directory, m.diffuse_texname, 4, upload_to_gpu);
 		}
 		material.m_reflectivity = m.specular[0];
 		if(m.specular_texname != "")
 		{
-			material.m_reflectivity_texture.load(directory, m.specular_texname, 1);
+			material.m_reflectivity_texture.load(directory, m.specular_texname, 1, upload_to_gpu);
 		}
 		material.m_metalness = m.metallic;
 		if(m.metallic_texname != "")
 		{
-			material.m_metalness_texture.load(directory, m.metallic_texname, 1);
+			material.m_metalness_texture.load(directory, m.metallic_texname, 1, upload_to_gpu);
 		}
 		material.m_fresnel = m.sheen;
 		if(m.sheen_texname != "")
 		{
-			material.m_fresnel_texture.load(directory, m.sheen_texname, 1);
+			material.m_fresnel_texture.load(directory, m.sheen_texname, 1, upload_to_gpu);
 		}
 		material.m_shininess = m.roughness;
 		if(m.roughness_texname != "")
 		{
-			material.m_shininess_texture.load(directory, m.roughness_texname, 1);
+			material.m_shininess_texture.load(directory, m.roughness_texname, 1, upload_to_gpu);
 		}
 		material.m_emission = m.emission[0];
 		if(m.emissive_texname != "")
 		{
-			material.m_emission_texture.load(directory, m.emissive_texname, 4);
+			material.m_emission_texture.load(directory, m.emissive_texname, 4, upload_to_gpu);
 		}
 		material.m_transparency = m.transmittance[0];
 		model->m_materials.push_back(material);
@@ -184,6 +197,9 @@ Model* loadModelFromOBJ(std::string path)
 	{
 		number_of_vertices += shape.mesh.indices.size();
 	}
+	// One position more than needed, so that the positions can be handed
+	// to embree as they are (it reads 4 bytes past the last one)
+	model->m_positions.reserve(number_of_vertices + 1);
 	model->m_positions.resize(number_of_vertices);
 	model->m_normals.resize(number_of_vertices);
 	model->m_texture_coordinates.resize(number_of_vertices);
@@ -320,6 +336,11 @@ Model* loadModelFromOBJ(std::string path)
 	///////////////////////////////////////////////////////////////////////
 	// Upload to GPU
 	///////////////////////////////////////////////////////////////////////
+	if(!upload_to_gpu)
+	{
+		std::cout << "done.\n";
+		return model;
+	}
 	glGenVertexArrays(1, &model->m_vaob);
 	glBindVertexArray(model->m_vaob);
 	glGenBuffers(1, &model->m_positions_bo);
@@ -13,7 +13,10 @@ struct Texture
 	std::string directory;
 	int width, height;
 	uint8_t* data = nullptr;
-	bool load(const std::string& directory, const std::string& filename, int nof_components);
+	bool load(const std::string& directory,
+	          const std::string& filename,
+	          int nof_components,
+	          bool upload_to_gpu = true);
 };
 //////////////////////////////////////////////////////////////////////////////
 // This material class implements a subset of the suggested PBR extension
@@ -66,15 +69,17 @@ public:
 	std::vector<glm::vec3> m_positions;
 	std::vector<glm::vec3> m_normals;
 	std::vector<glm::vec2> m_texture_coordinates;
-	// Buffers on GPU
-	uint32_t m_positions_bo;
-	uint32_t m_normals_bo;
-	uint32_t m_texture_coordinates_bo;
+	// Buffers on GPU (all zero if the model was never uploaded)
+	uint32_t m_positions_bo = 0;
+	uint32_t m_normals_bo = 0;
+	uint32_t m_texture_coordinates_bo = 0;
 	// Vertex Array Object
-	uint32_t m_vaob;
+	uint32_t m_vaob = 0;
 };
 
-Model* loadModelFromOBJ(std::string filename);
+// Pass upload_to_gpu = false to load a model without an OpenGL context,
+// e.g., for offline rendering. Only the CPU buffers are filled in then.
+Model* loadModelFromOBJ(std::string filename, bool upload_to_gpu = true);
 void saveModelToOBJ(Model* model, std::string filename);
 void freeModel(Model* model);
 void render(const Model* model, const bool submitMaterials = true);
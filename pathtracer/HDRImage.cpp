@@ -1,5 +1,9 @@
 #include "HDRImage.h"
 #include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <stb_image_write.h>
 
 using namespace std;
 using namespace glm;
@@ -16,9 +20,89 @@ void HDRImage::load(const string& filename)
 	}
 };
 
-vec3 HDRImage::sample(float u, float v)
+vec3 HDRImage::sample(float u, float v) const
 {
 	int x = int(u * width) % width;
 	int y = int(v * height) % height;
 	return vec3(data[(y * width + x) * 3 + 0], data[(y * width + x) * 3 + 1], data[(y * width + x) * 3 + 2]);
-}
\ No newline at end of file
+}
+
+bool saveHDRImage(const string& filename, int width, int height, const float* data)
+{
+	const size_t separator = filename.find_last_of(".");
+	const string extension = separator == string::npos ? "" : filename.substr(separator);
+	if(extension == ".pfm")
+	{
+		// PFM stores rows bottom to top, so no flip is needed. A negative
+		// scale means little endian.
+		ofstream file(filename, ios::binary);
+		file << "PF\n" << width << " " << height << "\n-1.0\n";
+		file.write((const char*)data, sizeof(float) * 3 * width * height);
+		if(!file)
+		{
+			std::cout << "Failed to write image: " << filename << ".\n";
+			return false;
+		}
+		return true;
+	}
+	else if(extension == ".hdr")
+	{
+		vector<float> flipped(3 * width * height);
+		for(int y = 0; y < height; y++)
+		{
+			std::copy(data + 3 * width * (height - 1 - y), data + 3 * width * (height - y),
+			          flipped.begin() + 3 * width * y);
+		}
+		if(stbi_write_hdr(filename.c_str(), width, height, 3, flipped.data()) == 0)
+		{
+			std::cout << "Failed to write image: " << filename << ".\n";
+			return false;
+		}
+		return true;
+	}
+	std::cout << "Unknown image format (expected .hdr or .pfm): " << filename << ".\n";
+	return false;
+}
+
+bool loadHDRImage(const string& filename, int& width, int& height, vector<float>& data)
+{
+	const size_t separator = filename.find_last_of(".");
+	const string extension = separator == string::npos ? "" : filename.substr(separator);
+	if(extension == ".pfm")
+	{
+		ifstream file(filename, ios::binary);
+		string magic;
+		float scale = 0.0f;
+		file >> magic >> width >> height >> scale;
+		file.get(); // The single whitespace before the pixels
+		if(!file || magic != "PF" || scale >= 0.0f || width <= 0 || height <= 0)
+		{
+			std::cout << "Failed to load image (expected little endian RGB PFM): " << filename << ".\n";
+			return false;
+		}
+		data.resize(3 * width * height);
+		file.read((char*)data.data(), sizeof(float) * data.size());
+		if(!file)
+		{
+			std::cout << "Failed to load image: " << filename << ".\n";
+			return false;
+		}
+		return true;
+	}
+	else if(extension == ".hdr")
+	{
+		int components;
+		stbi_set_flip_vertically_on_load(true);
+		float* pixels = stbi_loadf(filename.c_str(), &width, &height, &components, 3);
+		if(pixels == NULL)
+		{
+			std::cout << "Failed to load image: " << filename << ".\n";
+			return false;
+		}
+		data.assign(pixels, pixels + 3 * width * height);
+		stbi_image_free(pixels);
+		return true;
+	}
+	std::cout << "Unknown image format (expected .hdr or .pfm): " << filename << ".\n";
+	return false;
+}
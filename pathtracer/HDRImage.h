@@ -1,6 +1,7 @@
 #pragma once
 #include <stb_image.h>
 #include <string>
+#include <vector>
 #include <glm/glm.hpp>
 
 ///////////////////////////////////////////////////////////////////////////
@@ -17,5 +18,18 @@ struct HDRImage
 			stbi_image_free(data);
 	};
 	void load(const std::string& filename);
-	glm::vec3 sample(float u, float v);
-};
\ No newline at end of file
+	glm::vec3 sample(float u, float v) const;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Save an RGB float image to a Radiance .hdr or a .pfm file (chosen from
+// the extension of the filename). The rows in data are stored bottom to
+// top, as in OpenGL.
+///////////////////////////////////////////////////////////////////////////
+bool saveHDRImage(const std::string& filename, int width, int height, const float* data);
+
+///////////////////////////////////////////////////////////////////////////
+// Load an RGB float image written by saveHDRImage(), with the rows bottom
+// to top.
+///////////////////////////////////////////////////////////////////////////
+bool loadHDRImage(const std::string& filename, int& width, int& height, std::vector<float>& data);
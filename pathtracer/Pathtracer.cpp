@@ -3,9 +3,15 @@
 #include <iostream>
 #include <map>
 #include <algorithm>
+#include <atomic>
 #include "material.h"
 #include "embree.h"
 #include "sampling.h"
+#include "scheduler.h"
+#include "integrator.h"
+#include "wavefront.h"
+#include "lights.h"
+#include "termination.h"
 
 using namespace std;
 using namespace glm;
@@ -20,13 +26,26 @@ Environment environment;
 Image rendered_image;
 PointLight point_light;
 
+///////////////////////////////////////////////////////////////////////////
+// Every call to restart() bumps the generation. A pass belongs to the
+// generation it started in and is cancelled when the generation changes.
+///////////////////////////////////////////////////////////////////////////
+static atomic<uint32_t> restart_generation{ 0 };
+static uint32_t image_generation = 0;
+static uint32_t pass_generation = 0;
+
+bool passCancelled()
+{
+	return restart_generation.load(memory_order_relaxed) != pass_generation;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Restart rendering of image
 ///////////////////////////////////////////////////////////////////////////
 void restart()
 {
-	// No need to clear image,
-	rendered_image.number_of_samples = 0;
+	// No need to clear image, the next pass notices the new generation
+	restart_generation++;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -35,59 +54,307 @@ void restart()
 ///////////////////////////////////////////////////////////////////////////
 void resize(int w, int h)
 {
-	rendered_image.width = w / settings.subsampling;
-	rendered_image.height = h / settings.subsampling;
+	resize(w, h, settings.subsampling);
+}
+
+void resize(int w, int h, int subsampling)
+{
+	rendered_image.width = std::max(1, w / subsampling);
+	rendered_image.height = std::max(1, h / subsampling);
 	rendered_image.data.resize(rendered_image.width * rendered_image.height);
+	rendered_image.sample_count.resize(rendered_image.width * rendered_image.height);
+	rendered_image.luminance_m2.resize(rendered_image.width * rendered_image.height);
+	rendered_image.aovs.resize(rendered_image.width * rendered_image.height, rendered_image.aovs.enabled);
+	rendered_image.number_of_samples = 0;
 	restart();
 }
 
+void continueImage()
+{
+	image_generation = restart_generation;
+}
+
+uint32_t activeAOVs()
+{
+	return settings.aovs | (settings.denoise ? DENOISER_AOVS : 0u);
+}
+
+void Environment::load(const std::string& filename)
+{
+	map.load(filename);
+	octahedral.build(map);
+}
+
+bool filtersEnvironment(const MaterialRecord& material)
+{
+	return settings.filter_environment && material.type == MATERIAL_DIFFUSE;
+}
+
+vec3 Lenvironment(const vec3& wi, float brdf_pdf, bool filtered)
+{
+	const float level = filtered ? environment.octahedral.levelForPdf(brdf_pdf) : 0.0f;
+	return environment.multiplier * environment.octahedral.lookup(wi, level);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Offset a point slightly along the geometry normal, to the side that
+// direction d points to, so that a ray starting there does not hit the
+// surface it starts on.
+///////////////////////////////////////////////////////////////////////////
+static vec3 offsetRayOrigin(const Intersection& hit, const vec3& d)
+{
+	return hit.position + (dot(d, hit.geometry_normal) > 0.0f ? EPSILON : -EPSILON) * hit.geometry_normal;
+}
+
+vec3 pointLightContribution(const Intersection& hit, Ray& shadow_ray)
+{
+	const float distance_to_light = length(point_light.position - hit.position);
+	const float falloff_factor = 1.0f / (distance_to_light * distance_to_light);
+	vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
+	vec3 wi = normalize(point_light.position - hit.position);
+	shadow_ray = Ray(offsetRayOrigin(hit, wi), wi, 0.0f, distance_to_light);
+	return evaluateMaterial(*hit.material, wi, hit.wo, hit.shading_normal) * Li
+	       * std::max(0.0f, dot(wi, hit.shading_normal));
+}
+
 ///////////////////////////////////////////////////////////////////////////
-// Return the radiance from a certain direction wi from the environment
-// map.
+// The power heuristic (with beta = 2) for combining two sampling techniques
 ///////////////////////////////////////////////////////////////////////////
-vec3 Lenvironment(const vec3& wi)
+static float powerHeuristic(float pdf, float other_pdf)
+{
+	return (pdf * pdf) / (pdf * pdf + other_pdf * other_pdf);
+}
+
+vec3 emissiveLightContribution(const Intersection& hit, Ray& shadow_ray)
 {
-	const float theta = acos(std::max(-1.0f, std::min(1.0f, wi.y)));
-	float phi = atan(wi.z, wi.x);
-	if(phi < 0.0f)
-		phi = phi + 2.0f * M_PI;
-	vec2 lookup = vec2(phi / (2.0 * M_PI), theta / M_PI);
-	return environment.multiplier * environment.map.sample(lookup.x, lookup.y);
+	if(getNumberOfEmissiveTriangles() == 0)
+		return vec3(0.0f);
+	const vec2 u = sample2D(DIM_LIGHT);
+	EmissiveSample light = sampleEmissiveTriangle(vec3(u, sample1D(DIM_LIGHT_SELECTION)));
+	vec3 wi = light.position - hit.position;
+	const float distance_to_light = length(wi);
+	if(distance_to_light < EPSILON)
+		return vec3(0.0f);
+	wi /= distance_to_light;
+	// Emissive surfaces emit from both sides, as when they are hit
+	const float cos_light = abs(dot(wi, light.normal));
+	const float cos_surface = std::max(0.0f, dot(wi, hit.shading_normal));
+	if(cos_light <= 0.0f || cos_surface <= 0.0f)
+		return vec3(0.0f);
+	const float light_pdf = light.pdf_area * distance_to_light * distance_to_light / cos_light;
+	const float brdf_pdf = materialPdf(*hit.material, wi, hit.wo, hit.shading_normal);
+	// Stop just short of the light, or the shadow ray hits the light itself
+	shadow_ray = Ray(offsetRayOrigin(hit, wi), wi, 0.0f, distance_to_light * (1.0f - EPSILON) - EPSILON);
+	return evaluateMaterial(*hit.material, wi, hit.wo, hit.shading_normal) * light.radiance * cos_surface
+	       * powerHeuristic(light_pdf, brdf_pdf) / light_pdf;
 }
 
+float emissionWeight(const Ray& ray, float brdf_pdf)
+{
+	if(brdf_pdf == 0.0f)
+		return 1.0f;
+	return powerHeuristic(brdf_pdf, emissiveTrianglePdf(getGeometryIndex(ray), ray.primID, ray.d, ray.tfar));
+}
+
+vec3 environmentLightContribution(const Intersection& hit, Ray& shadow_ray)
+{
+	if(environment.multiplier <= 0.0f || !environment.octahedral.canImportanceSample()
+	   || filtersEnvironment(*hit.material))
+	{
+		return vec3(0.0f);
+	}
+	float light_pdf;
+	const vec3 wi = environment.octahedral.sample(sample2D(DIM_ENVIRONMENT), light_pdf);
+	const float cos_surface = std::max(0.0f, dot(wi, hit.shading_normal));
+	if(light_pdf <= 0.0f || cos_surface <= 0.0f)
+		return vec3(0.0f);
+	const float brdf_pdf = materialPdf(*hit.material, wi, hit.wo, hit.shading_normal);
+	shadow_ray = Ray(offsetRayOrigin(hit, wi), wi);
+	return evaluateMaterial(*hit.material, wi, hit.wo, hit.shading_normal)
+	       * environment.multiplier * environment.octahedral.lookup(wi) * cos_surface
+	       * powerHeuristic(light_pdf, brdf_pdf) / light_pdf;
+}
+
+float environmentWeight(const vec3& wi, float brdf_pdf, bool filtered)
+{
+	if(brdf_pdf == 0.0f || filtered || environment.multiplier <= 0.0f || !environment.octahedral.canImportanceSample())
+		return 1.0f;
+	return powerHeuristic(brdf_pdf, environment.octahedral.pdf(wi));
+}
+
+vec3 sampleNextRay(const Intersection& hit, Ray& next_ray, float& pdf)
+{
+	vec3 wi;
+	vec3 brdf = sampleMaterial(*hit.material, wi, hit.wo, hit.shading_normal, pdf);
+	if(pdf < EPSILON)
+		return vec3(0.0f);
+	float cosine_term = abs(dot(wi, hit.shading_normal));
+	next_ray = Ray(offsetRayOrigin(hit, wi), wi);
+	return brdf * cosine_term / pdf;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A branch of a split path that is still to be traced: its next ray, not
+// yet intersected, and the state of the path at the vertex it left from
+///////////////////////////////////////////////////////////////////////////
+struct PathBranch
+{
+	Ray ray;
+	vec3 throughput;
+	float brdf_pdf;
+	bool filtered_environment;
+	int bounces;
+	int split_budget;
+	RandomStream stream;
+};
+
 ///////////////////////////////////////////////////////////////////////////
 // Calculate the radiance going from one point (r.hitPosition()) in one
-// direction (-r.d), through path tracing.
+// direction (-r.d), through path tracing. Also fills in what the path
+// adds to the AOVs. A path that splits (see termination.h) follows its
+// first branch right away and the others once that one has ended.
 ///////////////////////////////////////////////////////////////////////////
-vec3 Li(Ray& primary_ray)
+vec3 Li(Ray& primary_ray, PathAOVs& aovs)
 {
 	vec3 L = vec3(0.0f);
 	vec3 path_throughput = vec3(1.0);
 	Ray current_ray = primary_ray;
+	// The pdf of the BRDF sample that current_ray came from
+	float brdf_pdf = 0.0f;
+	// Whether the vertex it left from filters the environment
+	bool filtered_environment = false;
+	int split_budget = MAX_EXTRA_BRANCHES;
+	PathBranch pending[MAX_EXTRA_BRANCHES];
+	int number_of_pending = 0;
+	PathCounts counts;
+	counts.paths = 1;
+	counts.segments = 1;
 
-	///////////////////////////////////////////////////////////////////
-	// Get the intersection information from the ray
-	///////////////////////////////////////////////////////////////////
-	Intersection hit = getIntersection(current_ray);
-	///////////////////////////////////////////////////////////////////
-	// Create a Material tree for evaluating brdfs and calculating
-	// sample directions.
-	///////////////////////////////////////////////////////////////////
-
-	Diffuse diffuse(hit.material->m_color);
-	BRDF& mat = diffuse;
-	///////////////////////////////////////////////////////////////////
-	// Calculate Direct Illumination from light.
-	///////////////////////////////////////////////////////////////////
+	for(int bounces = 0;;)
 	{
-		const float distance_to_light = length(point_light.position - hit.position);
-		const float falloff_factor = 1.0f / (distance_to_light * distance_to_light);
-		vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
-		vec3 wi = normalize(point_light.position - hit.position);
-		L = mat.f(wi, hit.wo, hit.shading_normal) * Li * std::max(0.0f, dot(wi, hit.shading_normal));
+		startBounce(bounces);
+		///////////////////////////////////////////////////////////////////
+		// Get the intersection information from the ray
+		///////////////////////////////////////////////////////////////////
+		Intersection hit = getIntersection(current_ray);
+		if(bounces == 0)
+		{
+			aovs.albedo = hit.material->color;
+			aovs.normal = hit.shading_normal;
+			aovs.depth = current_ray.tfar;
+			aovs.material_id = float(getMaterialIndex(hit.material));
+		}
+		///////////////////////////////////////////////////////////////////
+		// Calculate Direct Illumination from light.
+		///////////////////////////////////////////////////////////////////
+		// One shadow ray for each kind of light, traced together
+		Ray shadow_rays[3];
+		vec3 Ld[3];
+		int shadow_count = 0;
+		Ld[shadow_count] = pointLightContribution(hit, shadow_rays[shadow_count]);
+		shadow_count += Ld[shadow_count] != vec3(0.0f) ? 1 : 0;
+		Ld[shadow_count] = emissiveLightContribution(hit, shadow_rays[shadow_count]);
+		shadow_count += Ld[shadow_count] != vec3(0.0f) ? 1 : 0;
+		Ld[shadow_count] = environmentLightContribution(hit, shadow_rays[shadow_count]);
+		shadow_count += Ld[shadow_count] != vec3(0.0f) ? 1 : 0;
+		uint64_t visible;
+		occludedBatch(shadow_rays, shadow_count, &visible);
+		for(int i = 0; i < shadow_count; i++)
+		{
+			if(!isVisible(&visible, i))
+				continue;
+			L += path_throughput * Ld[i];
+			if(bounces == 0)
+				aovs.direct += Ld[i];
+		}
+		///////////////////////////////////////////////////////////////////
+		// Add emitted radiance from intersection, weighted against the
+		// chance that the light sample above would have found it.
+		///////////////////////////////////////////////////////////////////
+		if(hit.material->emission != vec3(0.0f))
+		{
+			const vec3 Le =
+			    path_throughput * hit.material->emission * emissionWeight(current_ray, brdf_pdf);
+			L += Le;
+			if(bounces <= 1)
+				aovs.direct += Le;
+		}
+		///////////////////////////////////////////////////////////////////
+		// Sample an incoming direction for each branch the path continues
+		// with, unless it is already as long as we allow. Branch 0 is
+		// sampled last, so that its stream is the current one.
+		///////////////////////////////////////////////////////////////////
+		bool continued = false;
+		if(bounces < settings.max_bounces)
+		{
+			const bool filtered = filtersEnvironment(*hit.material);
+			const int branches = splitCount(path_throughput, split_budget);
+			const RandomStream vertex_stream = getRandomStream();
+			const vec3 branch_throughput = path_throughput / float(branches);
+			for(int b = branches - 1; b >= 0; b--)
+			{
+				setRandomStream(splitStream(vertex_stream, b));
+				Ray next_ray;
+				float next_pdf;
+				vec3 throughput = branch_throughput * sampleNextRay(hit, next_ray, next_pdf);
+				if(throughput == vec3(0.0f))
+					continue;
+				if(!russianRoulette(bounces, throughput))
+				{
+					counts.roulette_terminations++;
+					continue;
+				}
+				const int budget = branchBudget(split_budget, branches, b);
+				if(b > 0)
+				{
+					pending[number_of_pending++] =
+					    PathBranch{ next_ray, throughput, next_pdf, filtered, bounces, budget, getRandomStream() };
+					counts.splits++;
+					continue;
+				}
+				current_ray = next_ray;
+				path_throughput = throughput;
+				brdf_pdf = next_pdf;
+				filtered_environment = filtered;
+				split_budget = budget;
+				continued = true;
+			}
+		}
+		///////////////////////////////////////////////////////////////////
+		// Find the next ray that hits something, from this branch or the
+		// pending ones. Rays that miss see the environment.
+		///////////////////////////////////////////////////////////////////
+		for(;;)
+		{
+			if(!continued)
+			{
+				if(number_of_pending == 0)
+				{
+					countPaths(counts);
+					// Return the final outgoing radiance for the primary ray
+					return L;
+				}
+				const PathBranch& branch = pending[--number_of_pending];
+				current_ray = branch.ray;
+				path_throughput = branch.throughput;
+				brdf_pdf = branch.brdf_pdf;
+				filtered_environment = branch.filtered_environment;
+				bounces = branch.bounces;
+				split_budget = branch.split_budget;
+				setRandomStream(branch.stream);
+			}
+			continued = false;
+			counts.segments++;
+			if(intersect(current_ray))
+				break;
+			const vec3 Le = path_throughput * Lenvironment(current_ray.d, brdf_pdf, filtered_environment)
+			                * environmentWeight(current_ray.d, brdf_pdf, filtered_environment);
+			L += Le;
+			if(bounces == 0)
+				aovs.direct += Le;
+		}
+		bounces++;
 	}
-	// Return the final outgoing radiance for the primary ray
-	return L;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -98,57 +365,284 @@ inline static glm::vec3 homogenize(const glm::vec4& p)
 	return glm::vec3(p * (1.f / p.w));
 }
 
+Ray PrimaryRayGenerator::generate(int x, int y, const RandomStream& stream) const
+{
+	Ray primaryRay;
+	primaryRay.o = camera_pos;
+	const vec2 jitter = pixelSample(stream);
+	vec2 screenCoord = vec2((float(x) + jitter.x) / float(rendered_image.width),
+	                        (float(y) + jitter.y) / float(rendered_image.height));
+	// Calculate direction
+	vec4 viewCoord = vec4(screenCoord.x * 2.0f - 1.0f, screenCoord.y * 2.0f - 1.0f, 1.0f, 1.0f);
+	vec3 p = homogenize(inverse_VP * viewCoord);
+	primaryRay.d = normalize(p - camera_pos);
+	return primaryRay;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Adaptive sampling
+///////////////////////////////////////////////////////////////////////////
+// The most paths a pixel can get in one pass, so that a pass stays short
+// even when only a few pixels are left.
+static const int MAX_ADAPTIVE_PATHS_PER_PASS = 16;
+// How many paths each unconverged pixel gets in the current pass
+static int paths_per_active_pixel = 1;
+
+static float luminance(const vec3& color)
+{
+	return dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+static bool isConverged(int pixel)
+{
+	if(!settings.adaptive_sampling)
+		return false;
+	const int n = rendered_image.sample_count[pixel];
+	if(settings.max_paths_per_pixel != 0 && n >= settings.max_paths_per_pixel)
+		return true;
+	if(n < std::max(2, settings.adaptive_min_samples))
+		return false;
+	const float variance = rendered_image.luminance_m2[pixel] / float(n - 1);
+	const float standard_error = sqrt(variance / float(n));
+	// Nearly black pixels are compared against an absolute error instead,
+	// or they would never converge.
+	const float mean = std::max(luminance(rendered_image.data[pixel]), 0.01f);
+	return standard_error / mean < settings.adaptive_threshold;
+}
+
+int pathsThisPass(int x, int y)
+{
+	return isConverged(y * rendered_image.width + x) ? 0 : paths_per_active_pixel;
+}
+
+void accumulatePixel(int x, int y, const vec3& color, const PathAOVs& aovs)
+{
+	const int pixel = y * rendered_image.width + x;
+	const float n = float(rendered_image.sample_count[pixel]);
+	const float old_mean = luminance(rendered_image.data[pixel]);
+	rendered_image.data[pixel] = rendered_image.data[pixel] * (n / (n + 1.0f)) + (1.0f / (n + 1.0f)) * color;
+	rendered_image.aovs.accumulate(pixel, rendered_image.sample_count[pixel], aovs, color);
+	// Welford's online update of the sum of squared deviations
+	const float l = luminance(color);
+	rendered_image.luminance_m2[pixel] += (l - old_mean) * (l - luminance(rendered_image.data[pixel]));
+	rendered_image.sample_count[pixel] += 1;
+}
+
+void sampleCountHeatmap(const vector<int>& sample_count, vector<vec3>& heatmap)
+{
+	heatmap.resize(sample_count.size());
+	int max_count = 1;
+	for(int count : sample_count)
+		max_count = std::max(max_count, count);
+	for(size_t i = 0; i < heatmap.size(); i++)
+	{
+		const float t = float(sample_count[i]) / float(max_count);
+		heatmap[i] = t < 0.5f ? mix(vec3(0.0f, 0.0f, 1.0f), vec3(0.0f, 1.0f, 0.0f), 2.0f * t)
+		                      : mix(vec3(0.0f, 1.0f, 0.0f), vec3(1.0f, 0.0f, 0.0f), 2.0f * t - 1.0f);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The random number stream of the next path of a pixel
+///////////////////////////////////////////////////////////////////////////
+static RandomStream pathStream(int x, int y)
+{
+	const int pixel = y * rendered_image.width + x;
+	return randomStream(pixel, rendered_image.first_sample + rendered_image.sample_count[pixel]);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Evaluate the radiance for a primary ray that has already been
+// intersected with the scene and accumulate it to the pixels color
+///////////////////////////////////////////////////////////////////////////
+static void shadePrimaryRay(int x, int y, Ray& primaryRay)
+{
+	setRandomStream(pathStream(x, y));
+	vec3 color;
+	PathAOVs aovs;
+	if(primaryRay.geomID != RTC_INVALID_GEOMETRY_ID)
+	{
+		// If it hit something, evaluate the radiance from that point
+		color = Li(primaryRay, aovs);
+	}
+	else
+	{
+		// Otherwise evaluate environment
+		color = Lenvironment(primaryRay.d);
+		aovs.albedo = color;
+		aovs.direct = color;
+		PathCounts counts;
+		counts.paths = 1;
+		counts.segments = 1;
+		countPaths(counts);
+	}
+	accumulatePixel(x, y, color, aovs);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trace the primary rays of a tile one at a time
+///////////////////////////////////////////////////////////////////////////
+static void traceTile(const Tile& tile, const PrimaryRayGenerator& camera)
+{
+	for(int y = tile.y0; y < tile.y1; y++)
+	{
+		for(int x = tile.x0; x < tile.x1; x++)
+		{
+			const int paths = pathsThisPass(x, y);
+			for(int s = 0; s < paths; s++)
+			{
+				Ray primaryRay = camera.generate(x, y, pathStream(x, y));
+				intersect(primaryRay);
+				shadePrimaryRay(x, y, primaryRay);
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trace the primary rays of a tile as packets covering W x H pixel blocks.
+// Neighbouring primary rays are coherent, so embree can trace them
+// together using the full SIMD width of the CPU. Lanes that fall outside
+// of the tile, or whose pixel needs fewer paths than the others, are
+// masked out.
+///////////////////////////////////////////////////////////////////////////
+template <typename Packet, int W, int H>
+static void traceTilePackets(const Tile& tile, const PrimaryRayGenerator& camera)
+{
+	static_assert(W * H == Packet::size, "Block must cover exactly one packet");
+	for(int by = tile.y0; by < tile.y1; by += H)
+	{
+		for(int bx = tile.x0; bx < tile.x1; bx += W)
+		{
+			int paths[Packet::size];
+			int max_paths = 0;
+			for(int i = 0; i < Packet::size; i++)
+			{
+				const int x = bx + i % W, y = by + i / W;
+				paths[i] = (x < tile.x1 && y < tile.y1) ? pathsThisPass(x, y) : 0;
+				max_paths = std::max(max_paths, paths[i]);
+			}
+			for(int s = 0; s < max_paths; s++)
+			{
+				Packet packet;
+				// Embree wants the mask aligned like the packet
+				alignas(4 * Packet::size) int valid[Packet::size];
+				for(int i = 0; i < Packet::size; i++)
+				{
+					valid[i] = s < paths[i] ? -1 : 0;
+					const int x = bx + i % W, y = by + i / W;
+					packet.set(i, valid[i] ? camera.generate(x, y, pathStream(x, y)) : Ray());
+				}
+				intersectPacket(valid, packet);
+				for(int i = 0; i < Packet::size; i++)
+				{
+					if(valid[i])
+					{
+						Ray primaryRay = packet.get(i);
+						shadePrimaryRay(bx + i % W, by + i / W, primaryRay);
+					}
+				}
+			}
+		}
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Trace one path per pixel and accumulate the result in an image
 ///////////////////////////////////////////////////////////////////////////
-void tracePaths(const glm::mat4& V, const glm::mat4& P)
+bool tracePaths(const glm::mat4& V, const glm::mat4& P)
 {
+	pass_generation = restart_generation;
+	commitSceneUpdates();
+	updatePassLights();
+	if(pass_generation != image_generation)
+	{
+		image_generation = pass_generation;
+		rendered_image.number_of_samples = 0;
+	}
+	// Start over if other AOVs are wanted, since the missing ones were
+	// never accumulated
+	const uint32_t aovs = activeAOVs();
+	if(aovs != rendered_image.aovs.enabled)
+	{
+		rendered_image.aovs.resize(rendered_image.width * rendered_image.height, aovs);
+		rendered_image.number_of_samples = 0;
+	}
 	// Stop here if we have as many samples as we want
 	if((int(rendered_image.number_of_samples) > settings.max_paths_per_pixel)
 	   && (settings.max_paths_per_pixel != 0))
 	{
-		return;
+		return false;
 	}
-	vec3 camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
-	// Trace one path per pixel (the omp parallel stuf magically distributes the
-	// pathtracing on all cores of your CPU).
-	int num_rays = 0;
-	vector<vec4> local_image(rendered_image.width * rendered_image.height, vec4(0.0f));
-
-#pragma omp parallel for
-	for(int y = 0; y < rendered_image.height; y++)
+	const int number_of_pixels = rendered_image.width * rendered_image.height;
+	// The image was restarted, forget all per pixel statistics
+	if(rendered_image.number_of_samples == 0)
 	{
-		for(int x = 0; x < rendered_image.width; x++)
+		std::fill(rendered_image.sample_count.begin(), rendered_image.sample_count.end(), 0);
+		std::fill(rendered_image.luminance_m2.begin(), rendered_image.luminance_m2.end(), 0.0f);
+	}
+	// With adaptive sampling, split this pass' budget of one path per pixel
+	// evenly over the pixels that have not converged yet.
+	if(settings.adaptive_sampling)
+	{
+		int active_pixels = 0;
+#pragma omp parallel for reduction(+ : active_pixels)
+		for(int i = 0; i < number_of_pixels; i++)
 		{
-			vec3 color;
-			Ray primaryRay;
-			primaryRay.o = camera_pos;
-			// Create a ray that starts in the camera position and points toward
-			// the current pixel on a virtual screen.
-			vec2 screenCoord = vec2(float(x) / float(rendered_image.width),
-			                        float(y) / float(rendered_image.height));
-			// Calculate direction
-			vec4 viewCoord = vec4(screenCoord.x * 2.0f - 1.0f, screenCoord.y * 2.0f - 1.0f, 1.0f, 1.0f);
-			vec3 p = homogenize(inverse(P * V) * viewCoord);
-			primaryRay.d = normalize(p - camera_pos);
-			// Intersect ray with scene
-			if(intersect(primaryRay))
-			{
-				// If it hit something, evaluate the radiance from that point
-				color = Li(primaryRay);
-			}
-			else
+			active_pixels += isConverged(i) ? 0 : 1;
+		}
+		rendered_image.active_pixels = active_pixels;
+		if(active_pixels == 0)
+			return false;
+		paths_per_active_pixel =
+		    std::min(MAX_ADAPTIVE_PATHS_PER_PASS, (number_of_pixels + active_pixels - 1) / active_pixels);
+	}
+	else
+	{
+		rendered_image.active_pixels = number_of_pixels;
+		paths_per_active_pixel = 1;
+	}
+
+	beginPathStats();
+	PrimaryRayGenerator camera;
+	camera.camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
+	camera.inverse_VP = inverse(P * V);
+	if(settings.integrator == Integrator::Wavefront)
+	{
+		traceWavefront(camera);
+	}
+	else
+	{
+		const int packet_size = std::min(settings.packet_size, getMaxPacketSize());
+		// Trace one path per pixel. The image is split into small tiles that
+		// are spread over all cores of your CPU, and cores that finish early
+		// steal tiles from the others.
+		renderTiles(rendered_image.width, rendered_image.height, settings.tile_size, [&](const Tile& tile) {
+			if(passCancelled())
+				return;
+			switch(packet_size)
 			{
-				// Otherwise evaluate environment
-				color = Lenvironment(primaryRay.d);
+			case 16:
+				traceTilePackets<Ray16, 4, 4>(tile, camera);
+				break;
+			case 8:
+				traceTilePackets<Ray8, 4, 2>(tile, camera);
+				break;
+			case 4:
+				traceTilePackets<Ray4, 2, 2>(tile, camera);
+				break;
+			default:
+				traceTile(tile, camera);
+				break;
 			}
-			// Accumulate the obtained radiance to the pixels color
-			float n = float(rendered_image.number_of_samples);
-			rendered_image.data[y * rendered_image.width + x] =
-			    rendered_image.data[y * rendered_image.width + x] * (n / (n + 1.0f))
-			    + (1.0f / (n + 1.0f)) * color;
-		}
+		});
 	}
+	// A cancelled pass has left some pixels half done, but the next pass
+	// starts over anyway.
+	if(passCancelled())
+		return false;
+	endPathStats();
 	rendered_image.number_of_samples += 1;
+	return true;
 }
 }; // namespace pathtracer
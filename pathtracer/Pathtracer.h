@@ -4,6 +4,8 @@
 #include <Model.h>
 #include <omp.h>
 #include "HDRImage.h"
+#include "envmap.h"
+#include "aov.h"
 
 #ifdef M_PI
 #undef M_PI
@@ -19,11 +21,90 @@ namespace pathtracer
 ///////////////////////////////////////////////////////////////////////////////
 // Path Tracer settings
 ///////////////////////////////////////////////////////////////////////////////
+enum class Integrator
+{
+	// One thread follows a whole path at a time, in Li()
+	Megakernel,
+	// All paths of a pass advance one stage at a time, see wavefront.h
+	Wavefront
+};
+
+enum class Sampler
+{
+	// Every dimension of every path is an independent random number
+	Independent,
+	// Owen scrambled Sobol points, see sampling.h
+	Sobol
+};
+
+// How the geometry of the models may change after it is added, which
+// decides how embree builds their BVHs (see embree.cpp)
+enum class GeometryUsage
+{
+	// Never changes. Instances can still be moved.
+	Static,
+	// Vertices may move, keeping the topology (the BVH can be refit)
+	Deformable,
+	// Anything may change (the BVH is rebuilt)
+	Dynamic
+};
+
 extern struct Settings
 {
 	int subsampling;
+	// Dynamic resolution (see renderthread.h). While the camera moves, the
+	// subsampling is picked so that a pass takes about target_frame_time
+	// milliseconds, and once it stops the image is refined back to full
+	// resolution. The subsampling above is then only where it starts.
+	bool dynamic_resolution;
+	float target_frame_time;
 	int max_bounces;
 	int max_paths_per_pixel;
+	// Width and height, in pixels, of the tiles handed out to threads
+	int tile_size;
+	// Trace primary rays in packets of this size (4, 8 or 16), or one at a
+	// time (1). Clamped to what the CPU supports.
+	int packet_size;
+	Integrator integrator;
+	Sampler sampler;
+	// Adaptive sampling. Once a pixel has at least adaptive_min_samples
+	// paths and the standard error of its mean luminance, relative to the
+	// mean, drops below adaptive_threshold, it gets no more paths. The paths
+	// it would have gotten go to the pixels that are still noisy instead.
+	bool adaptive_sampling;
+	float adaptive_threshold;
+	int adaptive_min_samples;
+	// Let diffuse bounces see a prefiltered level of the environment map
+	// through their BRDF samples, instead of sampling it as a light (see
+	// filtersEnvironment()). Small bright features then light them
+	// smoothly, but blurred.
+	bool filter_environment;
+	// Embree BVH options, read when the scene is created (by the first
+	// addModel()) and when each model is added. A high quality BVH takes
+	// longer to build but traces faster, a compact one takes about half
+	// the memory but traces slower, and robust traversal avoids missing
+	// hits on the edges between triangles at some cost in speed.
+	bool bvh_high_quality;
+	bool bvh_compact;
+	bool bvh_robust;
+	GeometryUsage geometry_usage;
+	// Show the image through the denoiser (see denoiser.h). The color sigma
+	// is how many standard errors of a pixel's mean two colors may differ
+	// by and still be blended.
+	bool denoise;
+	int denoise_iterations;
+	float denoise_color_sigma;
+	// How paths end and split (see termination.h). Russian roulette starts
+	// after roulette_min_bounces bounces, and splitting keeps the
+	// throughput of each branch below split_threshold.
+	bool russian_roulette;
+	int roulette_min_bounces;
+	bool path_splitting;
+	float split_threshold;
+	// The AOVs to write, as a mask of aovBit()s. The denoiser's guides
+	// (DENOISER_AOVS) are also written while settings.denoise is set.
+	// Changing the set restarts the image.
+	uint32_t aovs;
 } settings;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -32,7 +113,12 @@ extern struct Settings
 extern struct Environment
 {
 	float multiplier;
+	// The image as loaded, in latitude-longitude layout
 	HDRImage map;
+	// The same resampled for lookups and importance sampling
+	EnvironmentMap octahedral;
+	// Load a latitude-longitude .hdr image and resample it
+	void load(const std::string& filename);
 } environment;
 
 ///////////////////////////////////////////////////////////////////////////
@@ -40,8 +126,23 @@ extern struct Environment
 ///////////////////////////////////////////////////////////////////////////
 extern struct Image
 {
+	// number_of_samples counts passes. Without adaptive sampling every
+	// pass traces one path per pixel.
 	int width, height, number_of_samples = 0;
 	std::vector<glm::vec3> data;
+	// Number of paths accumulated into each pixel
+	std::vector<int> sample_count;
+	// The paths of a pixel are numbered from first_sample on (see
+	// randomStream()), so that processes that each render a range of a
+	// pixel's paths never repeat each other's random numbers
+	int first_sample = 0;
+	// Sum of squared deviations from the mean luminance of each pixel, used
+	// to estimate its variance
+	std::vector<float> luminance_m2;
+	// The enabled AOVs, averaged like data
+	AOVBuffer aovs;
+	// Number of pixels that were traced in the last pass
+	int active_pixels = 0;
 	float* getPtr()
 	{
 		return &data[0].x;
@@ -59,18 +160,41 @@ extern struct PointLight
 } point_light;
 
 ///////////////////////////////////////////////////////////////////////////
-// Restart rendering of image
+// Restart rendering of image. May be called from any thread: a pass in
+// progress on another thread is cancelled, and the next pass starts over.
 ///////////////////////////////////////////////////////////////////////////
 void restart();
 
 ///////////////////////////////////////////////////////////////////////////
 // On window resize, window size is passed in, actual size of pathtraced
-// image may be smaller (if we're subsampling for speed)
+// image may be smaller (if we're subsampling for speed). The first version
+// subsamples by settings.subsampling.
 ///////////////////////////////////////////////////////////////////////////
 void resize(int w, int h);
+void resize(int w, int h, int subsampling);
+
+///////////////////////////////////////////////////////////////////////////
+// Keep what is in rendered_image (restored from a checkpoint, say) as the
+// image of the current view, so that the next pass adds to it instead of
+// starting over. Must be called on the thread that calls tracePaths().
+///////////////////////////////////////////////////////////////////////////
+void continueImage();
+
+///////////////////////////////////////////////////////////////////////////
+// The AOVs that tracePaths() writes with the current settings
+///////////////////////////////////////////////////////////////////////////
+uint32_t activeAOVs();
+
+///////////////////////////////////////////////////////////////////////////
+// Trace one path per pixel. Returns false if no pass was completed,
+// because the image is already done or because restart() was called
+// while tracing.
+///////////////////////////////////////////////////////////////////////////
+bool tracePaths(const mat4& V, const mat4& P);
 
 ///////////////////////////////////////////////////////////////////////////
-// Trace one path per pixel
+// Debug view of the rendered image, coloring each pixel from blue (few
+// paths) to red (the most paths of any pixel) by its sample count.
 ///////////////////////////////////////////////////////////////////////////
-void tracePaths(const mat4& V, const mat4& P);
+void sampleCountHeatmap(const std::vector<int>& sample_count, std::vector<glm::vec3>& heatmap);
 }; // namespace pathtracer
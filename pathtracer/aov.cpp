@@ -0,0 +1,111 @@
+#include "aov.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+int aovChannels(AOV aov)
+{
+	switch(aov)
+	{
+	case AOV_NORMAL:
+	case AOV_ALBEDO:
+	case AOV_DIRECT:
+	case AOV_INDIRECT:
+		return 3;
+	default:
+		return 1;
+	}
+}
+
+const char* aovName(AOV aov)
+{
+	static const char* names[NUMBER_OF_AOVS] = { "depth",  "normal",   "albedo",     "material",
+	                                             "direct", "indirect", "samplecount" };
+	return names[aov];
+}
+
+void AOVBuffer::resize(int number_of_pixels, uint32_t enabled_aovs)
+{
+	enabled = enabled_aovs;
+	for(int aov = 0; aov < int(NUMBER_OF_AOVS); aov++)
+	{
+		for(int c = 0; c < 3; c++)
+		{
+			vector<float>& p = planes[aov][c];
+			if(has(AOV(aov)) && c < aovChannels(AOV(aov)))
+			{
+				p.resize(number_of_pixels);
+			}
+			else
+			{
+				p.clear();
+				p.shrink_to_fit();
+			}
+		}
+	}
+}
+
+void AOVBuffer::accumulate(int pixel, int n, const PathAOVs& path, const vec3& color)
+{
+	if(enabled == 0)
+		return;
+	const float a = float(n) / float(n + 1), b = 1.0f / float(n + 1);
+	auto average = [&](AOV aov, const vec3& value) {
+		if(!has(aov))
+			return;
+		for(int c = 0; c < aovChannels(aov); c++)
+		{
+			float& mean = planes[aov][c][pixel];
+			mean = mean * a + b * value[c];
+		}
+	};
+	average(AOV_DEPTH, vec3(path.depth));
+	average(AOV_NORMAL, path.normal);
+	average(AOV_ALBEDO, path.albedo);
+	average(AOV_DIRECT, path.direct);
+	average(AOV_INDIRECT, color - path.direct);
+	if(has(AOV_MATERIAL_ID) && n == 0)
+		planes[AOV_MATERIAL_ID][0][pixel] = path.material_id;
+	if(has(AOV_SAMPLE_COUNT))
+		planes[AOV_SAMPLE_COUNT][0][pixel] = float(n + 1);
+}
+
+void AOVBuffer::merge(int pixel, int n, const AOVBuffer& other, int m)
+{
+	if(enabled == 0 || m == 0)
+		return;
+	const float a = float(n) / float(n + m), b = float(m) / float(n + m);
+	for(AOV aov : { AOV_DEPTH, AOV_NORMAL, AOV_ALBEDO, AOV_DIRECT, AOV_INDIRECT })
+	{
+		if(!has(aov))
+			continue;
+		for(int c = 0; c < aovChannels(aov); c++)
+		{
+			float& mean = planes[aov][c][pixel];
+			mean = mean * a + b * other.planes[aov][c][pixel];
+		}
+	}
+	if(has(AOV_MATERIAL_ID) && n == 0)
+		planes[AOV_MATERIAL_ID][0][pixel] = other.planes[AOV_MATERIAL_ID][0][pixel];
+	if(has(AOV_SAMPLE_COUNT))
+		planes[AOV_SAMPLE_COUNT][0][pixel] = float(n + m);
+}
+
+void AOVBuffer::toRGB(AOV aov, vector<vec3>& rgb) const
+{
+	const vector<float>& r = planes[aov][0];
+	rgb.resize(r.size());
+	if(aovChannels(aov) == 1)
+	{
+		for(size_t i = 0; i < r.size(); i++)
+			rgb[i] = vec3(r[i]);
+		return;
+	}
+	const vector<float>& g = planes[aov][1];
+	const vector<float>& b = planes[aov][2];
+	for(size_t i = 0; i < r.size(); i++)
+		rgb[i] = vec3(r[i], g[i], b[i]);
+}
+} // namespace pathtracer
@@ -0,0 +1,101 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Arbitrary output variables: planes written next to the color of the
+// rendered image, so that the parts of an image can be inspected or
+// composited separately. Each is enabled by its bit (aovBit()) in
+// settings.aovs.
+///////////////////////////////////////////////////////////////////////////
+enum AOV : uint32_t
+{
+	// Distance along the primary ray to the first hit, zero for misses
+	AOV_DEPTH,
+	// World space shading normal at the first hit, zero for misses
+	AOV_NORMAL,
+	// Color of the first hit's material, or the environment's radiance
+	AOV_ALBEDO,
+	// Index of the first hit's material, -1 for misses. IDs can't be
+	// averaged, so this is the ID seen by the first path of the pixel.
+	AOV_MATERIAL_ID,
+	// Light that reaches the camera with at most one bounce: emission and
+	// environment seen directly, and light arriving at the first hit
+	// straight from a light source or the environment
+	AOV_DIRECT,
+	// Everything else, so that direct + indirect is the image
+	AOV_INDIRECT,
+	// Number of paths traced for the pixel
+	AOV_SAMPLE_COUNT,
+	NUMBER_OF_AOVS
+};
+
+inline uint32_t aovBit(AOV aov)
+{
+	return 1u << aov;
+}
+
+// The AOVs that the denoiser is guided by
+const uint32_t DENOISER_AOVS = (1u << AOV_DEPTH) | (1u << AOV_NORMAL) | (1u << AOV_ALBEDO);
+
+// Number of channels (1 or 3) and a short name for files and options
+int aovChannels(AOV aov);
+const char* aovName(AOV aov);
+
+///////////////////////////////////////////////////////////////////////////
+// What one path adds to the AOVs of its pixel, filled in by the
+// integrators along with the path's radiance
+///////////////////////////////////////////////////////////////////////////
+struct PathAOVs
+{
+	glm::vec3 albedo = glm::vec3(0.0f);
+	glm::vec3 normal = glm::vec3(0.0f);
+	float depth = 0.0f;
+	float material_id = -1.0f;
+	glm::vec3 direct = glm::vec3(0.0f);
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The enabled AOVs of an image, stored as one plane of floats per channel
+// so that filters and exporters can stream through a single channel.
+///////////////////////////////////////////////////////////////////////////
+struct AOVBuffer
+{
+	uint32_t enabled = 0;
+	// planes[aov][channel][pixel], empty for AOVs that are not enabled
+	std::vector<float> planes[NUMBER_OF_AOVS][3];
+
+	// Allocate the planes of the enabled AOVs and free the others
+	void resize(int number_of_pixels, uint32_t enabled_aovs);
+	bool has(AOV aov) const
+	{
+		return (enabled & aovBit(aov)) != 0;
+	}
+	const float* plane(AOV aov, int channel) const
+	{
+		return planes[aov][channel].data();
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Add a path with radiance color to the running averages of a pixel
+	// that already has n paths. Must be called before the sample count of
+	// the pixel is incremented, like the color.
+	///////////////////////////////////////////////////////////////////////
+	void accumulate(int pixel, int n, const PathAOVs& path, const glm::vec3& color);
+
+	///////////////////////////////////////////////////////////////////////
+	// Merge the averages of m paths of a pixel in another buffer, with the
+	// same AOVs, into this pixel's averages of n paths. The material ID is
+	// the first path's, so other should hold the later paths.
+	///////////////////////////////////////////////////////////////////////
+	void merge(int pixel, int n, const AOVBuffer& other, int m);
+
+	///////////////////////////////////////////////////////////////////////
+	// One AOV as an RGB image, single channels repeated in all three
+	///////////////////////////////////////////////////////////////////////
+	void toRGB(AOV aov, std::vector<glm::vec3>& rgb) const;
+};
+} // namespace pathtracer
@@ -0,0 +1,305 @@
+#include "checkpoint.h"
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+#include "Pathtracer.h"
+#include "embree.h"
+#include "hash.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+static const char CHECKPOINT_MAGIC[8] = { 'P', 'T', 'C', 'K', 'P', 'T', '\0', '\0' };
+static const uint32_t CHECKPOINT_VERSION = 1;
+
+struct CheckpointHeader
+{
+	char magic[8];
+	uint32_t version;
+	int32_t width, height;
+	// rendered_image.number_of_samples
+	int32_t number_of_passes;
+	// The enabled AOVs, whose planes follow the others
+	uint32_t aovs;
+	uint32_t unused;
+	uint64_t hash;
+};
+static_assert(sizeof(CheckpointHeader) == 40, "The checkpoint header should not have any padding");
+
+///////////////////////////////////////////////////////////////////////////
+// A copy of rendered_image, as written to and read from a file
+///////////////////////////////////////////////////////////////////////////
+struct Snapshot
+{
+	CheckpointHeader header;
+	vector<vec3> data;
+	vector<int> sample_count;
+	vector<float> luminance_m2;
+	AOVBuffer aovs;
+};
+
+uint64_t renderHash(const mat4& V, const mat4& P)
+{
+	uint64_t hash = getSceneHash();
+	auto add = [&](const void* data, size_t size) { hash = hashBytes(data, size, hash); };
+	add(&V, sizeof(V));
+	add(&P, sizeof(P));
+	add(&rendered_image.width, sizeof(rendered_image.width));
+	add(&rendered_image.height, sizeof(rendered_image.height));
+	add(&settings.max_bounces, sizeof(settings.max_bounces));
+	// The integrators compute the same estimate, but not in the same order
+	add(&settings.integrator, sizeof(settings.integrator));
+	add(&settings.sampler, sizeof(settings.sampler));
+	add(&settings.adaptive_sampling, sizeof(settings.adaptive_sampling));
+	add(&settings.adaptive_threshold, sizeof(settings.adaptive_threshold));
+	add(&settings.adaptive_min_samples, sizeof(settings.adaptive_min_samples));
+	add(&settings.filter_environment, sizeof(settings.filter_environment));
+	add(&settings.russian_roulette, sizeof(settings.russian_roulette));
+	add(&settings.roulette_min_bounces, sizeof(settings.roulette_min_bounces));
+	add(&settings.path_splitting, sizeof(settings.path_splitting));
+	add(&settings.split_threshold, sizeof(settings.split_threshold));
+	// Results with other AOVs can't be merged
+	const uint32_t aovs = activeAOVs();
+	add(&aovs, sizeof(aovs));
+	add(&environment.multiplier, sizeof(environment.multiplier));
+	if(!environment.octahedral.levels.empty())
+	{
+		const vector<vec3>& texels = environment.octahedral.levels[0];
+		add(texels.data(), texels.size() * sizeof(vec3));
+	}
+	add(&point_light.intensity_multiplier, sizeof(point_light.intensity_multiplier));
+	add(&point_light.color, sizeof(point_light.color));
+	add(&point_light.position, sizeof(point_light.position));
+	return hash;
+}
+
+static void takeSnapshot(Snapshot& snapshot, uint64_t hash)
+{
+	memcpy(snapshot.header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	snapshot.header.version = CHECKPOINT_VERSION;
+	snapshot.header.width = rendered_image.width;
+	snapshot.header.height = rendered_image.height;
+	snapshot.header.number_of_passes = rendered_image.number_of_samples;
+	snapshot.header.aovs = rendered_image.aovs.enabled;
+	snapshot.header.unused = 0;
+	snapshot.header.hash = hash;
+	snapshot.data = rendered_image.data;
+	snapshot.sample_count = rendered_image.sample_count;
+	snapshot.luminance_m2 = rendered_image.luminance_m2;
+	snapshot.aovs = rendered_image.aovs;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Move a file over another, replacing it in one step where the platform
+// allows
+///////////////////////////////////////////////////////////////////////////
+static bool replaceFile(const string& from, const string& to)
+{
+#if defined(_WIN32)
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+static bool writeSnapshot(const Snapshot& snapshot, const string& filename)
+{
+	const string temporary = filename + ".tmp";
+	{
+		ofstream file(temporary, ios::binary);
+		uint64_t checksum = FNV_OFFSET;
+		auto write = [&](const void* data, size_t size) {
+			file.write(static_cast<const char*>(data), size);
+			checksum = hashBytes(data, size, checksum);
+		};
+		write(&snapshot.header, sizeof(snapshot.header));
+		write(snapshot.data.data(), snapshot.data.size() * sizeof(vec3));
+		write(snapshot.sample_count.data(), snapshot.sample_count.size() * sizeof(int));
+		write(snapshot.luminance_m2.data(), snapshot.luminance_m2.size() * sizeof(float));
+		for(int aov = 0; aov < int(NUMBER_OF_AOVS); aov++)
+		{
+			if(!snapshot.aovs.has(AOV(aov)))
+				continue;
+			for(int c = 0; c < aovChannels(AOV(aov)); c++)
+			{
+				const vector<float>& plane = snapshot.aovs.planes[aov][c];
+				write(plane.data(), plane.size() * sizeof(float));
+			}
+		}
+		file.write(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+		if(!file)
+		{
+			cout << "Failed to write checkpoint: " << temporary << ".\n";
+			return false;
+		}
+	}
+	if(!replaceFile(temporary, filename))
+	{
+		cout << "Failed to replace checkpoint: " << filename << ".\n";
+		return false;
+	}
+	return true;
+}
+
+bool saveCheckpoint(const string& filename, uint64_t hash)
+{
+	Snapshot snapshot;
+	takeSnapshot(snapshot, hash);
+	return writeSnapshot(snapshot, filename);
+}
+
+bool loadCheckpoint(const string& filename, uint64_t hash)
+{
+	ifstream file(filename, ios::binary);
+	if(!file)
+		return false;
+	Snapshot snapshot;
+	CheckpointHeader& header = snapshot.header;
+	uint64_t checksum = FNV_OFFSET;
+	auto read = [&](void* data, size_t size) {
+		file.read(static_cast<char*>(data), size);
+		checksum = hashBytes(data, size, checksum);
+		return bool(file);
+	};
+	if(!read(&header, sizeof(header)) || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0
+	   || header.version != CHECKPOINT_VERSION)
+	{
+		cout << filename << " is not a checkpoint.\n";
+		return false;
+	}
+	if(header.hash != hash || header.width != rendered_image.width || header.height != rendered_image.height
+	   || header.aovs != activeAOVs())
+	{
+		cout << filename << " is a checkpoint of another scene, view or settings.\n";
+		return false;
+	}
+
+	const size_t number_of_pixels = size_t(header.width) * header.height;
+	snapshot.data.resize(number_of_pixels);
+	snapshot.sample_count.resize(number_of_pixels);
+	snapshot.luminance_m2.resize(number_of_pixels);
+	snapshot.aovs.resize(int(number_of_pixels), header.aovs);
+	bool ok = read(snapshot.data.data(), number_of_pixels * sizeof(vec3))
+	          && read(snapshot.sample_count.data(), number_of_pixels * sizeof(int))
+	          && read(snapshot.luminance_m2.data(), number_of_pixels * sizeof(float));
+	for(int aov = 0; aov < int(NUMBER_OF_AOVS) && ok; aov++)
+	{
+		if(!snapshot.aovs.has(AOV(aov)))
+			continue;
+		for(int c = 0; c < aovChannels(AOV(aov)) && ok; c++)
+			ok = read(snapshot.aovs.planes[aov][c].data(), number_of_pixels * sizeof(float));
+	}
+	uint64_t stored_checksum = 0;
+	file.read(reinterpret_cast<char*>(&stored_checksum), sizeof(stored_checksum));
+	if(!ok || !file || stored_checksum != checksum)
+	{
+		cout << filename << " is damaged or incomplete.\n";
+		return false;
+	}
+
+	rendered_image.data = std::move(snapshot.data);
+	rendered_image.sample_count = std::move(snapshot.sample_count);
+	rendered_image.luminance_m2 = std::move(snapshot.luminance_m2);
+	rendered_image.aovs = std::move(snapshot.aovs);
+	rendered_image.number_of_samples = header.number_of_passes;
+	continueImage();
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The background writer. The rendering thread fills pending_snapshot
+// while the writer is idle, and the writer swaps it with the snapshot it
+// writes from, so neither ever waits on the other's work.
+///////////////////////////////////////////////////////////////////////////
+static thread writer_thread;
+static mutex writer_lock;
+static condition_variable writer_wakeup;
+static bool writer_stop = false;
+static bool snapshot_pending = false;
+static bool writer_busy = false;
+static Snapshot pending_snapshot, writing_snapshot;
+static string checkpoint_filename;
+static uint64_t checkpoint_hash = 0;
+static float checkpoint_interval = 0.0f;
+static chrono::steady_clock::time_point last_checkpoint;
+
+static void writerLoop()
+{
+	unique_lock<mutex> lock(writer_lock);
+	for(;;)
+	{
+		writer_wakeup.wait(lock, [] { return snapshot_pending || writer_stop; });
+		if(!snapshot_pending)
+			return;
+		swap(pending_snapshot, writing_snapshot);
+		snapshot_pending = false;
+		writer_busy = true;
+		lock.unlock();
+		const auto start_time = chrono::steady_clock::now();
+		if(writeSnapshot(writing_snapshot, checkpoint_filename))
+		{
+			cout << "Checkpoint of " << writing_snapshot.header.number_of_passes << " passes written to "
+			     << checkpoint_filename << " in "
+			     << chrono::duration<float>(chrono::steady_clock::now() - start_time).count() << " s\n";
+		}
+		lock.lock();
+		writer_busy = false;
+	}
+}
+
+void startCheckpointWriter(const string& filename, uint64_t hash, float interval)
+{
+	checkpoint_filename = filename;
+	checkpoint_hash = hash;
+	checkpoint_interval = interval;
+	last_checkpoint = chrono::steady_clock::now();
+	writer_stop = false;
+	writer_thread = thread(writerLoop);
+}
+
+void checkpointPass()
+{
+	if(!writer_thread.joinable())
+		return;
+	const auto now = chrono::steady_clock::now();
+	if(chrono::duration<float>(now - last_checkpoint).count() < checkpoint_interval)
+		return;
+	{
+		lock_guard<mutex> guard(writer_lock);
+		if(snapshot_pending || writer_busy)
+			return;
+	}
+	takeSnapshot(pending_snapshot, checkpoint_hash);
+	{
+		lock_guard<mutex> guard(writer_lock);
+		snapshot_pending = true;
+	}
+	writer_wakeup.notify_one();
+	last_checkpoint = now;
+}
+
+void stopCheckpointWriter()
+{
+	if(!writer_thread.joinable())
+		return;
+	{
+		lock_guard<mutex> guard(writer_lock);
+		writer_stop = true;
+	}
+	writer_wakeup.notify_one();
+	writer_thread.join();
+}
+} // namespace pathtracer
@@ -0,0 +1,55 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Checkpoints of a render in progress. A checkpoint holds everything the
+// next pass depends on: the running averages of every pixel (color,
+// luminance variance and AOVs), the per pixel sample counts and the pass
+// count. The random numbers of a path only depend on its pixel and the
+// pixel's sample count (see randomStream()), so a render resumed from a
+// checkpoint continues bit for bit like the one that wrote it.
+//
+// The file is a small header followed by the raw planes, in the order of
+// the header's fields, and ends with a checksum of all of it so that a
+// file cut short is never resumed from.
+///////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////
+// A hash of everything that decides what a render converges to: the
+// scene (see getSceneHash()), the camera, the image size, the settings
+// that change the estimate and the AOVs written. A checkpoint only
+// resumes a render with the same hash.
+///////////////////////////////////////////////////////////////////////////
+uint64_t renderHash(const glm::mat4& V, const glm::mat4& P);
+
+///////////////////////////////////////////////////////////////////////////
+// Write rendered_image to a checkpoint right away. The file is written
+// next to filename first and then moved over it, so an existing
+// checkpoint is only replaced by a complete one.
+///////////////////////////////////////////////////////////////////////////
+bool saveCheckpoint(const std::string& filename, uint64_t hash);
+
+///////////////////////////////////////////////////////////////////////////
+// Restore rendered_image from a checkpoint, which must have been written
+// with the same hash, image size and AOVs, and keep it (continueImage())
+// for the current view. Call after resize(). Returns false, and leaves the
+// image alone, if the file is missing, damaged or from another render.
+///////////////////////////////////////////////////////////////////////////
+bool loadCheckpoint(const std::string& filename, uint64_t hash);
+
+///////////////////////////////////////////////////////////////////////////
+// Write checkpoints in the background while rendering. checkpointPass()
+// is called after each completed pass, and once interval seconds have
+// passed since the last checkpoint it copies the image and hands the copy
+// to a writer thread. The copy is all the rendering thread waits for. If
+// the writer is still busy with the last checkpoint, the pass is skipped.
+// stopCheckpointWriter() waits for the write in progress to finish.
+///////////////////////////////////////////////////////////////////////////
+void startCheckpointWriter(const std::string& filename, uint64_t hash, float interval);
+void checkpointPass();
+void stopCheckpointWriter();
+} // namespace pathtracer
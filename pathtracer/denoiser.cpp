@@ -0,0 +1,259 @@
+#include "denoiser.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <omp.h>
+#include "scheduler.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////////
+// Global variables
+///////////////////////////////////////////////////////////////////////////////
+DenoiseStats denoise_stats;
+
+///////////////////////////////////////////////////////////////////////////
+// Each task filters a square tile of pixels of this size
+///////////////////////////////////////////////////////////////////////////
+static const int DENOISE_TILE_SIZE = 64;
+
+///////////////////////////////////////////////////////////////////////////
+// Weights. Added to the albedo before it is divided out, so that black
+// surfaces keep their radiance. The normal weight is dot(n_p, n_q)^128,
+// taken by squaring seven times. The depth weight allows neighbours one
+// step apart to differ by DEPTH_SIGMA of the center pixel's depth.
+///////////////////////////////////////////////////////////////////////////
+static const float ALBEDO_EPSILON = 1e-3f;
+static const int NORMAL_SQUARINGS = 7;
+static const float DEPTH_SIGMA = 0.05f;
+
+// The 1D B3-spline kernel, the 2D kernel is its outer product
+static const float KERNEL[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+///////////////////////////////////////////////////////////////////////////
+// The image as planes of floats, one per channel, like the AOVs that
+// guide it, so that the inner loops walk contiguous memory along a row
+// and vectorize
+///////////////////////////////////////////////////////////////////////////
+struct Planes
+{
+	vector<float> r, g, b;
+	void resize(size_t n)
+	{
+		r.resize(n);
+		g.resize(n);
+		b.resize(n);
+	}
+};
+// The radiance divided by albedo, filtered back and forth between the two
+static Planes irradiance[2];
+// One over the color difference at which a tap's weight drops to 1/e
+static vector<float> inverse_sigma;
+// One over the depth, taken once rather than for every tap
+static vector<float> inverse_depth;
+
+static float luminance(float r, float g, float b)
+{
+	return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// exp(-x) for x >= 0, to a relative error of about 1e-5. Unlike exp(),
+// which is a library call, it is straight-line arithmetic, so the tap
+// loop below vectorizes. Goes through 2^t = 2^i * 2^f with i the nearest
+// integer, and a Taylor polynomial for 2^f with f in [-0.5, 0.5]. Results
+// below about 1e-35 are clamped there. x is clamped with a mask on its
+// bits, which order like the values for x >= 0. With a min, g++ folds the
+// clamped case to a constant behind a branch, and leaves the rest of the
+// math, which may trap, on the other side where it can't be if-converted.
+///////////////////////////////////////////////////////////////////////////
+static inline float expNegative(float x)
+{
+	const float max_x = 80.0f;
+	int x_bits, max_bits;
+	memcpy(&x_bits, &x, sizeof(x_bits));
+	memcpy(&max_bits, &max_x, sizeof(max_bits));
+	const int difference = x_bits - max_bits;
+	x_bits = max_bits + (difference & (difference >> 31));
+	memcpy(&x, &x_bits, sizeof(x));
+	const float t = -1.442695041f * x;
+	// Rounds, as t - 0.5 is negative and the conversion truncates
+	const int i = int(t - 0.5f);
+	const float f = (t - float(i)) * 0.693147181f;
+	const float p = 1.0f + f * (1.0f + f * (0.5f + f * (1.0f / 6.0f + f * (1.0f / 24.0f + f * (1.0f / 120.0f)))));
+	const int bits = (i + 127) << 23;
+	float scale;
+	memcpy(&scale, &bits, sizeof(scale));
+	return p * scale;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// One a-trous iteration over a tile, with taps step pixels apart
+///////////////////////////////////////////////////////////////////////////
+static void filterTile(const Tile& tile, const AOVBuffer& guides, int width, int height, int step,
+                       float sigma_scale, const Planes& in, Planes& out)
+{
+	float sum_r[DENOISE_TILE_SIZE], sum_g[DENOISE_TILE_SIZE], sum_b[DENOISE_TILE_SIZE];
+	float sum_w[DENOISE_TILE_SIZE];
+	const float* in_r = in.r.data();
+	const float* in_g = in.g.data();
+	const float* in_b = in.b.data();
+	const float* nx = guides.plane(AOV_NORMAL, 0);
+	const float* ny = guides.plane(AOV_NORMAL, 1);
+	const float* nz = guides.plane(AOV_NORMAL, 2);
+	const float* z = guides.plane(AOV_DEPTH, 0);
+	const float* inv_z = inverse_depth.data();
+	const float* inv_sigma = inverse_sigma.data();
+	const float inv_depth_sigma = 1.0f / (DEPTH_SIGMA * float(step));
+	for(int y = tile.y0; y < tile.y1; y++)
+	{
+		const int row = y * width;
+		// The center tap always counts fully
+		const float center = KERNEL[2] * KERNEL[2];
+		for(int x = tile.x0; x < tile.x1; x++)
+		{
+			const int i = x - tile.x0;
+			sum_r[i] = center * in_r[row + x];
+			sum_g[i] = center * in_g[row + x];
+			sum_b[i] = center * in_b[row + x];
+			sum_w[i] = center;
+		}
+		for(int ky = 0; ky < 5; ky++)
+		{
+			const int dy = (ky - 2) * step;
+			if(y + dy < 0 || y + dy >= height)
+				continue;
+			for(int kx = 0; kx < 5; kx++)
+			{
+				if(kx == 2 && ky == 2)
+					continue;
+				const int dx = (kx - 2) * step;
+				// Only the pixels whose tap lands inside the image
+				const int x0 = std::max(tile.x0, -dx);
+				const int x1 = std::min(tile.x1, width - dx);
+				const int offset = dy * width + dx;
+				const float k = KERNEL[kx] * KERNEL[ky];
+				for(int x = x0; x < x1; x++)
+				{
+					const int p = row + x;
+					const int q = p + offset;
+					const int i = x - tile.x0;
+					// max(cos, 0) without a branch, see expNegative()
+					const float cos_normal = nx[p] * nx[q] + ny[p] * ny[q] + nz[p] * nz[q];
+					float w_normal = 0.5f * (cos_normal + abs(cos_normal));
+					for(int s = 0; s < NORMAL_SQUARINGS; s++)
+						w_normal *= w_normal;
+					const float d_depth = abs(z[p] - z[q]) * inv_depth_sigma * inv_z[p];
+					const float l_p = luminance(in_r[p], in_g[p], in_b[p]);
+					const float l_q = luminance(in_r[q], in_g[q], in_b[q]);
+					const float d_color = abs(l_p - l_q) * inv_sigma[p] * sigma_scale;
+					const float w = k * w_normal * expNegative(d_color + d_depth);
+					sum_r[i] += w * in_r[q];
+					sum_g[i] += w * in_g[q];
+					sum_b[i] += w * in_b[q];
+					sum_w[i] += w;
+				}
+			}
+		}
+		for(int x = tile.x0; x < tile.x1; x++)
+		{
+			const int i = x - tile.x0;
+			const float inv_w = 1.0f / sum_w[i];
+			out.r[row + x] = sum_r[i] * inv_w;
+			out.g[row + x] = sum_g[i] * inv_w;
+			out.b[row + x] = sum_b[i] * inv_w;
+		}
+	}
+}
+
+void denoise(const Image& image, vector<vec3>& result)
+{
+	const double start = omp_get_wtime();
+	const AOVBuffer& guides = image.aovs;
+	if((guides.enabled & DENOISER_AOVS) != DENOISER_AOVS)
+	{
+		// Not rendered with the guides, pass the image through
+		result = image.data;
+		return;
+	}
+	const int width = image.width, height = image.height;
+	const int number_of_pixels = width * height;
+	for(auto& planes : irradiance)
+		planes.resize(number_of_pixels);
+	inverse_sigma.resize(number_of_pixels);
+	inverse_depth.resize(number_of_pixels);
+	const float* albedo_r = guides.plane(AOV_ALBEDO, 0);
+	const float* albedo_g = guides.plane(AOV_ALBEDO, 1);
+	const float* albedo_b = guides.plane(AOV_ALBEDO, 2);
+	const float* depth = guides.plane(AOV_DEPTH, 0);
+
+	///////////////////////////////////////////////////////////////////////
+	// Split the color into planes and divide out the albedo. The noise of
+	// a pixel is the standard error of its mean luminance, as estimated
+	// for adaptive sampling. Pixels with fewer than two paths have no
+	// estimate, and are then only held back by the normals and depths.
+	///////////////////////////////////////////////////////////////////////
+#pragma omp parallel for schedule(static)
+	for(int p = 0; p < number_of_pixels; p++)
+	{
+		const vec3 albedo = vec3(albedo_r[p], albedo_g[p], albedo_b[p]) + vec3(ALBEDO_EPSILON);
+		const vec3 e = image.data[p] / albedo;
+		irradiance[0].r[p] = e.r;
+		irradiance[0].g[p] = e.g;
+		irradiance[0].b[p] = e.b;
+		inverse_depth[p] = 1.0f / std::max(depth[p], 1e-4f);
+		const int n = image.sample_count[p];
+		if(n < 2)
+		{
+			inverse_sigma[p] = 0.0f;
+			continue;
+		}
+		const float standard_error = sqrt(image.luminance_m2[p] / float(n - 1) / float(n));
+		const float albedo_luminance = luminance(albedo.r, albedo.g, albedo.b);
+		const float sigma = settings.denoise_color_sigma * standard_error / albedo_luminance;
+		inverse_sigma[p] = 1.0f / std::max(sigma, 1e-4f);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Filter, doubling the step and halving the color sigma each
+	// iteration, since the image gets smoother as it goes
+	///////////////////////////////////////////////////////////////////////
+	const int tiles_x = (width + DENOISE_TILE_SIZE - 1) / DENOISE_TILE_SIZE;
+	const int tiles_y = (height + DENOISE_TILE_SIZE - 1) / DENOISE_TILE_SIZE;
+	int current = 0;
+	for(int iteration = 0; iteration < settings.denoise_iterations; iteration++)
+	{
+		const int step = 1 << iteration;
+		const float sigma_scale = float(step);
+		const Planes& in = irradiance[current];
+		Planes& out = irradiance[1 - current];
+#pragma omp parallel for schedule(dynamic, 1)
+		for(int t = 0; t < tiles_x * tiles_y; t++)
+		{
+			Tile tile;
+			tile.x0 = (t % tiles_x) * DENOISE_TILE_SIZE;
+			tile.y0 = (t / tiles_x) * DENOISE_TILE_SIZE;
+			tile.x1 = std::min(tile.x0 + DENOISE_TILE_SIZE, width);
+			tile.y1 = std::min(tile.y0 + DENOISE_TILE_SIZE, height);
+			filterTile(tile, guides, width, height, step, sigma_scale, in, out);
+		}
+		current = 1 - current;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Multiply the albedo back in
+	///////////////////////////////////////////////////////////////////////
+	result.resize(number_of_pixels);
+	const Planes& filtered = irradiance[current];
+#pragma omp parallel for schedule(static)
+	for(int p = 0; p < number_of_pixels; p++)
+	{
+		const vec3 albedo = vec3(albedo_r[p], albedo_g[p], albedo_b[p]) + vec3(ALBEDO_EPSILON);
+		result[p] = albedo * vec3(filtered.r[p], filtered.g[p], filtered.b[p]);
+	}
+	denoise_stats.time = float((omp_get_wtime() - start) * 1000.0);
+}
+} // namespace pathtracer
@@ -0,0 +1,33 @@
+#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+#include "Pathtracer.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Time taken by the last denoise(), in milliseconds
+///////////////////////////////////////////////////////////////////////////
+extern struct DenoiseStats
+{
+	float time = 0.0f;
+} denoise_stats;
+
+///////////////////////////////////////////////////////////////////////////
+// Filter the noise out of an image with the edge-avoiding a-trous wavelet
+// transform (Dammertz et al. 2010). Each iteration blurs with a 5x5
+// B3-spline kernel whose taps are spread 2^i pixels apart, so that a few
+// iterations of 25 taps each cover a large footprint. A tap is weighted
+// down where its first hit normal or depth differs from the center
+// pixel's, or where its color differs by more than the noise of the
+// center pixel explains, so edges stay sharp. The radiance is divided by
+// the first hit albedo before filtering and multiplied back afterwards,
+// so that textures are not blurred along with the lighting.
+//
+// Reads the DENOISER_AOVS of the image, and passes the image through
+// unchanged if they were not rendered. Uses settings.denoise_iterations
+// and settings.denoise_color_sigma. result may be image.data. Not
+// reentrant: the working buffers are shared between calls.
+///////////////////////////////////////////////////////////////////////////
+void denoise(const Image& image, std::vector<glm::vec3>& result);
+} // namespace pathtracer
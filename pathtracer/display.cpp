@@ -0,0 +1,389 @@
+#include "display.h"
+#include <GL/glew.h>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////////
+// Global variables
+///////////////////////////////////////////////////////////////////////////////
+DisplaySettings display_settings;
+DisplayStats display_stats;
+
+///////////////////////////////////////////////////////////////////////////
+// Number of pixel buffers in the ring. The CPU fills one while the GPU
+// may still be copying out of the others.
+///////////////////////////////////////////////////////////////////////////
+static const int NUMBER_OF_PBOS = 3;
+
+static struct DisplayState
+{
+	GLuint texture = 0;
+	GLuint pbo[NUMBER_OF_PBOS] = {};
+	// Where each buffer is mapped, if mapped persistently
+	void* mapped[NUMBER_OF_PBOS] = {};
+	// Signalled when the GPU is done copying out of each buffer
+	GLsync fence[NUMBER_OF_PBOS] = {};
+	int next_pbo = 0;
+	bool persistent = false;
+	// What the texture currently holds
+	int width = 0, height = 0;
+	DisplaySettings settings;
+	bool raw = false;
+	vector<uint32_t> tile_version;
+} state;
+
+///////////////////////////////////////////////////////////////////////////
+// sRGB encoding of x in [0, 1]. The curve 1.055 * x^(1/2.4) - 0.055 is a
+// polynomial in u = x^(1/4), fitted for minimax error over the range it is
+// used in, and the result is within 4e-5 of the exact encoding. Written
+// with arithmetic and integer operations only, so that the loop over a row
+// in packTile() vectorizes: a table would need a gather, g++ keeps a
+// branch for errno around sqrt(), and a branch between the linear segment
+// and the curve is not if-converted, as the float math may trap.
+///////////////////////////////////////////////////////////////////////////
+static inline int floatBits(float x)
+{
+	int bits;
+	memcpy(&bits, &x, sizeof(bits));
+	return bits;
+}
+
+static inline float bitsFloat(int bits)
+{
+	float x;
+	memcpy(&x, &bits, sizeof(x));
+	return x;
+}
+
+// 1 / sqrt(x) for x >= 0, from a guess made on the bits and two Newton
+// steps, to a relative error of about 5e-6
+static inline float inverseSqrt(float x)
+{
+	float y = bitsFloat(0x5f375a86 - (floatBits(x) >> 1));
+	y = y * (1.5f - 0.5f * x * y * y);
+	y = y * (1.5f - 0.5f * x * y * y);
+	return y;
+}
+
+static float encodeSRGB(float x)
+{
+	const float s = x * inverseSqrt(x);
+	const float u = s * inverseSqrt(s);
+	const float curve =
+	    -0.0646129404f + u * (0.196144961f + u * (1.12266253f + u * (-0.335486497f + u * 0.0813265061f)));
+	const float linear = 12.92f * x;
+	// All ones below the threshold, as the bits of x >= 0 order like x
+	const int mask = (floatBits(x) - floatBits(0.0031308f)) >> 31;
+	return bitsFloat((floatBits(linear) & mask) | (floatBits(curve) & ~mask));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Round a float to half precision. Values too small for a normal half
+// become zero and values too large become infinity.
+///////////////////////////////////////////////////////////////////////////
+static uint16_t floatToHalf(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	const uint32_t sign = (x >> 16) & 0x8000u;
+	x &= 0x7fffffffu;
+	if(x >= 0x477ff000u)
+		return uint16_t(sign | 0x7c00u);
+	if(x < 0x38800000u)
+		return uint16_t(sign);
+	// Rebias the exponent from 127 to 15 and round the mantissa
+	return uint16_t(sign | ((x - 0x38000000u + 0x1000u) >> 13));
+}
+
+static bool sameSettings(const DisplaySettings& a, const DisplaySettings& b)
+{
+	return a.tonemap == b.tonemap && a.exposure == b.exposure && a.srgb == b.srgb && a.format == b.format;
+}
+
+static int bytesPerPixel(DisplayFormat format)
+{
+	return format == DisplayFormat::RGBA8 ? 4 : 8;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Texture and buffers
+///////////////////////////////////////////////////////////////////////////
+static void destroyBuffers()
+{
+	for(int i = 0; i < NUMBER_OF_PBOS; i++)
+	{
+		if(state.fence[i] != nullptr)
+		{
+			glDeleteSync(state.fence[i]);
+			state.fence[i] = nullptr;
+		}
+		if(state.mapped[i] != nullptr)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, state.pbo[i]);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			state.mapped[i] = nullptr;
+		}
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if(state.pbo[0] != 0)
+		glDeleteBuffers(NUMBER_OF_PBOS, state.pbo);
+	memset(state.pbo, 0, sizeof(state.pbo));
+}
+
+static void createTextureAndBuffers(int width, int height, DisplayFormat format)
+{
+	destroyDisplay();
+	const GLenum internal_format = format == DisplayFormat::RGBA8 ? GL_RGBA8 : GL_RGBA16F;
+	glGenTextures(1, &state.texture);
+	glBindTexture(GL_TEXTURE_2D, state.texture);
+	if(GLEW_ARB_texture_storage)
+	{
+		glTexStorage2D(GL_TEXTURE_2D, 1, internal_format, width, height);
+	}
+	else
+	{
+		const GLenum type = format == DisplayFormat::RGBA8 ? GL_UNSIGNED_BYTE : GL_HALF_FLOAT;
+		glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, GL_RGBA, type, nullptr);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+	// Each buffer has room for the whole image, laid out like the texture,
+	// so that a tile is copied from the same place it is written to
+	const GLsizeiptr size = GLsizeiptr(width) * height * bytesPerPixel(format);
+	state.persistent = GLEW_ARB_buffer_storage != 0;
+	glGenBuffers(NUMBER_OF_PBOS, state.pbo);
+	for(int i = 0; i < NUMBER_OF_PBOS; i++)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, state.pbo[i]);
+		if(state.persistent)
+		{
+			const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+			state.mapped[i] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+		}
+		else
+		{
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+		}
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	state.width = width;
+	state.height = height;
+}
+
+// max(x, 0) without a branch, for the same reason as in encodeSRGB()
+static inline float positive(float x)
+{
+	return 0.5f * (x + abs(x));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Tonemap, encode and pack one tile into a buffer laid out like the
+// texture. Each row goes through a few simple loops over its floats, which
+// the compiler turns into SIMD code.
+///////////////////////////////////////////////////////////////////////////
+static void packTile(int x0, int y0, int x1, int y1, const vec3* data, bool raw, uint8_t* buffer)
+{
+	const DisplaySettings& s = state.settings;
+	const float scale = raw ? 1.0f : exp2(s.exposure);
+	const Tonemap tonemap = raw ? Tonemap::Clamp : s.tonemap;
+	const int n = 3 * (x1 - x0);
+	float row[3 * DISPLAY_TILE_SIZE];
+	for(int y = y0; y < y1; y++)
+	{
+		const float* in = &data[y * state.width + x0].x;
+		switch(tonemap)
+		{
+		case Tonemap::Clamp:
+			for(int i = 0; i < n; i++)
+				row[i] = std::max(0.0f, std::min(in[i] * scale, 1.0f));
+			break;
+		case Tonemap::Reinhard:
+			for(int i = 0; i < n; i++)
+			{
+				const float v = positive(in[i] * scale);
+				row[i] = v / (1.0f + v);
+			}
+			break;
+		case Tonemap::ACES:
+			for(int i = 0; i < n; i++)
+			{
+				const float v = positive(in[i] * scale);
+				const float aces = (v * (2.51f * v + 0.03f)) / (v * (2.43f * v + 0.59f) + 0.14f);
+				row[i] = std::min(aces, 1.0f);
+			}
+			break;
+		}
+		if(s.srgb && !raw)
+		{
+			for(int i = 0; i < n; i++)
+				row[i] = encodeSRGB(row[i]);
+		}
+		const size_t offset = size_t(y * state.width + x0) * bytesPerPixel(s.format);
+		if(s.format == DisplayFormat::RGBA8)
+		{
+			uint8_t* out = buffer + offset;
+			for(int x = 0; x < x1 - x0; x++)
+			{
+				out[4 * x + 0] = uint8_t(row[3 * x + 0] * 255.0f + 0.5f);
+				out[4 * x + 1] = uint8_t(row[3 * x + 1] * 255.0f + 0.5f);
+				out[4 * x + 2] = uint8_t(row[3 * x + 2] * 255.0f + 0.5f);
+				out[4 * x + 3] = 255;
+			}
+		}
+		else
+		{
+			uint16_t* out = reinterpret_cast<uint16_t*>(buffer + offset);
+			for(int x = 0; x < x1 - x0; x++)
+			{
+				out[4 * x + 0] = floatToHalf(row[3 * x + 0]);
+				out[4 * x + 1] = floatToHalf(row[3 * x + 1]);
+				out[4 * x + 2] = floatToHalf(row[3 * x + 2]);
+				out[4 * x + 3] = 0x3c00; // 1.0
+			}
+		}
+	}
+}
+
+void uploadDisplayImage(int width, int height, const vec3* data, const uint32_t* tile_version, bool raw)
+{
+	const int tiles_x = (width + DISPLAY_TILE_SIZE - 1) / DISPLAY_TILE_SIZE;
+	const int tiles_y = (height + DISPLAY_TILE_SIZE - 1) / DISPLAY_TILE_SIZE;
+
+	///////////////////////////////////////////////////////////////////////
+	// Find the tiles to upload. The texture is immutable, so a new size or
+	// format needs a new one.
+	///////////////////////////////////////////////////////////////////////
+	const bool new_texture = state.texture == 0 || width != state.width || height != state.height
+	                         || display_settings.format != state.settings.format;
+	const bool all = new_texture || tile_version == nullptr || raw != state.raw
+	                 || !sameSettings(display_settings, state.settings);
+	if(new_texture)
+		createTextureAndBuffers(width, height, display_settings.format);
+	state.settings = display_settings;
+	state.raw = raw;
+	state.tile_version.resize(tiles_x * tiles_y);
+	vector<char> dirty(tiles_x * tiles_y);
+	vector<int> dirty_tiles;
+	for(int t = 0; t < tiles_x * tiles_y; t++)
+	{
+		dirty[t] = all || tile_version[t] != state.tile_version[t];
+		if(dirty[t])
+			dirty_tiles.push_back(t);
+		if(tile_version != nullptr)
+			state.tile_version[t] = tile_version[t];
+	}
+	if(dirty_tiles.empty())
+		return;
+	display_stats.total_tiles = tiles_x * tiles_y;
+	display_stats.uploaded_tiles = 0;
+	display_stats.uploaded_bytes = 0;
+
+	///////////////////////////////////////////////////////////////////////
+	// Pack the tiles into the next buffer of the ring, once the GPU is done
+	// with what was copied out of it last time around
+	///////////////////////////////////////////////////////////////////////
+	const int b = state.next_pbo;
+	state.next_pbo = (state.next_pbo + 1) % NUMBER_OF_PBOS;
+	const size_t size = size_t(width) * height * bytesPerPixel(state.settings.format);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, state.pbo[b]);
+	uint8_t* buffer;
+	if(state.persistent)
+	{
+		if(state.fence[b] != nullptr)
+		{
+			const GLuint64 one_second = 1000000000;
+			while(glClientWaitSync(state.fence[b], GL_SYNC_FLUSH_COMMANDS_BIT, one_second) == GL_TIMEOUT_EXPIRED)
+			{
+			}
+			glDeleteSync(state.fence[b]);
+			state.fence[b] = nullptr;
+		}
+		buffer = static_cast<uint8_t*>(state.mapped[b]);
+	}
+	else
+	{
+		// Let the driver orphan the old storage instead of waiting for the
+		// GPU to finish with it
+		buffer = static_cast<uint8_t*>(
+		    glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+	}
+	const double start = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic, 1)
+	for(int i = 0; i < int(dirty_tiles.size()); i++)
+	{
+		const int t = dirty_tiles[i];
+		const int x0 = (t % tiles_x) * DISPLAY_TILE_SIZE, y0 = (t / tiles_x) * DISPLAY_TILE_SIZE;
+		packTile(x0, y0, std::min(x0 + DISPLAY_TILE_SIZE, width), std::min(y0 + DISPLAY_TILE_SIZE, height), data,
+		         raw, buffer);
+	}
+	display_stats.pack_time = float((omp_get_wtime() - start) * 1000.0);
+	if(!state.persistent)
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	///////////////////////////////////////////////////////////////////////
+	// Copy to the texture, one call per run of dirty tiles in a tile row
+	///////////////////////////////////////////////////////////////////////
+	const int bpp = bytesPerPixel(state.settings.format);
+	const GLenum type = state.settings.format == DisplayFormat::RGBA8 ? GL_UNSIGNED_BYTE : GL_HALF_FLOAT;
+	glBindTexture(GL_TEXTURE_2D, state.texture);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+	for(int ty = 0; ty < tiles_y; ty++)
+	{
+		for(int tx = 0; tx < tiles_x;)
+		{
+			if(!dirty[ty * tiles_x + tx])
+			{
+				tx++;
+				continue;
+			}
+			int end = tx;
+			while(end < tiles_x && dirty[ty * tiles_x + end])
+				end++;
+			const int x0 = tx * DISPLAY_TILE_SIZE, y0 = ty * DISPLAY_TILE_SIZE;
+			const int x1 = std::min(end * DISPLAY_TILE_SIZE, width);
+			const int y1 = std::min(y0 + DISPLAY_TILE_SIZE, height);
+			const size_t offset = (size_t(y0) * width + x0) * bpp;
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x0, y0, x1 - x0, y1 - y0, GL_RGBA, type,
+			                reinterpret_cast<const void*>(offset));
+			display_stats.uploaded_tiles += end - tx;
+			display_stats.uploaded_bytes += size_t(x1 - x0) * (y1 - y0) * bpp;
+			tx = end;
+		}
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if(state.persistent)
+		state.fence[b] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	display_stats.persistent = state.persistent;
+}
+
+uint32_t getDisplayTexture()
+{
+	return state.texture;
+}
+
+void destroyDisplay()
+{
+	destroyBuffers();
+	if(state.texture != 0)
+	{
+		glDeleteTextures(1, &state.texture);
+		state.texture = 0;
+	}
+	state.width = state.height = 0;
+	state.next_pbo = 0;
+}
+} // namespace pathtracer
@@ -0,0 +1,79 @@
+#pragma once
+#include <cstdint>
+#include <glm/glm.hpp>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The display is updated in square tiles of this size. The render thread
+// versions its tiles on the same grid (see DisplayImage::tile_version).
+///////////////////////////////////////////////////////////////////////////
+const int DISPLAY_TILE_SIZE = 64;
+
+enum class Tonemap
+{
+	// Clamp to [0, 1]
+	Clamp,
+	// x / (1 + x), which never saturates
+	Reinhard,
+	// Narkowicz' fit of the ACES filmic curve
+	ACES
+};
+
+enum class DisplayFormat
+{
+	// 8 bits per channel, 4 bytes per pixel
+	RGBA8,
+	// Half floats, 8 bytes per pixel but no banding in dark gradients
+	RGBA16F
+};
+
+///////////////////////////////////////////////////////////////////////////
+// How the pathtraced image is turned into what is shown. The image is
+// scaled by 2^exposure, tonemapped, sRGB encoded and packed on the CPU,
+// so the texture holds display ready values.
+///////////////////////////////////////////////////////////////////////////
+extern struct DisplaySettings
+{
+	Tonemap tonemap = Tonemap::Clamp;
+	float exposure = 0.0f;
+	bool srgb = true;
+	DisplayFormat format = DisplayFormat::RGBA8;
+} display_settings;
+
+///////////////////////////////////////////////////////////////////////////
+// What the last uploadDisplayImage() that had anything to upload did
+///////////////////////////////////////////////////////////////////////////
+extern struct DisplayStats
+{
+	int uploaded_tiles = 0;
+	int total_tiles = 0;
+	size_t uploaded_bytes = 0;
+	// Time spent tonemapping and packing, in milliseconds
+	float pack_time = 0.0f;
+	// True if the PBOs are persistently mapped (GL_ARB_buffer_storage)
+	bool persistent = false;
+} display_stats;
+
+///////////////////////////////////////////////////////////////////////////
+// Update the display texture from an image. Only the tiles whose
+// tile_version differs from the last upload are packed and uploaded;
+// pass nullptr to upload all of them. Everything is uploaded again if the
+// size or the display settings change. A raw image (like the sample
+// count heatmap) is only packed, without exposure or tonemapping. The
+// packed tiles are written into a ring of pixel buffer objects and copied
+// to the texture from there, so the driver can do the copy while the
+// next frame is prepared. Must be called with the GL context current.
+///////////////////////////////////////////////////////////////////////////
+void uploadDisplayImage(int width, int height, const glm::vec3* data, const uint32_t* tile_version, bool raw);
+
+///////////////////////////////////////////////////////////////////////////
+// The texture holding the image, 0 before the first upload
+///////////////////////////////////////////////////////////////////////////
+uint32_t getDisplayTexture();
+
+///////////////////////////////////////////////////////////////////////////
+// Free the texture and buffers
+///////////////////////////////////////////////////////////////////////////
+void destroyDisplay();
+} // namespace pathtracer
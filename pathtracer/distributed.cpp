@@ -0,0 +1,536 @@
+#include "distributed.h"
+#include <iostream>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <signal.h>
+#endif
+#include "Pathtracer.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The little of the socket API that differs between Winsock and POSIX
+///////////////////////////////////////////////////////////////////////////
+#if defined(_WIN32)
+typedef SOCKET Socket;
+static const Socket NO_SOCKET = INVALID_SOCKET;
+static void closeSocket(Socket s)
+{
+	closesocket(s);
+}
+static void shutdownSocket(Socket s)
+{
+	shutdown(s, SD_BOTH);
+}
+#else
+typedef int Socket;
+static const Socket NO_SOCKET = -1;
+static void closeSocket(Socket s)
+{
+	close(s);
+}
+static void shutdownSocket(Socket s)
+{
+	shutdown(s, SHUT_RDWR);
+}
+#endif
+
+static bool startSockets()
+{
+#if defined(_WIN32)
+	static bool started = false;
+	if(!started)
+	{
+		WSADATA data;
+		started = WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	}
+	return started;
+#else
+	// A peer that goes away should fail the send, not kill the process
+	signal(SIGPIPE, SIG_IGN);
+	return true;
+#endif
+}
+
+// The messages are small, so send them right away instead of waiting for
+// more to fill a packet
+static void setNoDelay(Socket s)
+{
+	int on = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));
+}
+
+static bool sendAll(Socket s, const void* data, size_t size)
+{
+	const char* bytes = static_cast<const char*>(data);
+	while(size > 0)
+	{
+		const int chunk = int(std::min(size, size_t(1 << 20)));
+		const int sent = int(send(s, bytes, chunk, 0));
+		if(sent <= 0)
+			return false;
+		bytes += sent;
+		size -= size_t(sent);
+	}
+	return true;
+}
+
+static bool receiveAll(Socket s, void* data, size_t size)
+{
+	char* bytes = static_cast<char*>(data);
+	while(size > 0)
+	{
+		const int chunk = int(std::min(size, size_t(1 << 20)));
+		const int received = int(recv(s, bytes, chunk, 0));
+		if(received <= 0)
+			return false;
+		bytes += received;
+		size -= size_t(received);
+	}
+	return true;
+}
+
+static Socket listenOn(int port)
+{
+	Socket s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(s == NO_SOCKET)
+		return NO_SOCKET;
+	int on = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&on), sizeof(on));
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(uint16_t(port));
+	if(::bind(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(s, 16) != 0)
+	{
+		closeSocket(s);
+		return NO_SOCKET;
+	}
+	return s;
+}
+
+static Socket connectTo(const string& host, int port)
+{
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	addrinfo* addresses = nullptr;
+	if(getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &addresses) != 0)
+		return NO_SOCKET;
+	Socket s = NO_SOCKET;
+	for(addrinfo* a = addresses; a != nullptr && s == NO_SOCKET; a = a->ai_next)
+	{
+		s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if(s != NO_SOCKET && connect(s, a->ai_addr, int(a->ai_addrlen)) != 0)
+		{
+			closeSocket(s);
+			s = NO_SOCKET;
+		}
+	}
+	freeaddrinfo(addresses);
+	return s;
+}
+
+// Wait up to timeout_ms for a connection, NO_SOCKET if none came
+static Socket acceptWithin(Socket listener, int timeout_ms)
+{
+	fd_set ready;
+	FD_ZERO(&ready);
+	FD_SET(listener, &ready);
+	timeval timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+	if(select(int(listener + 1), &ready, nullptr, nullptr, &timeout) <= 0)
+		return NO_SOCKET;
+	return accept(listener, nullptr, nullptr);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The protocol. A worker and the coordinator first exchange a Hello and
+// hang up unless their hashes match. Then the coordinator sends a job and
+// the worker answers with its result, until a job of zero passes tells
+// the worker that there is no more work.
+///////////////////////////////////////////////////////////////////////////
+static const uint32_t PROTOCOL_MAGIC = 0x50544457; // "PTDW"
+static const uint32_t PROTOCOL_VERSION = 1;
+
+struct Hello
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t hash;
+};
+
+struct Job
+{
+	int32_t first_pass;
+	int32_t passes;
+};
+
+// Followed by the planes of the result, in the order of JobResult
+struct ResultHeader
+{
+	int32_t first_pass;
+	int32_t passes;
+	int32_t number_of_pixels;
+	uint32_t aovs;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The averages and sample counts of the paths of one job
+///////////////////////////////////////////////////////////////////////////
+struct JobResult
+{
+	Job job;
+	vector<vec3> data;
+	vector<int> sample_count;
+	vector<float> luminance_m2;
+	AOVBuffer aovs;
+};
+
+template<typename T>
+static bool sendVector(Socket s, const vector<T>& v)
+{
+	return sendAll(s, v.data(), v.size() * sizeof(T));
+}
+
+template<typename T>
+static bool receiveVector(Socket s, vector<T>& v, size_t size)
+{
+	v.resize(size);
+	return receiveAll(s, v.data(), size * sizeof(T));
+}
+
+static bool sendHello(Socket s, uint64_t hash)
+{
+	const Hello hello = { PROTOCOL_MAGIC, PROTOCOL_VERSION, hash };
+	return sendAll(s, &hello, sizeof(hello));
+}
+
+static bool receiveHello(Socket s, uint64_t hash)
+{
+	Hello hello;
+	return receiveAll(s, &hello, sizeof(hello)) && hello.magic == PROTOCOL_MAGIC
+	       && hello.version == PROTOCOL_VERSION && hello.hash == hash;
+}
+
+// Send the job just rendered into rendered_image
+static bool sendResult(Socket s, const Job& job)
+{
+	const Image& image = rendered_image;
+	const ResultHeader header = { job.first_pass, job.passes, int32_t(image.data.size()), image.aovs.enabled };
+	bool ok = sendAll(s, &header, sizeof(header)) && sendVector(s, image.data) && sendVector(s, image.sample_count)
+	          && sendVector(s, image.luminance_m2);
+	for(int aov = 0; aov < int(NUMBER_OF_AOVS) && ok; aov++)
+	{
+		for(int c = 0; c < aovChannels(AOV(aov)) && ok && image.aovs.has(AOV(aov)); c++)
+			ok = sendVector(s, image.aovs.planes[aov][c]);
+	}
+	return ok;
+}
+
+static bool receiveResult(Socket s, const Job& job, JobResult& result)
+{
+	const Image& image = rendered_image;
+	ResultHeader header;
+	if(!receiveAll(s, &header, sizeof(header)) || header.first_pass != job.first_pass
+	   || header.passes != job.passes || size_t(header.number_of_pixels) != image.data.size()
+	   || header.aovs != image.aovs.enabled)
+	{
+		return false;
+	}
+	const size_t n = size_t(header.number_of_pixels);
+	result.job = job;
+	result.aovs.resize(int(n), header.aovs);
+	bool ok = receiveVector(s, result.data, n) && receiveVector(s, result.sample_count, n)
+	          && receiveVector(s, result.luminance_m2, n);
+	for(int aov = 0; aov < int(NUMBER_OF_AOVS) && ok; aov++)
+	{
+		for(int c = 0; c < aovChannels(AOV(aov)) && ok && result.aovs.has(AOV(aov)); c++)
+			ok = receiveVector(s, result.aovs.planes[aov][c], n);
+	}
+	return ok;
+}
+
+static float luminance(const vec3& color)
+{
+	return dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add the paths of a job to rendered_image. The averages are weighted by
+// the paths on each side and the sums of squared deviations combined
+// with Chan et al.'s parallel form of Welford's update.
+///////////////////////////////////////////////////////////////////////////
+static void mergeResult(const JobResult& result)
+{
+	Image& image = rendered_image;
+	const int number_of_pixels = int(image.data.size());
+#pragma omp parallel for
+	for(int i = 0; i < number_of_pixels; i++)
+	{
+		const int n = image.sample_count[i], m = result.sample_count[i];
+		if(m == 0)
+			continue;
+		const float a = float(n) / float(n + m), b = float(m) / float(n + m);
+		const float delta = luminance(result.data[i]) - luminance(image.data[i]);
+		image.luminance_m2[i] += result.luminance_m2[i] + delta * delta * float(n) * b;
+		image.data[i] = image.data[i] * a + b * result.data[i];
+		image.aovs.merge(i, n, result.aovs, m);
+		image.sample_count[i] = n + m;
+	}
+	image.number_of_samples += result.job.passes;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// What the coordinator's connections share
+///////////////////////////////////////////////////////////////////////////
+struct Coordinator
+{
+	mutex lock;
+	condition_variable changed;
+	uint64_t hash;
+	int passes;
+	float time_budget;
+	int passes_per_job;
+	chrono::steady_clock::time_point start_time;
+	// First pass of the next new job
+	int next_pass = 0;
+	// Jobs of workers that went away, to be handed out again
+	vector<Job> lost_jobs;
+	// Results that wait for the ones before them to be merged
+	map<int, unique_ptr<JobResult>> finished;
+	// Connections that have not said hello yet
+	vector<Socket> greeting;
+	int workers = 0;
+
+	// Whether new jobs are still handed out
+	bool handingOut() const
+	{
+		if(passes > 0 && next_pass >= passes)
+			return false;
+		return time_budget <= 0.0f
+		       || chrono::duration<float>(chrono::steady_clock::now() - start_time).count() < time_budget;
+	}
+	bool done() const
+	{
+		return !handingOut() && lost_jobs.empty() && rendered_image.number_of_samples == next_pass;
+	}
+	// The next job, or one of zero passes once everything is merged.
+	// Waits while only other workers' jobs are left, since they may be
+	// lost and need someone to take them over.
+	Job nextJob(unique_lock<mutex>& guard)
+	{
+		changed.wait(guard, [&] { return handingOut() || !lost_jobs.empty() || done(); });
+		Job job = { 0, 0 };
+		if(!lost_jobs.empty())
+		{
+			job = lost_jobs.back();
+			lost_jobs.pop_back();
+		}
+		else if(handingOut())
+		{
+			job.first_pass = next_pass;
+			job.passes = passes > 0 ? std::min(passes_per_job, passes - next_pass) : passes_per_job;
+			next_pass += job.passes;
+		}
+		return job;
+	}
+	void finish(unique_ptr<JobResult> result)
+	{
+		finished[result->job.first_pass] = std::move(result);
+		while(!finished.empty() && finished.begin()->first == rendered_image.number_of_samples)
+		{
+			mergeResult(*finished.begin()->second);
+			finished.erase(finished.begin());
+		}
+	}
+};
+
+static void serveWorker(Coordinator& coordinator, Socket s, int worker)
+{
+	const bool greeted = receiveHello(s, coordinator.hash);
+	{
+		lock_guard<mutex> guard(coordinator.lock);
+		auto& greeting = coordinator.greeting;
+		greeting.erase(std::remove(greeting.begin(), greeting.end(), s), greeting.end());
+	}
+	if(!greeted || !sendHello(s, coordinator.hash))
+	{
+		cout << "Worker " << worker << " renders another scene, view or settings, and was turned away.\n";
+		// Closed now rather than with the others at the end, so that the
+		// worker does not wait for the whole render
+		shutdownSocket(s);
+		return;
+	}
+	setNoDelay(s);
+	cout << "Worker " << worker << " connected.\n";
+	int jobs = 0;
+	for(;;)
+	{
+		Job job;
+		{
+			unique_lock<mutex> guard(coordinator.lock);
+			job = coordinator.nextJob(guard);
+		}
+		if(job.passes == 0)
+		{
+			sendAll(s, &job, sizeof(job));
+			break;
+		}
+		unique_ptr<JobResult> result(new JobResult);
+		if(!sendAll(s, &job, sizeof(job)) || !receiveResult(s, job, *result))
+		{
+			cout << "Worker " << worker << " went away, passes " << job.first_pass << " to "
+			     << job.first_pass + job.passes - 1 << " will be rendered again.\n";
+			// A worker whose result was rejected is still waiting for a job
+			shutdownSocket(s);
+			lock_guard<mutex> guard(coordinator.lock);
+			coordinator.lost_jobs.push_back(job);
+			coordinator.changed.notify_all();
+			return;
+		}
+		{
+			lock_guard<mutex> guard(coordinator.lock);
+			coordinator.finish(std::move(result));
+			coordinator.changed.notify_all();
+		}
+		jobs++;
+	}
+	cout << "Worker " << worker << " is done after " << jobs << " jobs.\n";
+}
+
+bool coordinateRender(int port, uint64_t hash, int passes, float time_budget, int passes_per_job)
+{
+	if(!startSockets())
+		return false;
+	Socket listener = listenOn(port);
+	if(listener == NO_SOCKET)
+	{
+		cout << "Could not listen on port " << port << ".\n";
+		return false;
+	}
+	Image& image = rendered_image;
+	std::fill(image.data.begin(), image.data.end(), vec3(0.0f));
+	std::fill(image.sample_count.begin(), image.sample_count.end(), 0);
+	std::fill(image.luminance_m2.begin(), image.luminance_m2.end(), 0.0f);
+	image.aovs.resize(int(image.data.size()), activeAOVs());
+	image.number_of_samples = 0;
+	image.active_pixels = int(image.data.size());
+
+	Coordinator coordinator;
+	coordinator.hash = hash;
+	coordinator.passes = passes;
+	coordinator.time_budget = time_budget;
+	coordinator.passes_per_job = std::max(1, passes_per_job);
+	coordinator.start_time = chrono::steady_clock::now();
+	cout << "Waiting for workers on port " << port << "..." << endl;
+
+	vector<thread> connections;
+	vector<Socket> sockets;
+	for(;;)
+	{
+		{
+			unique_lock<mutex> guard(coordinator.lock);
+			// Wakes up the workers waiting for a job once the time is up
+			coordinator.changed.notify_all();
+			if(coordinator.done())
+				break;
+		}
+		Socket s = acceptWithin(listener, 100);
+		if(s == NO_SOCKET)
+			continue;
+		sockets.push_back(s);
+		{
+			lock_guard<mutex> guard(coordinator.lock);
+			coordinator.greeting.push_back(s);
+		}
+		connections.emplace_back(serveWorker, std::ref(coordinator), s, ++coordinator.workers);
+	}
+	closeSocket(listener);
+	{
+		// Connections that never said hello would hold up the join
+		lock_guard<mutex> guard(coordinator.lock);
+		for(Socket s : coordinator.greeting)
+			shutdownSocket(s);
+	}
+	for(thread& connection : connections)
+		connection.join();
+	for(Socket s : sockets)
+		closeSocket(s);
+	return true;
+}
+
+bool workForCoordinator(const string& host, int port, uint64_t hash, const mat4& V, const mat4& P)
+{
+	if(!startSockets())
+		return false;
+	Socket s = connectTo(host, port);
+	if(s == NO_SOCKET)
+	{
+		cout << "Could not connect to " << host << ":" << port << ".\n";
+		return false;
+	}
+	setNoDelay(s);
+	if(!sendHello(s, hash) || !receiveHello(s, hash))
+	{
+		cout << "The coordinator renders another scene, view or settings.\n";
+		closeSocket(s);
+		return false;
+	}
+	cout << "Connected to " << host << ":" << port << endl;
+	int jobs = 0, passes = 0;
+	bool ok = true;
+	for(;;)
+	{
+		Job job;
+		if(!receiveAll(s, &job, sizeof(job)))
+		{
+			cout << "Lost the coordinator.\n";
+			ok = false;
+			break;
+		}
+		if(job.passes <= 0)
+			break;
+		// A new image whose paths are numbered from the job's first pass
+		rendered_image.first_sample = job.first_pass;
+		restart();
+		for(int i = 0; i < job.passes; i++)
+			tracePaths(V, P);
+		if(!sendResult(s, job))
+		{
+			cout << "Lost the coordinator.\n";
+			ok = false;
+			break;
+		}
+		jobs++;
+		passes += job.passes;
+	}
+	closeSocket(s);
+	cout << "Rendered " << jobs << " jobs, " << passes << " passes.\n";
+	return ok;
+}
+} // namespace pathtracer
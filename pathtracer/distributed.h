@@ -0,0 +1,41 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Rendering one image with several processes, on one machine or on many.
+// A coordinator hands out jobs, ranges of passes over the whole image, to
+// the workers that connect to it over TCP, and merges the averages and
+// sample counts they send back into rendered_image. Every worker must
+// load the same scene with the same camera and settings, which is checked
+// with renderHash() when it connects.
+//
+// A job's paths are numbered from its first pass (see
+// Image::first_sample), so they draw the same random numbers as the same
+// passes of a single process would. Results are merged in pass order, so
+// the image does not depend on which worker rendered which job or when.
+// Messages are sent in the native byte order, so all processes must run
+// on machines of the same endianness.
+///////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////
+// Listen on a port and hand out jobs of passes_per_job passes, until
+// passes passes (if not 0) are merged, or until time_budget seconds (if
+// not 0) have passed and the jobs handed out by then are merged. The jobs
+// of workers that disconnect are handed out again. rendered_image must
+// have been resized. Returns false if the port can not be listened on.
+///////////////////////////////////////////////////////////////////////////
+bool coordinateRender(int port, uint64_t hash, int passes, float time_budget, int passes_per_job);
+
+///////////////////////////////////////////////////////////////////////////
+// Connect to the coordinator at host:port, then render the jobs it hands
+// out until it has none left. rendered_image must have been resized.
+// Returns false if the coordinator can not be reached, renders something
+// else or goes away before it is done.
+///////////////////////////////////////////////////////////////////////////
+bool workForCoordinator(const std::string& host, int port, uint64_t hash, const glm::mat4& V,
+                        const glm::mat4& P);
+} // namespace pathtracer
@@ -1,7 +1,14 @@
 #include "embree.h"
+#include "lights.h"
+#include "hash.h"
 #include <iostream>
 #include <map>
-
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <chrono>
+#include <algorithm>
 
 using namespace std;
 using namespace glm;
@@ -12,16 +19,194 @@ namespace pathtracer
 // Global variables
 ///////////////////////////////////////////////////////////////////////////
 RTCDevice embree_device;
+// The top level scene, which holds one instance per placed model
 RTCScene embree_scene;
+RTCAlgorithmFlags algorithm_flags;
+int max_packet_size = 1;
+// Whether embree was built with the ray stream API (rtcOccluded1M)
+bool stream_supported = false;
 
 ///////////////////////////////////////////////////////////////////////////
-// Build an acceleration structure for the scene
+// The scene has two levels. Each distinct model is added to an embree
+// scene of its own once (a prototype), with its vertices in model space,
+// and every addModel() places an instance of it, with a transform, in the
+// top level scene.
+//
+// Everything needed to resolve a hit is kept in flat tables. The instance
+// ID of a hit indexes the instances, the geometry ID (within the model)
+// indexes the geometries of its prototype, and each triangle has a packed
+// shading record. The records of a geometry are stored contiguously in
+// primID order, so a hit costs three indexed loads and no searching.
+///////////////////////////////////////////////////////////////////////////
+struct Prototype
+{
+	const labhelper::Model* model;
+	RTCScene scene;
+	// The records of the model's geometries are
+	// geometries[first_geometry ... first_geometry + number_of_geometries)
+	uint32_t first_geometry;
+	uint32_t number_of_geometries;
+	// The index of the model's first material in materials
+	uint32_t first_material;
+	// Filled in when the BVH is built
+	bool built = false;
+	float build_ms = 0.0f;
+	int64_t bvh_bytes = 0;
+};
+vector<Prototype> prototypes;
+// Which prototype each model was added as
+map<const labhelper::Model*, uint32_t> model_prototypes;
+
+struct GeometryRecord
+{
+	const labhelper::Mesh* mesh;
+	// Index of the shading record of primitive 0
+	uint32_t first_triangle;
+	// Index into materials
+	uint32_t material;
+};
+vector<GeometryRecord> geometries;
+vector<TriangleShading> triangle_shading;
+
+struct InstanceRecord
+{
+	uint32_t prototype;
+	// prototypes[prototype].first_geometry, to save a load on every hit
+	uint32_t first_geometry;
+	// The index (see getGeometryIndex()) of the instance's geometry 0
+	uint32_t first_geometry_index;
+	// The model matrix the instance was placed with
+	mat4 transform;
+	// Takes model space normals to world space
+	mat3 normal_matrix;
+};
+// Indexed by the instance's geom_ID in the top level scene
+vector<InstanceRecord> instances;
+uint32_t number_of_geometry_indices = 0;
+
+// The compiled materials of every distinct model, and what they were
+// compiled from
+vector<MaterialRecord> materials;
+vector<const labhelper::Material*> material_sources;
+
+///////////////////////////////////////////////////////////////////////////
+// Embree reports every allocation and free to the memory monitor, which
+// keeps track of how much memory embree holds (BVHs and the buffers it
+// owns).
+///////////////////////////////////////////////////////////////////////////
+static atomic<int64_t> embree_bytes{ 0 };
+static atomic<int64_t> embree_peak_bytes{ 0 };
+
+static bool embreeMemoryMonitor(void*, const ssize_t bytes, const bool)
+{
+	const int64_t total = embree_bytes += bytes;
+	int64_t peak = embree_peak_bytes.load();
+	while(total > peak && !embree_peak_bytes.compare_exchange_weak(peak, total))
+	{
+	}
+	return true; // Never refuse an allocation
+}
+
+static RTCSceneFlags sceneFlags(bool dynamic)
+{
+	int flags = dynamic ? RTC_SCENE_DYNAMIC : RTC_SCENE_STATIC;
+	if(settings.bvh_high_quality)
+		flags |= RTC_SCENE_HIGH_QUALITY;
+	if(settings.bvh_compact)
+		flags |= RTC_SCENE_COMPACT;
+	if(settings.bvh_robust)
+		flags |= RTC_SCENE_ROBUST;
+	return RTCSceneFlags(flags);
+}
+
+static RTCGeometryFlags geometryFlags()
+{
+	switch(settings.geometry_usage)
+	{
+	case GeometryUsage::Deformable:
+		return RTC_GEOMETRY_DEFORMABLE;
+	case GeometryUsage::Dynamic:
+		return RTC_GEOMETRY_DYNAMIC;
+	case GeometryUsage::Static:
+	default:
+		return RTC_GEOMETRY_STATIC;
+	}
+}
+
+static BVHStats bvh_stats;
+
+///////////////////////////////////////////////////////////////////////////
+// Build an acceleration structure for the scene. Each model's BVH is only
+// built once, the first time it is committed, and what it cost is taken
+// from the memory monitor.
 ///////////////////////////////////////////////////////////////////////////
 void buildBVH()
 {
-	cout << "Embree building BVH..." << flush;
+	cout << "Embree building BVH for " << prototypes.size() << " models and " << instances.size()
+	     << " instances..." << flush;
+	const auto start_time = chrono::steady_clock::now();
+	for(auto& prototype : prototypes)
+	{
+		if(prototype.built)
+			continue;
+		const int64_t bytes_before = embree_bytes;
+		const auto model_start_time = chrono::steady_clock::now();
+		rtcCommit(prototype.scene);
+		prototype.build_ms = chrono::duration<float, milli>(chrono::steady_clock::now() - model_start_time).count();
+		prototype.bvh_bytes = embree_bytes - bytes_before;
+		prototype.built = true;
+	}
 	rtcCommit(embree_scene);
 	cout << "done.\n";
+
+	bvh_stats.build_ms = chrono::duration<float, milli>(chrono::steady_clock::now() - start_time).count();
+	bvh_stats.bvh_bytes = 0;
+	for(auto& prototype : prototypes)
+		bvh_stats.bvh_bytes += prototype.bvh_bytes;
+	bvh_stats.triangles = triangle_shading.size();
+	bvh_stats.instances = instances.size();
+	bvh_stats.embree_bytes = embree_bytes;
+	bvh_stats.embree_peak_bytes = embree_peak_bytes;
+
+	cout << "  Flags:" << (settings.bvh_high_quality ? " high quality" : "")
+	     << (settings.bvh_compact ? " compact" : "") << (settings.bvh_robust ? " robust" : "")
+	     << (!settings.bvh_high_quality && !settings.bvh_compact && !settings.bvh_robust ? " default" : "") << "\n";
+	for(auto& prototype : prototypes)
+	{
+		cout << "  " << prototype.model->m_name << ": " << prototype.build_ms << " ms, "
+		     << prototype.bvh_bytes / (1024.0 * 1024.0) << " MB\n";
+		for(uint32_t g = prototype.first_geometry; g < prototype.first_geometry + prototype.number_of_geometries; g++)
+		{
+			cout << "    " << geometries[g].mesh->m_name << ": " << geometries[g].mesh->m_number_of_vertices / 3
+			     << " triangles\n";
+		}
+	}
+	cout << "  Total: " << bvh_stats.triangles << " triangles in " << bvh_stats.instances << " instances, built in "
+	     << bvh_stats.build_ms << " ms, " << bvh_stats.bvh_bytes / (1024.0 * 1024.0) << " MB of BVH, "
+	     << bvh_stats.embree_bytes / (1024.0 * 1024.0) << " MB held by embree (peak "
+	     << bvh_stats.embree_peak_bytes / (1024.0 * 1024.0) << " MB)\n";
+	cout << "Found " << updateLights() << " emissive triangles.\n";
+}
+
+BVHStats getBVHStats()
+{
+	return bvh_stats;
+}
+
+uint64_t getSceneHash()
+{
+	uint64_t hash = FNV_OFFSET;
+	for(const Prototype& prototype : prototypes)
+	{
+		const vector<vec3>& positions = prototype.model->m_positions;
+		hash = hashBytes(positions.data(), positions.size() * sizeof(vec3), hash);
+	}
+	for(const InstanceRecord& instance : instances)
+	{
+		hash = hashBytes(&instance.prototype, sizeof(instance.prototype), hash);
+		hash = hashBytes(&instance.transform, sizeof(instance.transform), hash);
+	}
+	return hashBytes(materials.data(), materials.size() * sizeof(MaterialRecord), hash);
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -34,15 +219,88 @@ void embreeErrorHandler(const RTCError code, const char* str)
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Used to map an Embree geometry ID to our scene Meshes and Materials
+// Add each mesh of a model as a geometry of a new embree scene, in model
+// space, and pack the shading data of its triangles.
 ///////////////////////////////////////////////////////////////////////////
-map<uint32_t, const labhelper::Model*> map_geom_ID_to_model;
-map<uint32_t, const labhelper::Mesh*> map_geom_ID_to_mesh;
+static uint32_t addPrototype(const labhelper::Model* model)
+{
+	Prototype prototype;
+	prototype.model = model;
+	prototype.scene = rtcDeviceNewScene(embree_device, sceneFlags(settings.geometry_usage != GeometryUsage::Static),
+	                                    algorithm_flags);
+	prototype.first_geometry = uint32_t(geometries.size());
+	prototype.number_of_geometries = uint32_t(model->m_meshes.size());
+	geometries.resize(geometries.size() + model->m_meshes.size());
+
+	const uint32_t first_material = uint32_t(materials.size());
+	prototype.first_material = first_material;
+	for(auto& material : model->m_materials)
+	{
+		materials.push_back(compileMaterial(material));
+		material_sources.push_back(&material);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Embree reads vertices 16 bytes at a time, so the 4 bytes after the
+	// last position must be readable. If the model's positions are padded
+	// (labhelper allocates room for one more), every mesh shares them
+	// as they are, and indexes its own three vertices per triangle in them.
+	// Otherwise each mesh gets a padded copy.
+	///////////////////////////////////////////////////////////////////////
+	const vector<vec3>& positions = model->m_positions;
+	const bool share_positions = positions.capacity() > positions.size();
+
+	for(auto& mesh : model->m_meshes)
+	{
+		const uint32_t number_of_triangles = mesh.m_number_of_vertices / 3;
+		uint32_t geom_ID = rtcNewTriangleMesh(prototype.scene, geometryFlags(), number_of_triangles,
+		                                      share_positions ? positions.size() : mesh.m_number_of_vertices);
+		GeometryRecord& geometry = geometries[prototype.first_geometry + geom_ID];
+		geometry.mesh = &mesh;
+		geometry.first_triangle = uint32_t(triangle_shading.size());
+		geometry.material = first_material + mesh.m_material_idx;
+		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i += 3)
+		{
+			TriangleShading triangle;
+			for(int k = 0; k < 3; k++)
+			{
+				triangle.normal[k] = model->m_normals[mesh.m_start_index + i + k];
+				triangle.texture_coordinates[k] = model->m_texture_coordinates[mesh.m_start_index + i + k];
+			}
+			triangle.material = geometry.material;
+			triangle_shading.push_back(triangle);
+		}
+		int* embree_tri_idxs = (int*)rtcMapBuffer(prototype.scene, geom_ID, RTC_INDEX_BUFFER);
+		if(share_positions)
+		{
+			rtcSetBuffer2(prototype.scene, geom_ID, RTC_VERTEX_BUFFER, positions.data(), 0, sizeof(vec3),
+			              positions.size());
+			for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+			{
+				embree_tri_idxs[i] = int(mesh.m_start_index + i);
+			}
+		}
+		else
+		{
+			vec4* embree_vertices = (vec4*)rtcMapBuffer(prototype.scene, geom_ID, RTC_VERTEX_BUFFER);
+			for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+			{
+				embree_vertices[i] = vec4(positions[mesh.m_start_index + i], 1.0f);
+				embree_tri_idxs[i] = i;
+			}
+			rtcUnmapBuffer(prototype.scene, geom_ID, RTC_VERTEX_BUFFER);
+		}
+		rtcUnmapBuffer(prototype.scene, geom_ID, RTC_INDEX_BUFFER);
+	}
+	cout << (share_positions ? "sharing the model's positions..." : "copying positions...") << flush;
+	prototypes.push_back(prototype);
+	return uint32_t(prototypes.size() - 1);
+}
 
 ///////////////////////////////////////////////////////////////////////////
 // Add a model to the embree scene
 ///////////////////////////////////////////////////////////////////////////
-void addModel(const labhelper::Model* model, const mat4& model_matrix)
+uint32_t addModel(const labhelper::Model* model, const mat4& model_matrix)
 {
 	///////////////////////////////////////////////////////////////////////
 	// Lazy initialize embree on first use
@@ -54,65 +312,385 @@ void addModel(const labhelper::Model* model, const mat4& model_matrix)
 		embree_is_initialized = true;
 		embree_device = rtcNewDevice();
 		rtcDeviceSetErrorFunction(embree_device, embreeErrorHandler);
-		embree_scene = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+		rtcDeviceSetMemoryMonitorFunction2(embree_device, embreeMemoryMonitor, nullptr);
+		// Enable every packet size this CPU supports, along with single rays
+		int aflags = RTC_INTERSECT1;
+		if(rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT4))
+		{
+			aflags |= RTC_INTERSECT4;
+			max_packet_size = 4;
+		}
+		if(rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT8))
+		{
+			aflags |= RTC_INTERSECT8;
+			max_packet_size = 8;
+		}
+		if(rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT16))
+		{
+			aflags |= RTC_INTERSECT16;
+			max_packet_size = 16;
+		}
+		if(rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT_STREAM))
+		{
+			aflags |= RTC_INTERSECT_STREAM;
+			stream_supported = true;
+		}
+		// The instanced scenes are traversed with the same packets as the
+		// top level scene, so they need the same flags
+		algorithm_flags = RTCAlgorithmFlags(aflags);
+		// The top level scene is dynamic so that instances can be moved
+		// (see updateInstanceTransform()). The models themselves only are if
+		// settings.geometry_usage says so.
+		embree_scene = rtcDeviceNewScene(embree_device, sceneFlags(true), algorithm_flags);
 	}
 	cout << "done.\n";
 
 	///////////////////////////////////////////////////////////////////////
-	// Transform and add each mesh in the model as a geometry in embree,
-	// and create mappings so that we can connect an embree geom_ID to a
-	// Material.
+	// Add the model itself the first time it is placed, then place an
+	// instance of it.
 	///////////////////////////////////////////////////////////////////////
 	cout << "Adding " << model->m_name << " to embree scene..." << flush;
-	for(auto& mesh : model->m_meshes)
+	auto found = model_prototypes.find(model);
+	if(found == model_prototypes.end())
+		found = model_prototypes.insert(make_pair(model, addPrototype(model))).first;
+	const Prototype& prototype = prototypes[found->second];
+	uint32_t inst_ID = rtcNewInstance2(embree_scene, prototype.scene);
+	rtcSetTransform2(embree_scene, inst_ID, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &model_matrix[0][0]);
+	if(instances.size() <= inst_ID)
+		instances.resize(inst_ID + 1);
+	InstanceRecord& instance = instances[inst_ID];
+	instance.prototype = found->second;
+	instance.first_geometry = prototype.first_geometry;
+	instance.first_geometry_index = number_of_geometry_indices;
+	instance.transform = model_matrix;
+	instance.normal_matrix = transpose(inverse(mat3(model_matrix)));
+	number_of_geometry_indices += prototype.number_of_geometries;
+	cout << "done.\n";
+	return inst_ID;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Scene updates. The GUI asks for new materials and transforms at any
+// time, and the render thread applies them between passes, when no rays
+// are in flight.
+///////////////////////////////////////////////////////////////////////////
+static std::mutex pending_updates_lock;
+// New transforms, by instance ID
+static vector<pair<uint32_t, mat4>> pending_transforms;
+// The compiled materials, and the material of every geometry, as of the
+// last updateMaterials(). Empty if there is nothing to apply.
+static vector<MaterialRecord> pending_materials;
+static vector<uint32_t> pending_geometry_materials;
+static SceneUpdateStats scene_update_stats;
+
+void updateMaterials()
+{
+	// Compiled here, on the thread that edits the materials, so that the
+	// render thread never reads a material while it is being edited
+	vector<MaterialRecord> compiled(material_sources.size());
+	for(size_t i = 0; i < material_sources.size(); i++)
+		compiled[i] = compileMaterial(*material_sources[i]);
+	// A mesh may also have been given another of its model's materials
+	vector<uint32_t> geometry_materials(geometries.size());
+	for(const Prototype& prototype : prototypes)
+	{
+		for(uint32_t g = prototype.first_geometry; g < prototype.first_geometry + prototype.number_of_geometries; g++)
+			geometry_materials[g] = prototype.first_material + geometries[g].mesh->m_material_idx;
+	}
+	lock_guard<std::mutex> guard(pending_updates_lock);
+	pending_materials.swap(compiled);
+	pending_geometry_materials.swap(geometry_materials);
+}
+
+static void applyMaterials(const vector<MaterialRecord>& compiled, const vector<uint32_t>& geometry_materials)
+{
+	// Copied element by element, so that pointers into materials stay valid
+	std::copy(compiled.begin(), compiled.end(), materials.begin());
+	for(uint32_t g = 0; g < geometries.size(); g++)
+	{
+		GeometryRecord& geometry = geometries[g];
+		const uint32_t material = geometry_materials[g];
+		if(geometry.material == material)
+			continue;
+		geometry.material = material;
+		const uint32_t number_of_triangles = geometry.mesh->m_number_of_vertices / 3;
+		for(uint32_t i = 0; i < number_of_triangles; i++)
+			triangle_shading[geometry.first_triangle + i].material = material;
+	}
+}
+
+void updateInstanceTransform(uint32_t instance, const mat4& model_matrix)
+{
+	lock_guard<std::mutex> guard(pending_updates_lock);
+	for(auto& pending : pending_transforms)
 	{
-		uint32_t geom_ID = rtcNewTriangleMesh(embree_scene, RTC_GEOMETRY_STATIC,
-		                                      mesh.m_number_of_vertices / 3, mesh.m_number_of_vertices);
-		map_geom_ID_to_mesh[geom_ID] = &mesh;
-		map_geom_ID_to_model[geom_ID] = model;
-		// Transform and commit vertices
-		vec4* embree_vertices = (vec4*)rtcMapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+		if(pending.first == instance)
 		{
-			embree_vertices[i] = model_matrix * vec4(model->m_positions[mesh.m_start_index + i], 1.0f);
+			pending.second = model_matrix;
+			return;
 		}
-		rtcUnmapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-		// Commit triangle indices
-		int* embree_tri_idxs = (int*)rtcMapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
-		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+	}
+	pending_transforms.push_back(make_pair(instance, model_matrix));
+}
+
+static bool hasEmissiveGeometry(const Prototype& prototype)
+{
+	for(uint32_t g = prototype.first_geometry; g < prototype.first_geometry + prototype.number_of_geometries; g++)
+	{
+		if(materials[geometries[g].material].emission != vec3(0.0f))
+			return true;
+	}
+	return false;
+}
+
+bool commitSceneUpdates()
+{
+	vector<pair<uint32_t, mat4>> updates;
+	vector<MaterialRecord> compiled;
+	vector<uint32_t> geometry_materials;
+	{
+		lock_guard<std::mutex> guard(pending_updates_lock);
+		updates.swap(pending_transforms);
+		compiled.swap(pending_materials);
+		geometry_materials.swap(pending_geometry_materials);
+	}
+	if(updates.empty() && compiled.empty())
+		return false;
+
+	const auto start_time = chrono::steady_clock::now();
+	int moved_instances = 0;
+	// Any material may have become emissive, or stopped being it
+	bool lights_moved = !compiled.empty();
+	if(!compiled.empty())
+		applyMaterials(compiled, geometry_materials);
+	for(auto& update : updates)
+	{
+		const uint32_t inst_ID = update.first;
+		if(inst_ID >= instances.size())
+			continue;
+		InstanceRecord& instance = instances[inst_ID];
+		instance.transform = update.second;
+		instance.normal_matrix = transpose(inverse(mat3(update.second)));
+		rtcSetTransform2(embree_scene, inst_ID, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &update.second[0][0]);
+		rtcUpdate(embree_scene, inst_ID);
+		lights_moved |= hasEmissiveGeometry(prototypes[instance.prototype]);
+		moved_instances++;
+	}
+	// Only the top level BVH, over the instances, is rebuilt
+	if(!updates.empty())
+		rtcCommit(embree_scene);
+	const auto bvh_time = chrono::steady_clock::now();
+	if(lights_moved)
+		updateLights();
+	const auto end_time = chrono::steady_clock::now();
+
+	scene_update_stats.updates++;
+	scene_update_stats.moved_instances = moved_instances;
+	scene_update_stats.bvh_ms = chrono::duration<float, milli>(bvh_time - start_time).count();
+	scene_update_stats.lights_ms = chrono::duration<float, milli>(end_time - bvh_time).count();
+	return true;
+}
+
+SceneUpdateStats getSceneUpdateStats()
+{
+	return scene_update_stats;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Collect every triangle of the meshes with an emissive material, in each
+// instance, so that they can be sampled as light sources.
+///////////////////////////////////////////////////////////////////////////
+size_t updateLights()
+{
+	vector<EmissiveTriangle> triangles;
+	vector<int> geometry_offset(number_of_geometry_indices, -1);
+	for(const InstanceRecord& instance : instances)
+	{
+		const Prototype& prototype = prototypes[instance.prototype];
+		const labhelper::Model* model = prototype.model;
+		const mat4& model_matrix = instance.transform;
+		for(uint32_t geom_ID = 0; geom_ID < prototype.number_of_geometries; geom_ID++)
 		{
-			embree_tri_idxs[i] = i;
+			const GeometryRecord& geometry = geometries[prototype.first_geometry + geom_ID];
+			const MaterialRecord& material = materials[geometry.material];
+			if(material.emission == vec3(0.0f))
+				continue;
+			const labhelper::Mesh* mesh = geometry.mesh;
+			geometry_offset[instance.first_geometry_index + geom_ID] = int(triangles.size());
+			for(uint32_t i = 0; i < mesh->m_number_of_vertices; i += 3)
+			{
+				vec3 p[3];
+				for(int k = 0; k < 3; k++)
+					p[k] = vec3(model_matrix * vec4(model->m_positions[mesh->m_start_index + i + k], 1.0f));
+				EmissiveTriangle triangle;
+				triangle.p0 = p[0];
+				triangle.e1 = p[1] - p[0];
+				triangle.e2 = p[2] - p[0];
+				const vec3 c = cross(triangle.e1, triangle.e2);
+				triangle.area = 0.5f * length(c);
+				// Degenerate triangles get no power, so they are never picked
+				triangle.normal = triangle.area > 0.0f ? normalize(c) : vec3(0.0f, 1.0f, 0.0f);
+				triangle.radiance = triangle.area > 0.0f ? material.emission : vec3(0.0f);
+				triangle.area = std::max(triangle.area, 1e-12f);
+				triangles.push_back(triangle);
+			}
 		}
-		rtcUnmapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
 	}
-	cout << "done.\n";
+	const size_t number_of_triangles = triangles.size();
+	setEmissiveTriangles(std::move(triangles), std::move(geometry_offset));
+	return number_of_triangles;
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Extract an intersection from an embree ray.
+// Extract an intersection from an embree ray. Embree reports the geometry
+// normal in the model space of the instance that was hit, so both normals
+// are taken to world space here.
 ///////////////////////////////////////////////////////////////////////////
 Intersection getIntersection(const Ray& r)
 {
-	const labhelper::Model* model = map_geom_ID_to_model[r.geomID];
-	const labhelper::Mesh* mesh = map_geom_ID_to_mesh[r.geomID];
+	const InstanceRecord& instance = instances[r.instID];
+	const GeometryRecord& geometry = geometries[instance.first_geometry + r.geomID];
+	const TriangleShading& triangle = triangle_shading[geometry.first_triangle + r.primID];
 	Intersection i;
-	i.material = &(model->m_materials[mesh->m_material_idx]);
-	vec3 n0 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-	vec3 n1 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-	vec3 n2 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
-	float w = 1.0f - (r.u + r.v);
-	i.shading_normal = normalize(w * n0 + r.u * n1 + r.v * n2);
-	i.geometry_normal = -normalize(r.n);
+	i.material = &materials[triangle.material];
+	const float w = 1.0f - (r.u + r.v);
+	const vec3 n = w * triangle.normal[0] + r.u * triangle.normal[1] + r.v * triangle.normal[2];
+	i.shading_normal = normalize(instance.normal_matrix * n);
+	i.texture_coordinates = w * triangle.texture_coordinates[0] + r.u * triangle.texture_coordinates[1]
+	                        + r.v * triangle.texture_coordinates[2];
+	i.geometry_normal = -normalize(instance.normal_matrix * r.n);
 	i.position = r.o + r.tfar * r.d;
 	i.wo = normalize(-r.d);
 	return i;
 }
 
+const MaterialRecord* getMaterial(const Ray& r)
+{
+	return &materials[geometries[instances[r.instID].first_geometry + r.geomID].material];
+}
+
+uint32_t getMaterialIndex(const MaterialRecord* material)
+{
+	return uint32_t(material - materials.data());
+}
+
+uint32_t getGeometryIndex(const Ray& r)
+{
+	return instances[r.instID].first_geometry_index + r.geomID;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Resolve every hit a number of times and return the hits per second. Sums
+// up something from every intersection, so that none of the work can be
+// optimized away.
+///////////////////////////////////////////////////////////////////////////
+static volatile float hit_benchmark_checksum;
+
+template <typename Resolve>
+static double timeHitResolution(const vector<Ray>& hits, int repetitions, Resolve resolve)
+{
+	const auto start_time = chrono::steady_clock::now();
+	vec3 sum = vec3(0.0f);
+	for(int k = 0; k < repetitions; k++)
+	{
+		for(const Ray& r : hits)
+		{
+			const Intersection i = resolve(r);
+			sum += i.shading_normal + i.material->color;
+		}
+	}
+	const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+	hit_benchmark_checksum = sum.x + sum.y + sum.z;
+	return double(hits.size()) * repetitions / elapsed;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Resolve the same hits with the flat tables and, as a baseline, the way
+// it used to be done: a std::map from geometry to model and one to mesh,
+// and normals gathered from the model's own arrays.
+///////////////////////////////////////////////////////////////////////////
+HitResolutionBenchmark benchmarkHitResolution(const vector<Ray>& hits, int repetitions)
+{
+	map<uint32_t, const labhelper::Model*> map_geom_ID_to_model;
+	map<uint32_t, const labhelper::Mesh*> map_geom_ID_to_mesh;
+	map<uint32_t, mat3> map_geom_ID_to_normal_matrix;
+	vector<MaterialRecord> geometry_materials(number_of_geometry_indices);
+	for(const InstanceRecord& instance : instances)
+	{
+		const Prototype& prototype = prototypes[instance.prototype];
+		for(uint32_t geom_ID = 0; geom_ID < prototype.number_of_geometries; geom_ID++)
+		{
+			const uint32_t index = instance.first_geometry_index + geom_ID;
+			map_geom_ID_to_model[index] = prototype.model;
+			map_geom_ID_to_mesh[index] = geometries[prototype.first_geometry + geom_ID].mesh;
+			map_geom_ID_to_normal_matrix[index] = instance.normal_matrix;
+			geometry_materials[index] = materials[geometries[prototype.first_geometry + geom_ID].material];
+		}
+	}
+	auto map_lookup = [&](const Ray& r) {
+		const uint32_t index = instances[r.instID].first_geometry_index + r.geomID;
+		const labhelper::Model* model = map_geom_ID_to_model[index];
+		const labhelper::Mesh* mesh = map_geom_ID_to_mesh[index];
+		const mat3& normal_matrix = map_geom_ID_to_normal_matrix[index];
+		Intersection i;
+		i.material = &geometry_materials[index];
+		vec3 n0 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
+		vec3 n1 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
+		vec3 n2 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
+		float w = 1.0f - (r.u + r.v);
+		i.shading_normal = normalize(normal_matrix * (w * n0 + r.u * n1 + r.v * n2));
+		i.geometry_normal = -normalize(normal_matrix * r.n);
+		i.position = r.o + r.tfar * r.d;
+		i.wo = normalize(-r.d);
+		return i;
+	};
+
+	HitResolutionBenchmark result;
+	result.map_hits_per_second = timeHitResolution(hits, repetitions, map_lookup);
+	result.flat_hits_per_second = timeHitResolution(hits, repetitions, getIntersection);
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Ray counting. Every thread increments a counter of its own (only that
+// thread ever writes to it, so no locked instructions are needed on the
+// hot path) and getNumberOfRaysTraced() sums them all up.
+///////////////////////////////////////////////////////////////////////////
+struct RayCounter
+{
+	std::atomic<uint64_t> count{ 0 };
+	char padding[64];
+};
+std::mutex ray_counters_lock;
+vector<unique_ptr<RayCounter>> ray_counters;
+
+static void countRays(int n)
+{
+	thread_local RayCounter* counter = nullptr;
+	if(counter == nullptr)
+	{
+		lock_guard<std::mutex> guard(ray_counters_lock);
+		ray_counters.emplace_back(new RayCounter);
+		counter = ray_counters.back().get();
+	}
+	counter->count.store(counter->count.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+uint64_t getNumberOfRaysTraced()
+{
+	lock_guard<std::mutex> guard(ray_counters_lock);
+	uint64_t total = 0;
+	for(auto& counter : ray_counters)
+		total += counter->count.load(memory_order_relaxed);
+	return total;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Test a ray against the scene and find the closest intersection
 ///////////////////////////////////////////////////////////////////////////
 bool intersect(Ray& r)
 {
+	countRays(1);
 	rtcIntersect(embree_scene, *((RTCRay*)&r));
 	return r.geomID != RTC_INVALID_GEOMETRY_ID;
 }
@@ -123,7 +701,128 @@ bool intersect(Ray& r)
 ///////////////////////////////////////////////////////////////////////////
 bool occluded(Ray& r)
 {
+	countRays(1);
 	rtcOccluded(embree_scene, *((RTCRay*)&r));
 	return r.geomID != RTC_INVALID_GEOMETRY_ID;
 }
+
+///////////////////////////////////////////////////////////////////////////
+// Packet versions of intersect() and occluded()
+///////////////////////////////////////////////////////////////////////////
+static_assert(sizeof(Ray4) == sizeof(RTCRay4), "Ray4 must match the layout of RTCRay4");
+static_assert(sizeof(Ray8) == sizeof(RTCRay8), "Ray8 must match the layout of RTCRay8");
+static_assert(sizeof(Ray16) == sizeof(RTCRay16), "Ray16 must match the layout of RTCRay16");
+
+template <int N>
+static int countValid(const int* valid)
+{
+	int n = 0;
+	for(int i = 0; i < N; i++)
+		n += valid[i] != 0 ? 1 : 0;
+	return n;
+}
+
+void intersectPacket(const int* valid, Ray4& rays)
+{
+	countRays(countValid<4>(valid));
+	rtcIntersect4(valid, embree_scene, *((RTCRay4*)&rays));
+}
+
+void intersectPacket(const int* valid, Ray8& rays)
+{
+	countRays(countValid<8>(valid));
+	rtcIntersect8(valid, embree_scene, *((RTCRay8*)&rays));
+}
+
+void intersectPacket(const int* valid, Ray16& rays)
+{
+	countRays(countValid<16>(valid));
+	rtcIntersect16(valid, embree_scene, *((RTCRay16*)&rays));
+}
+
+void occludedPacket(const int* valid, Ray4& rays)
+{
+	countRays(countValid<4>(valid));
+	rtcOccluded4(valid, embree_scene, *((RTCRay4*)&rays));
+}
+
+void occludedPacket(const int* valid, Ray8& rays)
+{
+	countRays(countValid<8>(valid));
+	rtcOccluded8(valid, embree_scene, *((RTCRay8*)&rays));
+}
+
+void occludedPacket(const int* valid, Ray16& rays)
+{
+	countRays(countValid<16>(valid));
+	rtcOccluded16(valid, embree_scene, *((RTCRay16*)&rays));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Batched occlusion. Embree sorts a stream of rays into packets itself, so
+// that is used when available. Otherwise the rays are traced in packets of
+// the widest size the CPU supports, in the order they come.
+///////////////////////////////////////////////////////////////////////////
+template <typename Packet>
+static void occludedInPackets(Ray* rays, int n)
+{
+	for(int first = 0; first < n; first += Packet::size)
+	{
+		Packet packet;
+		// Embree wants the mask aligned like the packet
+		alignas(4 * Packet::size) int valid[Packet::size];
+		for(int i = 0; i < Packet::size; i++)
+		{
+			valid[i] = first + i < n ? -1 : 0;
+			packet.set(i, valid[i] ? rays[first + i] : Ray());
+		}
+		occludedPacket(valid, packet);
+		for(int i = 0; i < Packet::size && first + i < n; i++)
+			rays[first + i].geomID = packet.geomID[i];
+	}
+}
+
+void occludedBatch(Ray* rays, int n, uint64_t* visible)
+{
+	if(n == 0)
+		return;
+	if(stream_supported)
+	{
+		countRays(n);
+		RTCIntersectContext context;
+		context.flags = RTC_INTERSECT_INCOHERENT;
+		context.userRayExt = nullptr;
+		rtcOccluded1M(embree_scene, &context, (RTCRay*)rays, n, sizeof(Ray));
+	}
+	else
+	{
+		switch(max_packet_size)
+		{
+		case 16:
+			occludedInPackets<Ray16>(rays, n);
+			break;
+		case 8:
+			occludedInPackets<Ray8>(rays, n);
+			break;
+		case 4:
+			occludedInPackets<Ray4>(rays, n);
+			break;
+		default:
+			for(int i = 0; i < n; i++)
+				occluded(rays[i]);
+		}
+	}
+	for(int word = 0; word < (n + 63) / 64; word++)
+		visible[word] = 0;
+	for(int i = 0; i < n; i++)
+	{
+		if(rays[i].geomID == RTC_INVALID_GEOMETRY_ID)
+			visible[i / 64] |= uint64_t(1) << (i % 64);
+	}
+}
+
+int getMaxPacketSize()
+{
+	return max_packet_size;
+}
 } // namespace pathtracer
\ No newline at end of file
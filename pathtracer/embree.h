@@ -3,20 +3,99 @@
 #include <embree2/rtcore_ray.h>
 #include "Model.h"
 #include <glm/glm.hpp>
-#include <map>
+#include <vector>
+#include "material.h"
 
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////
-// Add a model to the embree scene
+// Add a model to the embree scene. Adding the same model again places
+// another instance of it, which shares the geometry and BVH of the first
+// and costs only a transform. Returns the ID of the placed instance, to
+// move it with updateInstanceTransform().
 ///////////////////////////////////////////////////////////////////////////
-void addModel(const labhelper::Model* model, const glm::mat4& model_matrix);
+uint32_t addModel(const labhelper::Model* model, const glm::mat4& model_matrix);
 
 ///////////////////////////////////////////////////////////////////////////
-// Build an acceleration structure for the scene
+// Build an acceleration structure for the scene, with the flags in
+// settings, and print what it cost for each model
 ///////////////////////////////////////////////////////////////////////////
 void buildBVH();
 
+///////////////////////////////////////////////////////////////////////////
+// What the last buildBVH() cost. The BVH bytes are what embree allocated
+// while building the models' BVHs, the other byte counts include every
+// buffer embree holds (as reported to its memory monitor).
+///////////////////////////////////////////////////////////////////////////
+struct BVHStats
+{
+	float build_ms = 0.0f;
+	int64_t bvh_bytes = 0;
+	int64_t embree_bytes = 0;
+	int64_t embree_peak_bytes = 0;
+	// Triangles in the distinct models, not counting instances twice
+	size_t triangles = 0;
+	size_t instances = 0;
+};
+BVHStats getBVHStats();
+
+///////////////////////////////////////////////////////////////////////////
+// A hash of everything in the scene that decides how it looks: the vertex
+// positions of every model, where its instances are placed and the
+// compiled materials. Walks every vertex, so it is not meant to be called
+// every frame.
+///////////////////////////////////////////////////////////////////////////
+uint64_t getSceneHash();
+
+///////////////////////////////////////////////////////////////////////////
+// Move one instance, as returned by addModel(), to a new model matrix.
+// Other instances of the same model stay where they are. Only asks for
+// the move: it is done by the next commitSceneUpdates(), so this can be
+// called while a pass is being traced. Call restart() as well to start
+// over with the moved instance.
+///////////////////////////////////////////////////////////////////////////
+void updateInstanceTransform(uint32_t instance, const glm::mat4& model_matrix);
+
+///////////////////////////////////////////////////////////////////////////
+// Apply the moves and material changes asked for since the last call.
+// Only the transforms of the instances change, so only the top level BVH
+// (over the instances) is rebuilt, and the emissive triangles are only
+// collected again if a model with emissive materials moved or the
+// materials changed. Called by tracePaths() before each pass, when no
+// rays are in flight. Returns false if there was nothing to do.
+///////////////////////////////////////////////////////////////////////////
+bool commitSceneUpdates();
+
+///////////////////////////////////////////////////////////////////////////
+// What the most recent commitSceneUpdates() cost
+///////////////////////////////////////////////////////////////////////////
+struct SceneUpdateStats
+{
+	// Number of calls that had something to do
+	int updates = 0;
+	int moved_instances = 0;
+	// Time spent rebuilding the top level BVH, and collecting the lights
+	float bvh_ms = 0.0f;
+	float lights_ms = 0.0f;
+};
+SceneUpdateStats getSceneUpdateStats();
+
+///////////////////////////////////////////////////////////////////////////
+// Recompile the materials of all meshes in the scene. Call this after
+// editing a material, or changing which material a mesh uses, on the
+// thread that edits them. Like updateInstanceTransform(), the new materials
+// are only put in place by the next commitSceneUpdates(), so this can be
+// called while a pass is being traced.
+///////////////////////////////////////////////////////////////////////////
+void updateMaterials();
+
+///////////////////////////////////////////////////////////////////////////
+// Rebuild the list of emissive triangles that are sampled as lights (see
+// lights.h). Done by buildBVH() and commitSceneUpdates(). Returns the
+// number of emissive triangles.
+///////////////////////////////////////////////////////////////////////////
+size_t updateLights();
+
 ///////////////////////////////////////////////////////////////////////////
 // This struct is what an embree Ray must look like. It contains the
 // information about the ray to be shot and (after intersect() has been
@@ -50,6 +129,50 @@ struct RTCORE_ALIGN(16) Ray
 	uint32_t instID = RTC_INVALID_GEOMETRY_ID;
 };
 
+///////////////////////////////////////////////////////////////////////////
+// A packet of N rays in SoA layout. This has exactly the same memory
+// layout as embree's RTCRay4/8/16. Lanes are filled in and read back as
+// ordinary Rays with set() and get().
+///////////////////////////////////////////////////////////////////////////
+template <int N>
+struct alignas(4 * N) RayPacket
+{
+	static const int size = N;
+	// Ray data
+	float ox[N], oy[N], oz[N];
+	float dx[N], dy[N], dz[N];
+	float tnear[N], tfar[N], time[N];
+	uint32_t mask[N];
+	// Hit Data
+	float nx[N], ny[N], nz[N];
+	float u[N], v[N];
+	uint32_t geomID[N];
+	uint32_t primID[N];
+	uint32_t instID[N];
+
+	void set(int i, const Ray& r)
+	{
+		ox[i] = r.o.x, oy[i] = r.o.y, oz[i] = r.o.z;
+		dx[i] = r.d.x, dy[i] = r.d.y, dz[i] = r.d.z;
+		tnear[i] = r.tnear, tfar[i] = r.tfar, time[i] = r.time;
+		mask[i] = r.mask;
+		geomID[i] = primID[i] = instID[i] = RTC_INVALID_GEOMETRY_ID;
+	}
+	Ray get(int i) const
+	{
+		Ray r(glm::vec3(ox[i], oy[i], oz[i]), glm::vec3(dx[i], dy[i], dz[i]), tnear[i], tfar[i]);
+		r.time = time[i];
+		r.mask = mask[i];
+		r.n = glm::vec3(nx[i], ny[i], nz[i]);
+		r.u = u[i], r.v = v[i];
+		r.geomID = geomID[i], r.primID = primID[i], r.instID = instID[i];
+		return r;
+	}
+};
+typedef RayPacket<4> Ray4;
+typedef RayPacket<8> Ray8;
+typedef RayPacket<16> Ray16;
+
 ///////////////////////////////////////////////////////////////////////////
 // This struct describes an intersection, as extracted from the Embree
 // ray.
@@ -59,11 +182,53 @@ struct Intersection
 	glm::vec3 position;
 	glm::vec3 geometry_normal;
 	glm::vec3 shading_normal;
+	glm::vec2 texture_coordinates;
 	glm::vec3 wo;
-	const labhelper::Material* material;
+	const MaterialRecord* material;
 };
 Intersection getIntersection(const Ray& r);
 
+///////////////////////////////////////////////////////////////////////////
+// The shading data of one triangle, packed into 64 bytes: model space
+// vertex normals, texture coordinates, and an index into the compiled
+// materials.
+///////////////////////////////////////////////////////////////////////////
+struct TriangleShading
+{
+	glm::vec3 normal[3];
+	glm::vec2 texture_coordinates[3];
+	uint32_t material;
+};
+static_assert(sizeof(TriangleShading) == 64, "TriangleShading should be packed into 64 bytes");
+
+///////////////////////////////////////////////////////////////////////////
+// Time getIntersection() over a set of hits (rays returned by intersect()),
+// against the std::map lookups it used to do, in hits per second.
+///////////////////////////////////////////////////////////////////////////
+struct HitResolutionBenchmark
+{
+	double map_hits_per_second;
+	double flat_hits_per_second;
+};
+HitResolutionBenchmark benchmarkHitResolution(const std::vector<Ray>& hits, int repetitions);
+
+///////////////////////////////////////////////////////////////////////////
+// Only look up the material that an embree ray hit
+///////////////////////////////////////////////////////////////////////////
+const MaterialRecord* getMaterial(const Ray& r);
+
+///////////////////////////////////////////////////////////////////////////
+// The index of a material among all compiled materials of the scene
+///////////////////////////////////////////////////////////////////////////
+uint32_t getMaterialIndex(const MaterialRecord* material);
+
+///////////////////////////////////////////////////////////////////////////
+// An index for the geometry an embree ray hit, unique for every mesh of
+// every placed instance (unlike the geomID, which is only unique within
+// the model).
+///////////////////////////////////////////////////////////////////////////
+uint32_t getGeometryIndex(const Ray& r);
+
 ///////////////////////////////////////////////////////////////////////////
 // Test a ray against the scene and find the closest intersection
 ///////////////////////////////////////////////////////////////////////////
@@ -74,4 +239,42 @@ bool intersect(Ray& r);
 // intersection).
 ///////////////////////////////////////////////////////////////////////////
 bool occluded(Ray& r);
+
+///////////////////////////////////////////////////////////////////////////
+// Packet versions of intersect() and occluded(). valid[i] must be -1 for
+// lanes that should be traced and 0 for lanes that should be ignored.
+// Afterwards, geomID is RTC_INVALID_GEOMETRY_ID for lanes that did not hit
+// anything (or, for occludedPacket, that are not occluded).
+///////////////////////////////////////////////////////////////////////////
+void intersectPacket(const int* valid, Ray4& rays);
+void intersectPacket(const int* valid, Ray8& rays);
+void intersectPacket(const int* valid, Ray16& rays);
+void occludedPacket(const int* valid, Ray4& rays);
+void occludedPacket(const int* valid, Ray8& rays);
+void occludedPacket(const int* valid, Ray16& rays);
+
+///////////////////////////////////////////////////////////////////////////
+// Test a batch of n shadow rays for occlusion, which is faster than one
+// occluded() call per ray when there are many. Bit i % 64 of visible[i /
+// 64] is set if ray i is not occluded, so visible must hold (n + 63) / 64
+// words. The rays must be fresh (geomID RTC_INVALID_GEOMETRY_ID), and
+// have their geomID set like occluded() does.
+///////////////////////////////////////////////////////////////////////////
+void occludedBatch(Ray* rays, int n, uint64_t* visible);
+inline bool isVisible(const uint64_t* visible, int i)
+{
+	return (visible[i / 64] >> (i % 64)) & 1;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The widest packet (1, 4, 8 or 16) supported by embree on this CPU. Only
+// valid after the first model has been added.
+///////////////////////////////////////////////////////////////////////////
+int getMaxPacketSize();
+
+///////////////////////////////////////////////////////////////////////////
+// The total number of rays traced with intersect() and occluded() by all
+// threads since the program started.
+///////////////////////////////////////////////////////////////////////////
+uint64_t getNumberOfRaysTraced();
 } // namespace pathtracer
\ No newline at end of file
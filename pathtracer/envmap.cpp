@@ -0,0 +1,217 @@
+#include "envmap.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+vec2 octahedralEncode(const vec3& wi)
+{
+	const float l1 = abs(wi.x) + abs(wi.y) + abs(wi.z);
+	float px = wi.x / l1;
+	float pz = wi.z / l1;
+	if(wi.y < 0.0f)
+	{
+		// Fold the lower half out over the corners
+		const float fx = (1.0f - abs(pz)) * (px >= 0.0f ? 1.0f : -1.0f);
+		const float fz = (1.0f - abs(px)) * (pz >= 0.0f ? 1.0f : -1.0f);
+		px = fx;
+		pz = fz;
+	}
+	return vec2(px * 0.5f + 0.5f, pz * 0.5f + 0.5f);
+}
+
+vec3 octahedralDecode(const vec2& uv)
+{
+	const float px = uv.x * 2.0f - 1.0f;
+	const float pz = uv.y * 2.0f - 1.0f;
+	vec3 wi = vec3(px, 1.0f - abs(px) - abs(pz), pz);
+	if(wi.y < 0.0f)
+	{
+		wi.x = (1.0f - abs(pz)) * (px >= 0.0f ? 1.0f : -1.0f);
+		wi.z = (1.0f - abs(px)) * (pz >= 0.0f ? 1.0f : -1.0f);
+	}
+	return normalize(wi);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The solid angle covered by a unit of (u, v) area around direction wi.
+// A patch of the octahedron at point P projects to (n . P) / |P|^3 of its
+// area on the sphere, which with the scaling from the [-1,1]^2 square to
+// [0,1)^2 comes to 4 / |P|^3, and for a point on the octahedron
+// |P| = 1 / (|x| + |y| + |z|) of the normalized direction.
+///////////////////////////////////////////////////////////////////////////
+static float solidAngleDensity(const vec3& wi)
+{
+	const float l1 = abs(wi.x) + abs(wi.y) + abs(wi.z);
+	return 4.0f * l1 * l1 * l1;
+}
+
+void EnvironmentMap::build(const HDRImage& image)
+{
+	// About as many texels as the source, rounded up to a power of two so
+	// that every mip level halves evenly
+	size = 1;
+	while(size * size < image.width * image.height && size < 4096)
+		size *= 2;
+
+	///////////////////////////////////////////////////////////////////////
+	// Resample with 2x2 samples per texel. This is the only place that
+	// still needs the trigonometry of the latitude-longitude layout.
+	///////////////////////////////////////////////////////////////////////
+	levels.clear();
+	levels.emplace_back(size * size);
+#pragma omp parallel for schedule(dynamic, 16)
+	for(int y = 0; y < size; y++)
+	{
+		for(int x = 0; x < size; x++)
+		{
+			vec3 sum = vec3(0.0f);
+			for(int s = 0; s < 4; s++)
+			{
+				const vec2 uv = vec2((float(x) + 0.25f + 0.5f * float(s % 2)) / float(size),
+				                     (float(y) + 0.25f + 0.5f * float(s / 2)) / float(size));
+				const vec3 wi = octahedralDecode(uv);
+				const float theta = acos(std::max(-1.0f, std::min(1.0f, wi.y)));
+				float phi = atan2(wi.z, wi.x);
+				if(phi < 0.0f)
+					phi = phi + 2.0f * M_PI;
+				sum += image.sample(phi / (2.0f * M_PI), theta / M_PI);
+			}
+			levels[0][y * size + x] = 0.25f * sum;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Prefilter the mip chain with a box filter, down to a single texel
+	///////////////////////////////////////////////////////////////////////
+	for(int s = size / 2; s >= 1; s /= 2)
+	{
+		const vector<vec3>& finer = levels.back();
+		vector<vec3> level(s * s);
+		for(int y = 0; y < s; y++)
+		{
+			for(int x = 0; x < s; x++)
+			{
+				const int fs = 2 * s;
+				level[y * s + x] = 0.25f
+				                   * (finer[(2 * y) * fs + 2 * x] + finer[(2 * y) * fs + 2 * x + 1]
+				                      + finer[(2 * y + 1) * fs + 2 * x] + finer[(2 * y + 1) * fs + 2 * x + 1]);
+			}
+		}
+		levels.push_back(std::move(level));
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Importance sampling, with each texel weighted by its luminance times
+	// the solid angle it covers
+	///////////////////////////////////////////////////////////////////////
+	vector<float> weights(size * size);
+	for(int y = 0; y < size; y++)
+	{
+		for(int x = 0; x < size; x++)
+		{
+			const vec3 wi = octahedralDecode(vec2((float(x) + 0.5f) / float(size), (float(y) + 0.5f) / float(size)));
+			const float luminance = dot(levels[0][y * size + x], vec3(0.2126f, 0.7152f, 0.0722f));
+			weights[y * size + x] = std::max(0.0f, luminance) * solidAngleDensity(wi);
+		}
+	}
+	distribution.build(weights, size, size);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Fetch a texel, following the octahedral layout across the edges of the
+// square: a texel just outside an edge is the one mirrored along that
+// edge, since the two sides of the edge are the same seam of the sphere.
+///////////////////////////////////////////////////////////////////////////
+vec3 EnvironmentMap::texel(int level, int x, int y) const
+{
+	const int s = size >> level;
+	if(x < 0)
+	{
+		x = -x - 1;
+		y = s - 1 - y;
+	}
+	else if(x >= s)
+	{
+		x = 2 * s - 1 - x;
+		y = s - 1 - y;
+	}
+	if(y < 0)
+	{
+		y = -y - 1;
+		x = s - 1 - x;
+	}
+	else if(y >= s)
+	{
+		y = 2 * s - 1 - y;
+		x = s - 1 - x;
+	}
+	return levels[level][y * s + x];
+}
+
+vec3 EnvironmentMap::lookup(const vec3& wi, float level) const
+{
+	const vec2 uv = octahedralEncode(wi);
+	level = std::max(0.0f, std::min(level, float(levels.size() - 1)));
+	const int l0 = int(level);
+	const int l1 = std::min(l0 + 1, int(levels.size()) - 1);
+	const float t = level - float(l0);
+	vec3 result = vec3(0.0f);
+	for(int l = l0; l <= l1; l++)
+	{
+		const float weight = l == l0 ? 1.0f - t : t;
+		if(weight == 0.0f)
+			continue;
+		const int s = size >> l;
+		const float fx = uv.x * float(s) - 0.5f;
+		const float fy = uv.y * float(s) - 0.5f;
+		const int x = int(floor(fx));
+		const int y = int(floor(fy));
+		const float tx = fx - float(x);
+		const float ty = fy - float(y);
+		vec3 t00, t10, t01, t11;
+		if(x >= 0 && y >= 0 && x + 1 < s && y + 1 < s)
+		{
+			const vec3* row = &levels[l][y * s + x];
+			t00 = row[0];
+			t10 = row[1];
+			t01 = row[s];
+			t11 = row[s + 1];
+		}
+		else
+		{
+			t00 = texel(l, x, y);
+			t10 = texel(l, x + 1, y);
+			t01 = texel(l, x, y + 1);
+			t11 = texel(l, x + 1, y + 1);
+		}
+		result += weight * mix(mix(t00, t10, tx), mix(t01, t11, tx), ty);
+	}
+	return result;
+}
+
+float EnvironmentMap::levelForPdf(float pdf) const
+{
+	if(pdf <= 0.0f)
+		return 0.0f;
+	// A level 0 texel covers 4 * pi / size^2 steradians on average
+	const float texels_per_sample = float(size) * float(size) / (4.0f * M_PI * pdf);
+	return std::max(0.0f, 0.5f * log2(texels_per_sample));
+}
+
+vec3 EnvironmentMap::sample(const vec2& xi, float& pdf) const
+{
+	float pdf_uv;
+	const vec3 wi = octahedralDecode(distribution.sample(xi, pdf_uv));
+	pdf = pdf_uv / solidAngleDensity(wi);
+	return wi;
+}
+
+float EnvironmentMap::pdf(const vec3& wi) const
+{
+	return distribution.pdf(octahedralEncode(wi)) / solidAngleDensity(wi);
+}
+} // namespace pathtracer
@@ -0,0 +1,63 @@
+#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+#include "HDRImage.h"
+#include "sampling.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The environment map, resampled from the loaded latitude-longitude image
+// into an octahedral layout: the sphere of directions is projected onto
+// an octahedron (|x| + |y| + |z| = 1, with y up) whose lower half is then
+// folded out over the corners of the square. Mapping a direction to a
+// texel then only takes a few adds, abs and one division, instead of the
+// acos and atan of the latitude-longitude layout.
+///////////////////////////////////////////////////////////////////////////
+struct EnvironmentMap
+{
+	// Level 0 is size x size texels, each following level half of that
+	std::vector<std::vector<glm::vec3>> levels;
+	int size = 0;
+
+	///////////////////////////////////////////////////////////////////////
+	// Resample image (latitude-longitude) into a map of about the same
+	// number of texels, prefilter the mip chain and build the distribution
+	// for importance sampling.
+	///////////////////////////////////////////////////////////////////////
+	void build(const HDRImage& image);
+
+	///////////////////////////////////////////////////////////////////////
+	// The radiance from direction wi (which must be normalized), bilinearly
+	// filtered from a (fractional) mip level.
+	///////////////////////////////////////////////////////////////////////
+	glm::vec3 lookup(const glm::vec3& wi, float level = 0.0f) const;
+
+	///////////////////////////////////////////////////////////////////////
+	// The mip level whose texels cover about as much solid angle as a ray
+	// sampled with this (solid angle) pdf stands for.
+	///////////////////////////////////////////////////////////////////////
+	float levelForPdf(float pdf) const;
+
+	///////////////////////////////////////////////////////////////////////
+	// Importance sampling, in proportion to the luminance of level 0.
+	// Returns a direction and its solid angle pdf.
+	///////////////////////////////////////////////////////////////////////
+	glm::vec3 sample(const glm::vec2& xi, float& pdf) const;
+	float pdf(const glm::vec3& wi) const;
+	bool canImportanceSample() const
+	{
+		return distribution.valid();
+	}
+
+private:
+	Distribution2D distribution;
+	glm::vec3 texel(int level, int x, int y) const;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Map between directions and the [0,1)^2 square of the octahedral layout
+///////////////////////////////////////////////////////////////////////////
+glm::vec2 octahedralEncode(const glm::vec3& wi);
+glm::vec3 octahedralDecode(const glm::vec2& uv);
+} // namespace pathtracer
@@ -0,0 +1,21 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// 64 bit FNV-1a, used to tell whether a checkpoint or a worker's result
+// belongs to the same scene and render. Start with FNV_OFFSET and chain
+// the hash of each piece of data into the next.
+///////////////////////////////////////////////////////////////////////////
+const uint64_t FNV_OFFSET = 0xcbf29ce484222325ull;
+
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t hash)
+{
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	for(size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	return hash;
+}
+} // namespace pathtracer
@@ -0,0 +1,851 @@
+#include "headless.h"
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+#include <Model.h>
+#include "Pathtracer.h"
+#include "embree.h"
+#include "denoiser.h"
+#include "checkpoint.h"
+#include "distributed.h"
+#include "termination.h"
+
+using namespace glm;
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// Everything needed to describe a batch render. The defaults are the same
+// as for the interactive pathtracer.
+///////////////////////////////////////////////////////////////////////////////
+struct HeadlessJob
+{
+	struct ModelPlacement
+	{
+		string filename;
+		mat4 transform;
+	};
+	vector<ModelPlacement> models;
+	string envmap = "../scenes/envmaps/001.hdr";
+	float environment_multiplier = 1.0f;
+	vec3 camera_position = vec3(-30.0f, 10.0f, 30.0f);
+	vec3 camera_target = vec3(0.0f, 10.0f, 0.0f);
+	float fov = 45.0f;
+	int width = 1280, height = 720;
+	int max_bounces = 8;
+	int packet_size = 8;
+	pathtracer::Integrator integrator = pathtracer::Integrator::Megakernel;
+	pathtracer::Sampler sampler = pathtracer::Sampler::Sobol;
+	float adaptive_threshold = 0.0f; // 0 = No adaptive sampling
+	int samples_per_pixel = 0; // 0 = No limit (use time_budget)
+	float time_budget = 0.0f;  // In seconds, 0 = No limit (use samples_per_pixel)
+	string output = "output.hdr";
+	// Report the error against this image, if given
+	string reference;
+	// Render once with each sampler and compare their errors
+	bool compare_samplers = false;
+	// Render for the same time without Russian roulette, with it, and with
+	// it and splitting, and compare their errors
+	bool compare_termination = false;
+	// See settings.filter_environment
+	bool filter_environment = false;
+	// See the path termination options in settings. 0 = No splitting
+	bool russian_roulette = true;
+	int roulette_min_bounces = 3;
+	float split_threshold = 0.0f;
+	// See the BVH options in settings
+	bool bvh_high_quality = false;
+	bool bvh_compact = false;
+	bool bvh_robust = false;
+	pathtracer::GeometryUsage geometry_usage = pathtracer::GeometryUsage::Static;
+	// Write the image through the denoiser
+	bool denoise = false;
+	// Write these AOVs next to the output (see settings.aovs)
+	uint32_t aovs = 0;
+	// Time environment map lookups instead of rendering
+	bool benchmark_environment = false;
+	// Time how fast hits are resolved into intersections instead of rendering
+	bool benchmark_hits = false;
+	// Write the render in progress to this file every checkpoint_interval
+	// seconds, and when it is done
+	string checkpoint;
+	float checkpoint_interval = 60.0f;
+	// Continue from the checkpoint, if it is one of the same render
+	bool resume = false;
+	// Coordinate a render over worker processes on this port, 0 = render
+	// here (see distributed.h)
+	int coordinator_port = 0;
+	// Render the jobs of the coordinator at worker_host:worker_port
+	string worker_host;
+	int worker_port = 0;
+	// Passes in each job that the coordinator hands out
+	int job_passes = 4;
+};
+
+static void printUsage()
+{
+	cout << "Usage: pathtracer --headless [options]\n"
+	        "  --model <file.obj>                  Add a model to the scene (repeatable)\n"
+	        "  --translate <x> <y> <z>             Translate the last added model\n"
+	        "  --rotate <degrees> <x> <y> <z>      Rotate the last added model around an axis\n"
+	        "  --scale <s>                         Scale the last added model\n"
+	        "  --envmap <file.hdr>                 Environment map\n"
+	        "  --env-multiplier <m>                Environment map intensity\n"
+	        "  --camera <px> <py> <pz> <tx> <ty> <tz>  Camera position and target\n"
+	        "  --fov <degrees>                     Vertical field of view\n"
+	        "  --resolution <width> <height>       Size of the output image\n"
+	        "  --max-bounces <n>                   Maximum path length\n"
+	        "  --packet-size <1|4|8|16>            Primary ray packet size\n"
+	        "  --integrator <megakernel|wavefront> Integrator to render with\n"
+	        "  --sampler <independent|sobol>       Sample generator\n"
+	        "  --adaptive <relative error>         Stop sampling pixels below this error\n"
+	        "  --spp <n>                           Passes (paths per pixel) to render\n"
+	        "  --time <seconds>                    Time budget for the render\n"
+	        "  --output <file.hdr|file.pfm>        Where to write the result\n"
+	        "  --reference <file.hdr|file.pfm>     Report the RMSE against this image\n"
+	        "  --compare-samplers                  Render with each sampler at the same --spp and\n"
+	        "                                      compare their RMSE against the --reference\n"
+	        "  --compare-termination               Render for the same --time with no Russian roulette,\n"
+	        "                                      with it, and with it and splitting (at --split, or 1),\n"
+	        "                                      and compare their RMSE against the --reference\n"
+	        "  --no-roulette                       Only end paths at --max-bounces or when they escape\n"
+	        "  --roulette-after <bounces>          Bounces before Russian roulette starts (default 3)\n"
+	        "  --split <threshold>                 Split paths whose throughput grows above this\n"
+	        "  --env-filter                        Let diffuse bounces see a prefiltered environment\n"
+	        "  --bvh-high-quality                  Build a BVH that is slower to build but faster to trace\n"
+	        "  --bvh-compact                       Build a BVH that takes less memory but is slower to trace\n"
+	        "  --bvh-robust                        Use robust (watertight) traversal\n"
+	        "  --geometry <static|deformable|dynamic>  How the models' geometry may change\n"
+	        "  --denoise                           Denoise the result before writing it\n"
+	        "  --aov <name|all>                    Also write an AOV, to <output>.<name>.<ext> (repeatable):\n"
+	        "                                      depth, normal, albedo, material, direct, indirect,\n"
+	        "                                      samplecount\n"
+	        "  --checkpoint <file>                 Save the render in progress to this file\n"
+	        "  --checkpoint-interval <seconds>     Time between checkpoints (default 60)\n"
+	        "  --resume                            Continue the render saved in the --checkpoint\n"
+	        "  --coordinator <port>                Hand out the passes to --worker processes that\n"
+	        "                                      connect to this port, and merge their results\n"
+	        "  --worker <host>:<port>              Render passes for a --coordinator, which must be\n"
+	        "                                      given the same scene, camera and settings\n"
+	        "  --job-passes <n>                    Passes in each job of a --coordinator (default 4)\n"
+	        "  --benchmark-environment             Time environment lookups in the latitude-longitude\n"
+	        "                                      and octahedral layouts, and exit\n"
+	        "  --benchmark-hits                    Time resolving the camera's hits into intersections\n"
+	        "                                      instead of rendering\n"
+	        "If no models are given, the default ship and landing pad scene is used.\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parse the command line into a job. Returns false on malformed input.
+///////////////////////////////////////////////////////////////////////////////
+static bool parseArguments(int argc, char* argv[], HeadlessJob& job)
+{
+	int i = 1;
+	bool ok = true;
+	auto next = [&](const char* option) -> const char* {
+		if(i + 1 >= argc)
+		{
+			cout << "Missing value for " << option << ".\n";
+			ok = false;
+			return "0";
+		}
+		return argv[++i];
+	};
+	auto nextFloat = [&](const char* option) { return float(atof(next(option))); };
+	auto nextInt = [&](const char* option) { return atoi(next(option)); };
+	auto lastModel = [&](const char* option) -> mat4& {
+		static mat4 dummy;
+		if(job.models.empty())
+		{
+			cout << option << " must follow a --model.\n";
+			ok = false;
+			return dummy;
+		}
+		return job.models.back().transform;
+	};
+
+	for(; i < argc && ok; i++)
+	{
+		const string arg = argv[i];
+		if(arg == "--headless")
+		{
+		}
+		else if(arg == "--model")
+		{
+			HeadlessJob::ModelPlacement placement;
+			placement.filename = next("--model");
+			placement.transform = mat4(1.0f);
+			job.models.push_back(placement);
+		}
+		else if(arg == "--translate")
+		{
+			vec3 t;
+			t.x = nextFloat("--translate");
+			t.y = nextFloat("--translate");
+			t.z = nextFloat("--translate");
+			mat4& m = lastModel("--translate");
+			m = m * translate(t);
+		}
+		else if(arg == "--rotate")
+		{
+			float angle = nextFloat("--rotate");
+			vec3 axis;
+			axis.x = nextFloat("--rotate");
+			axis.y = nextFloat("--rotate");
+			axis.z = nextFloat("--rotate");
+			mat4& m = lastModel("--rotate");
+			m = m * rotate(radians(angle), normalize(axis));
+		}
+		else if(arg == "--scale")
+		{
+			float s = nextFloat("--scale");
+			mat4& m = lastModel("--scale");
+			m = m * scale(vec3(s));
+		}
+		else if(arg == "--envmap")
+			job.envmap = next("--envmap");
+		else if(arg == "--env-multiplier")
+			job.environment_multiplier = nextFloat("--env-multiplier");
+		else if(arg == "--camera")
+		{
+			for(int c = 0; c < 3; c++)
+				job.camera_position[c] = nextFloat("--camera");
+			for(int c = 0; c < 3; c++)
+				job.camera_target[c] = nextFloat("--camera");
+		}
+		else if(arg == "--fov")
+			job.fov = nextFloat("--fov");
+		else if(arg == "--resolution")
+		{
+			job.width = nextInt("--resolution");
+			job.height = nextInt("--resolution");
+		}
+		else if(arg == "--max-bounces")
+			job.max_bounces = nextInt("--max-bounces");
+		else if(arg == "--packet-size")
+			job.packet_size = nextInt("--packet-size");
+		else if(arg == "--integrator")
+		{
+			const string name = next("--integrator");
+			if(name == "megakernel")
+				job.integrator = pathtracer::Integrator::Megakernel;
+			else if(name == "wavefront")
+				job.integrator = pathtracer::Integrator::Wavefront;
+			else
+			{
+				cout << "Unknown integrator: " << name << "\n";
+				ok = false;
+			}
+		}
+		else if(arg == "--sampler")
+		{
+			const string name = next("--sampler");
+			if(name == "independent")
+				job.sampler = pathtracer::Sampler::Independent;
+			else if(name == "sobol")
+				job.sampler = pathtracer::Sampler::Sobol;
+			else
+			{
+				cout << "Unknown sampler: " << name << "\n";
+				ok = false;
+			}
+		}
+		else if(arg == "--adaptive")
+			job.adaptive_threshold = nextFloat("--adaptive");
+		else if(arg == "--spp")
+			job.samples_per_pixel = nextInt("--spp");
+		else if(arg == "--time")
+			job.time_budget = nextFloat("--time");
+		else if(arg == "--output")
+			job.output = next("--output");
+		else if(arg == "--reference")
+			job.reference = next("--reference");
+		else if(arg == "--compare-samplers")
+			job.compare_samplers = true;
+		else if(arg == "--compare-termination")
+			job.compare_termination = true;
+		else if(arg == "--no-roulette")
+			job.russian_roulette = false;
+		else if(arg == "--roulette-after")
+			job.roulette_min_bounces = nextInt("--roulette-after");
+		else if(arg == "--split")
+			job.split_threshold = nextFloat("--split");
+		else if(arg == "--env-filter")
+			job.filter_environment = true;
+		else if(arg == "--bvh-high-quality")
+			job.bvh_high_quality = true;
+		else if(arg == "--bvh-compact")
+			job.bvh_compact = true;
+		else if(arg == "--bvh-robust")
+			job.bvh_robust = true;
+		else if(arg == "--geometry")
+		{
+			const string name = next("--geometry");
+			if(name == "static")
+				job.geometry_usage = pathtracer::GeometryUsage::Static;
+			else if(name == "deformable")
+				job.geometry_usage = pathtracer::GeometryUsage::Deformable;
+			else if(name == "dynamic")
+				job.geometry_usage = pathtracer::GeometryUsage::Dynamic;
+			else
+			{
+				cout << "Unknown geometry usage: " << name << "\n";
+				ok = false;
+			}
+		}
+		else if(arg == "--denoise")
+			job.denoise = true;
+		else if(arg == "--aov")
+		{
+			const string name = next("--aov");
+			const uint32_t aovs = job.aovs;
+			for(int aov = 0; aov < int(pathtracer::NUMBER_OF_AOVS); aov++)
+			{
+				if(name == "all" || name == pathtracer::aovName(pathtracer::AOV(aov)))
+					job.aovs |= pathtracer::aovBit(pathtracer::AOV(aov));
+			}
+			if(job.aovs == aovs && name != "all")
+			{
+				cout << "Unknown AOV: " << name << "\n";
+				ok = false;
+			}
+		}
+		else if(arg == "--checkpoint")
+			job.checkpoint = next("--checkpoint");
+		else if(arg == "--checkpoint-interval")
+			job.checkpoint_interval = nextFloat("--checkpoint-interval");
+		else if(arg == "--resume")
+			job.resume = true;
+		else if(arg == "--coordinator")
+			job.coordinator_port = atoi(next("--coordinator"));
+		else if(arg == "--worker")
+		{
+			const string address = next("--worker");
+			const size_t separator = address.find_last_of(':');
+			if(separator != string::npos)
+			{
+				job.worker_host = address.substr(0, separator);
+				job.worker_port = atoi(address.substr(separator + 1).c_str());
+			}
+			if(job.worker_host.empty() || job.worker_port <= 0)
+			{
+				cout << "--worker needs a <host>:<port>.\n";
+				ok = false;
+			}
+		}
+		else if(arg == "--job-passes")
+			job.job_passes = atoi(next("--job-passes"));
+		else if(arg == "--benchmark-environment")
+			job.benchmark_environment = true;
+		else if(arg == "--benchmark-hits")
+			job.benchmark_hits = true;
+		else
+		{
+			cout << "Unknown option: " << arg << "\n";
+			ok = false;
+		}
+	}
+	if(ok && (job.width <= 0 || job.height <= 0))
+	{
+		cout << "Invalid resolution.\n";
+		ok = false;
+	}
+	if(ok && job.compare_samplers
+	   && (job.reference.empty() || job.time_budget > 0.0f || job.adaptive_threshold > 0.0f))
+	{
+		cout << "--compare-samplers needs a --reference, and an equal sample count (--spp, no --time or "
+		        "--adaptive).\n";
+		ok = false;
+	}
+	if(ok && job.compare_termination
+	   && (job.reference.empty() || job.time_budget <= 0.0f || job.samples_per_pixel > 0
+	       || job.adaptive_threshold > 0.0f || job.compare_samplers))
+	{
+		cout << "--compare-termination needs a --reference, and an equal time (--time, no --spp or --adaptive).\n";
+		ok = false;
+	}
+	if(ok && job.resume && job.checkpoint.empty())
+	{
+		cout << "--resume needs a --checkpoint.\n";
+		ok = false;
+	}
+	if(ok && job.checkpoint_interval <= 0.0f)
+	{
+		cout << "Invalid checkpoint interval.\n";
+		ok = false;
+	}
+	if(ok && !job.checkpoint.empty() && (job.compare_samplers || job.compare_termination))
+	{
+		cout << "--checkpoint can not be used with --compare-samplers or --compare-termination.\n";
+		ok = false;
+	}
+	const bool distributed = job.coordinator_port != 0 || !job.worker_host.empty();
+	if(ok && job.coordinator_port != 0 && (job.coordinator_port < 0 || job.coordinator_port > 65535))
+	{
+		cout << "Invalid coordinator port.\n";
+		ok = false;
+	}
+	if(ok && job.coordinator_port != 0 && !job.worker_host.empty())
+	{
+		cout << "A process can not be both a --coordinator and a --worker.\n";
+		ok = false;
+	}
+	if(ok && distributed
+	   && (job.adaptive_threshold > 0.0f || job.compare_samplers || job.compare_termination
+	       || !job.checkpoint.empty() || job.job_passes <= 0))
+	{
+		cout << "--coordinator and --worker render fixed ranges of passes, and can not be used with --adaptive,\n"
+		        "--compare-samplers, --compare-termination or --checkpoint.\n";
+		ok = false;
+	}
+	if(ok && job.samples_per_pixel == 0 && job.time_budget <= 0.0f)
+	{
+		job.samples_per_pixel = 64;
+	}
+	return ok;
+}
+
+bool isHeadless(int argc, char* argv[])
+{
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--headless") == 0)
+			return true;
+	}
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Render from scratch, or from the job's checkpoint, until we have enough
+// samples or run out of time, and report the throughput.
+///////////////////////////////////////////////////////////////////////////////
+static void render(const HeadlessJob& job, const mat4& viewMatrix, const mat4& projMatrix)
+{
+	pathtracer::resize(job.width, job.height);
+	const uint64_t hash = job.checkpoint.empty() ? 0 : pathtracer::renderHash(viewMatrix, projMatrix);
+	if(job.resume)
+	{
+		if(pathtracer::loadCheckpoint(job.checkpoint, hash))
+			cout << "Resumed " << pathtracer::rendered_image.number_of_samples << " passes from " << job.checkpoint
+			     << "\n";
+		else
+			cout << "Could not resume from " << job.checkpoint << ", starting over.\n";
+	}
+	if(!job.checkpoint.empty())
+		pathtracer::startCheckpointWriter(job.checkpoint, hash, job.checkpoint_interval);
+	auto countSamples = []() {
+		double samples = 0.0;
+		for(int count : pathtracer::rendered_image.sample_count)
+			samples += count;
+		return samples;
+	};
+	const int passes_before = pathtracer::rendered_image.number_of_samples;
+	const double samples_before = countSamples();
+	cout << "Rendering " << job.width << "x" << job.height << "..." << endl;
+	const uint64_t rays_before = pathtracer::getNumberOfRaysTraced();
+	const pathtracer::PathCounts paths_before = pathtracer::getPathCounts();
+	const auto start_time = chrono::steady_clock::now();
+	float elapsed = 0.0f;
+	for(;;)
+	{
+		if(job.samples_per_pixel > 0 && pathtracer::rendered_image.number_of_samples >= job.samples_per_pixel)
+			break;
+		if(job.time_budget > 0.0f && elapsed >= job.time_budget)
+			break;
+		pathtracer::tracePaths(viewMatrix, projMatrix);
+		pathtracer::checkpointPass();
+		if(pathtracer::rendered_image.active_pixels == 0)
+			break; // Every pixel has converged
+		elapsed = chrono::duration<float>(chrono::steady_clock::now() - start_time).count();
+	}
+	if(!job.checkpoint.empty())
+	{
+		pathtracer::stopCheckpointWriter();
+		if(pathtracer::saveCheckpoint(job.checkpoint, hash))
+			cout << "Wrote " << job.checkpoint << "\n";
+	}
+	const uint64_t rays = pathtracer::getNumberOfRaysTraced() - rays_before;
+	const pathtracer::PathCounts paths_after = pathtracer::getPathCounts();
+	const double paths = double(std::max<uint64_t>(1, paths_after.paths - paths_before.paths));
+	const double total_samples = countSamples();
+	const double samples = total_samples - samples_before;
+
+	cout << "Rendered " << pathtracer::rendered_image.number_of_samples - passes_before << " passes ("
+	     << total_samples / (double(job.width) * job.height) << " paths per pixel on average";
+	if(passes_before > 0)
+		cout << ", " << pathtracer::rendered_image.number_of_samples << " passes in all";
+	cout << ") in " << elapsed << " s\n";
+	cout << "  " << double(rays) / elapsed / 1e6 << " Mrays/s\n";
+	cout << "  " << samples / elapsed / 1e6 << " Msamples/s\n";
+	cout << "  " << double(paths_after.segments - paths_before.segments) / paths << " segments per path, "
+	     << double(rays) / paths << " rays per sample\n";
+	cout << "  " << double(paths_after.splits - paths_before.splits) / paths << " splits and "
+	     << double(paths_after.roulette_terminations - paths_before.roulette_terminations) / paths
+	     << " roulette terminations per path\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Coordinate the render over worker processes, and report the throughput
+///////////////////////////////////////////////////////////////////////////////
+static bool coordinate(const HeadlessJob& job, const mat4& viewMatrix, const mat4& projMatrix)
+{
+	pathtracer::resize(job.width, job.height);
+	const auto start_time = chrono::steady_clock::now();
+	if(!pathtracer::coordinateRender(job.coordinator_port, pathtracer::renderHash(viewMatrix, projMatrix),
+	                                 job.samples_per_pixel, job.time_budget, job.job_passes))
+	{
+		return false;
+	}
+	const float elapsed = chrono::duration<float>(chrono::steady_clock::now() - start_time).count();
+	double samples = 0.0;
+	for(int count : pathtracer::rendered_image.sample_count)
+		samples += count;
+	cout << "Merged " << pathtracer::rendered_image.number_of_samples << " passes in " << elapsed << " s\n";
+	cout << "  " << samples / elapsed / 1e6 << " Msamples/s\n";
+	return true;
+}
+
+static bool loadReference(const HeadlessJob& job, vector<float>& reference)
+{
+	int width, height;
+	if(!loadHDRImage(job.reference, width, height, reference))
+		return false;
+	if(width != job.width || height != job.height)
+	{
+		cout << "The reference is " << width << "x" << height << ", but the render is " << job.width << "x"
+		     << job.height << ".\n";
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Root mean square error of the rendered image, over all color channels
+///////////////////////////////////////////////////////////////////////////////
+static float rmse(const vector<float>& reference)
+{
+	const float* image = pathtracer::rendered_image.getPtr();
+	double sum = 0.0;
+	for(size_t i = 0; i < reference.size(); i++)
+	{
+		const double difference = double(image[i]) - double(reference[i]);
+		sum += difference * difference;
+	}
+	return float(sqrt(sum / double(reference.size())));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Write each AOV of the job next to the output, as <output>.<name>.<ext>
+///////////////////////////////////////////////////////////////////////////////
+static bool saveAOVs(const HeadlessJob& job)
+{
+	const size_t separator = job.output.find_last_of(".");
+	const string stem = separator == string::npos ? job.output : job.output.substr(0, separator);
+	const string extension = separator == string::npos ? "" : job.output.substr(separator);
+	const pathtracer::Image& image = pathtracer::rendered_image;
+	vector<vec3> rgb;
+	bool saved = true;
+	for(int aov = 0; aov < int(pathtracer::NUMBER_OF_AOVS); aov++)
+	{
+		if(!(job.aovs & pathtracer::aovBit(pathtracer::AOV(aov))))
+			continue;
+		const string filename = stem + "." + pathtracer::aovName(pathtracer::AOV(aov)) + extension;
+		image.aovs.toRGB(pathtracer::AOV(aov), rgb);
+		if(saveHDRImage(filename, image.width, image.height, &rgb[0].x))
+			cout << "Wrote " << filename << "\n";
+		else
+			saved = false;
+	}
+	return saved;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Time a miss the way it used to be shaded (acos and atan into the
+// latitude-longitude image, then a nearest texel) against the octahedral
+// map, both bilinear at full resolution and trilinear at a diffuse
+// bounce's level. Random directions are mostly cache misses, so they are
+// also timed over a coherent grid of directions like a camera's.
+///////////////////////////////////////////////////////////////////////////////
+static void benchmarkEnvironment()
+{
+	const HDRImage& map = pathtracer::environment.map;
+	const pathtracer::EnvironmentMap& octahedral = pathtracer::environment.octahedral;
+	const int grid = 2048;
+	const int n = grid * grid;
+	vector<vec3> directions(n);
+	vector<vec3> radiance(n);
+
+	auto time = [&](const char* name, const function<void()>& lookups) {
+		lookups(); // Warm up the caches
+		const auto start_time = chrono::steady_clock::now();
+		lookups();
+		const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+		vec3 sum = vec3(0.0f);
+		for(const vec3& r : radiance)
+			sum += r;
+		cout << "    " << name << ": " << elapsed * 1e9 / n << " ns/lookup (mean radiance " << sum.x / n << ", "
+		     << sum.y / n << ", " << sum.z / n << ")\n";
+	};
+	cout << "Environment lookups, " << map.width << "x" << map.height << " latitude-longitude, " << octahedral.size
+	     << "x" << octahedral.size << " octahedral (" << octahedral.levels.size() << " levels):\n";
+	for(int coherent = 0; coherent < 2; coherent++)
+	{
+		if(coherent)
+		{
+			cout << "  Coherent directions:\n";
+			for(int i = 0; i < n; i++)
+			{
+				const float x = float(i % grid) / float(grid) - 0.5f;
+				const float y = float(i / grid) / float(grid) - 0.5f;
+				directions[i] = normalize(vec3(1.5f * x, 1.5f * y, -1.0f));
+			}
+		}
+		else
+		{
+			cout << "  Random directions:\n";
+			mt19937 generator(1);
+			normal_distribution<float> gaussian;
+			for(vec3& d : directions)
+				d = normalize(vec3(gaussian(generator), gaussian(generator), gaussian(generator)));
+		}
+		time("latitude-longitude, nearest", [&]() {
+			for(int i = 0; i < n; i++)
+			{
+				const vec3& wi = directions[i];
+				const float theta = acos(std::max(-1.0f, std::min(1.0f, wi.y)));
+				float phi = atan2(wi.z, wi.x);
+				if(phi < 0.0f)
+					phi = phi + 2.0f * M_PI;
+				radiance[i] = map.sample(phi / (2.0f * M_PI), theta / M_PI);
+			}
+		});
+		time("octahedral, bilinear", [&]() {
+			for(int i = 0; i < n; i++)
+				radiance[i] = octahedral.lookup(directions[i]);
+		});
+		time("octahedral, trilinear", [&]() {
+			const float level = octahedral.levelForPdf(1.0f / M_PI);
+			for(int i = 0; i < n; i++)
+				radiance[i] = octahedral.lookup(directions[i], level);
+		});
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Find the hits of one ray through the center of each pixel, and time
+// resolving them into intersections in that (coherent) order and shuffled,
+// which is closer to what the hits of later bounces look like.
+///////////////////////////////////////////////////////////////////////////////
+static void benchmarkHits(const HeadlessJob& job, const mat4& viewMatrix, const mat4& projMatrix)
+{
+	const vec3 camera_position = vec3(inverse(viewMatrix) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
+	const mat4 inverse_VP = inverse(projMatrix * viewMatrix);
+	vector<pathtracer::Ray> hits;
+	for(int y = 0; y < job.height; y++)
+	{
+		for(int x = 0; x < job.width; x++)
+		{
+			const vec4 screen = vec4((float(x) + 0.5f) / float(job.width) * 2.0f - 1.0f,
+			                         (float(y) + 0.5f) / float(job.height) * 2.0f - 1.0f, 1.0f, 1.0f);
+			const vec4 p = inverse_VP * screen;
+			pathtracer::Ray ray(camera_position, normalize(vec3(p) / p.w - camera_position));
+			if(pathtracer::intersect(ray))
+				hits.push_back(ray);
+		}
+	}
+	if(hits.empty())
+	{
+		cout << "The camera does not see anything.\n";
+		return;
+	}
+	const int repetitions = std::max(1, int(20000000 / hits.size()));
+	cout << "Resolving " << hits.size() << " hits " << repetitions << " times:\n";
+	for(int shuffled = 0; shuffled < 2; shuffled++)
+	{
+		if(shuffled)
+			shuffle(hits.begin(), hits.end(), mt19937(1));
+		const pathtracer::HitResolutionBenchmark result = pathtracer::benchmarkHitResolution(hits, repetitions);
+		cout << (shuffled ? "  Shuffled:\n" : "  In pixel order:\n");
+		cout << "    std::map lookups: " << result.map_hits_per_second / 1e6 << " Mhits/s\n";
+		cout << "    flat tables:      " << result.flat_hits_per_second / 1e6 << " Mhits/s ("
+		     << result.flat_hits_per_second / result.map_hits_per_second << "x)\n";
+	}
+}
+
+int runHeadless(int argc, char* argv[])
+{
+	HeadlessJob job;
+	if(!parseArguments(argc, argv, job))
+	{
+		printUsage();
+		return 1;
+	}
+	if(job.models.empty())
+	{
+		job.models.push_back({ "../scenes/NewShip.obj", translate(vec3(0.0f, 10.0f, 0.0f)) });
+		job.models.push_back({ "../scenes/landingpad2.obj", mat4(1.0f) });
+	}
+	if(job.benchmark_environment)
+	{
+		pathtracer::environment.load(job.envmap);
+		benchmarkEnvironment();
+		return 0;
+	}
+	vector<float> reference;
+	if(!job.reference.empty() && !loadReference(job, reference))
+		return 1;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Set up the pathtracer, the same way as the interactive version but
+	// without any window or OpenGL context.
+	///////////////////////////////////////////////////////////////////////////
+	pathtracer::settings.max_bounces = job.max_bounces;
+	pathtracer::settings.max_paths_per_pixel = 0;
+	pathtracer::settings.subsampling = 1;
+	pathtracer::settings.dynamic_resolution = false;
+	pathtracer::settings.tile_size = 16;
+	pathtracer::settings.packet_size = job.packet_size;
+	pathtracer::settings.integrator = job.integrator;
+	pathtracer::settings.sampler = job.sampler;
+	pathtracer::settings.adaptive_sampling = job.adaptive_threshold > 0.0f;
+	pathtracer::settings.adaptive_threshold = job.adaptive_threshold;
+	pathtracer::settings.adaptive_min_samples = 16;
+	pathtracer::settings.filter_environment = job.filter_environment;
+	pathtracer::settings.russian_roulette = job.russian_roulette;
+	pathtracer::settings.roulette_min_bounces = job.roulette_min_bounces;
+	pathtracer::settings.path_splitting = job.split_threshold > 0.0f;
+	pathtracer::settings.split_threshold = job.split_threshold;
+	pathtracer::settings.bvh_high_quality = job.bvh_high_quality;
+	pathtracer::settings.bvh_compact = job.bvh_compact;
+	pathtracer::settings.bvh_robust = job.bvh_robust;
+	pathtracer::settings.geometry_usage = job.geometry_usage;
+	pathtracer::settings.denoise = job.denoise;
+	pathtracer::settings.denoise_iterations = 5;
+	pathtracer::settings.denoise_color_sigma = 4.0f;
+	pathtracer::settings.aovs = job.aovs;
+
+	pathtracer::point_light.intensity_multiplier = 2500.0f;
+	pathtracer::point_light.color = vec3(1.f, 1.f, 1.f);
+	pathtracer::point_light.position = vec3(10.0f, 40.0f, 10.0f);
+
+	pathtracer::environment.load(job.envmap);
+	pathtracer::environment.multiplier = job.environment_multiplier;
+
+	// A file that is placed more than once is only loaded once, so that the
+	// placements become instances of the same model
+	map<string, labhelper::Model*> models;
+	for(auto& placement : job.models)
+	{
+		labhelper::Model*& model = models[placement.filename];
+		if(model == nullptr)
+			model = labhelper::loadModelFromOBJ(placement.filename, false);
+		pathtracer::addModel(model, placement.transform);
+	}
+	pathtracer::buildBVH();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Render
+	///////////////////////////////////////////////////////////////////////////
+	mat4 viewMatrix = lookAt(job.camera_position, job.camera_target, vec3(0.0f, 1.0f, 0.0f));
+	mat4 projMatrix = perspective(radians(job.fov), float(job.width) / float(job.height), 0.1f, 100.0f);
+	bool saved = true;
+	if(job.benchmark_hits)
+	{
+		benchmarkHits(job, viewMatrix, projMatrix);
+	}
+	else if(!job.worker_host.empty())
+	{
+		pathtracer::resize(job.width, job.height);
+		saved = pathtracer::workForCoordinator(job.worker_host, job.worker_port,
+		                                       pathtracer::renderHash(viewMatrix, projMatrix), viewMatrix, projMatrix);
+	}
+	else if(job.compare_samplers)
+	{
+		const pathtracer::Sampler samplers[] = { pathtracer::Sampler::Independent, pathtracer::Sampler::Sobol };
+		const char* names[] = { "independent", "sobol" };
+		float error[2];
+		for(int i = 0; i < 2; i++)
+		{
+			cout << "Sampler: " << names[i] << "\n";
+			pathtracer::settings.sampler = samplers[i];
+			render(job, viewMatrix, projMatrix);
+			error[i] = rmse(reference);
+			cout << "  RMSE: " << error[i] << "\n";
+		}
+		// At the MC rate the error falls with the square root of the sample
+		// count, so the squared ratio estimates how many times as many
+		// paths independent sampling would need to reach the error of Sobol.
+		cout << "Sobol/independent RMSE: " << error[1] / error[0] << " (independent needs ~"
+		     << (error[0] * error[0]) / (error[1] * error[1]) << "x the paths for the same error)\n";
+	}
+	else if(job.compare_termination)
+	{
+		struct Termination
+		{
+			const char* name;
+			bool russian_roulette;
+			float split_threshold; // 0 = No splitting
+		};
+		const float split_threshold = job.split_threshold > 0.0f ? job.split_threshold : 1.0f;
+		const Termination terminations[] = { { "none", false, 0.0f },
+		                                     { "roulette", true, 0.0f },
+		                                     { "roulette and splitting", true, split_threshold } };
+		float error[3];
+		for(int i = 0; i < 3; i++)
+		{
+			cout << "Termination: " << terminations[i].name << "\n";
+			pathtracer::settings.russian_roulette = terminations[i].russian_roulette;
+			pathtracer::settings.path_splitting = terminations[i].split_threshold > 0.0f;
+			pathtracer::settings.split_threshold = terminations[i].split_threshold;
+			render(job, viewMatrix, projMatrix);
+			error[i] = rmse(reference);
+			cout << "  RMSE: " << error[i] << "\n";
+		}
+		// In the same time, the efficiency (one over variance times time) of
+		// each relative to no roulette is the inverse squared ratio of errors
+		for(int i = 1; i < 3; i++)
+		{
+			cout << "Efficiency of " << terminations[i].name << ": " << (error[0] * error[0]) / (error[i] * error[i])
+			     << "x that of none\n";
+		}
+	}
+	else if(job.coordinator_port != 0 && !coordinate(job, viewMatrix, projMatrix))
+	{
+		saved = false; // Could not listen on the port
+	}
+	else
+	{
+		// A coordinator's image has been rendered by its workers by now
+		if(job.coordinator_port == 0)
+			render(job, viewMatrix, projMatrix);
+		if(!reference.empty())
+			cout << "  RMSE: " << rmse(reference) << "\n";
+		if(job.denoise)
+		{
+			pathtracer::denoise(pathtracer::rendered_image, pathtracer::rendered_image.data);
+			cout << "Denoised in " << pathtracer::denoise_stats.time << " ms\n";
+			if(!reference.empty())
+				cout << "  RMSE (denoised): " << rmse(reference) << "\n";
+		}
+		saved = saveHDRImage(job.output, pathtracer::rendered_image.width, pathtracer::rendered_image.height,
+		                     pathtracer::rendered_image.getPtr());
+		if(saved)
+			cout << "Wrote " << job.output << "\n";
+		saved = saveAOVs(job) && saved;
+	}
+
+	for(auto& m : models)
+	{
+		labhelper::freeModel(m.second);
+	}
+	return saved ? 0 : 1;
+}
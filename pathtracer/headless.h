@@ -0,0 +1,14 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////
+// Returns true if the pathtracer was started with --headless, in which
+// case no window or OpenGL context should be created.
+///////////////////////////////////////////////////////////////////////////
+bool isHeadless(int argc, char* argv[]);
+
+///////////////////////////////////////////////////////////////////////////
+// Render the scene described on the command line without a display,
+// write the result to disk and print throughput statistics. Returns the
+// exit code of the program.
+///////////////////////////////////////////////////////////////////////////
+int runHeadless(int argc, char* argv[]);
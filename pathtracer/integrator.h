@@ -0,0 +1,106 @@
+#pragma once
+#include <glm/glm.hpp>
+#include "Pathtracer.h"
+#include "embree.h"
+#include "material.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Building blocks shared by the integrators, so that the megakernel (Li())
+// and the wavefront integrator compute exactly the same estimator.
+///////////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Creates a ray that starts in the camera position and points toward a
+// pixel on a virtual screen.
+///////////////////////////////////////////////////////////////////////////
+struct PrimaryRayGenerator
+{
+	vec3 camera_pos;
+	mat4 inverse_VP;
+	// The path's stream decides where in the pixel the ray passes through
+	Ray generate(int x, int y, const RandomStream& stream) const;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Whether a vertex with this material sees the environment through a
+// prefiltered level of the map (if settings.filter_environment is set).
+// Such a vertex does not also sample the environment as a light, and the
+// rays it samples from its BRDF get an MIS weight of one, so that it
+// estimates the integral of one map only. Only diffuse vertices filter:
+// their BRDF samples stand for wide cones, while glossy ones need the
+// sharp map and its importance sampling.
+///////////////////////////////////////////////////////////////////////////
+bool filtersEnvironment(const MaterialRecord& material);
+
+///////////////////////////////////////////////////////////////////////////
+// Return the radiance from a certain direction wi from the environment
+// map. A ray sampled from a BRDF with pdf brdf_pdf stands for a cone of
+// about 1 / brdf_pdf steradians, so rays from vertices that filter (see
+// filtersEnvironment()) see the matching prefiltered level. Other rays,
+// and primary rays, see the full resolution.
+///////////////////////////////////////////////////////////////////////////
+vec3 Lenvironment(const vec3& wi, float brdf_pdf = 0.0f, bool filtered = false);
+
+///////////////////////////////////////////////////////////////////////////
+// Set up a shadow ray from the hit toward the point light and return the
+// radiance reflected toward hit.wo, assuming the light is not occluded.
+///////////////////////////////////////////////////////////////////////////
+vec3 pointLightContribution(const Intersection& hit, Ray& shadow_ray);
+
+///////////////////////////////////////////////////////////////////////////
+// Pick a point on an emissive triangle, set up a shadow ray toward it and
+// return the radiance reflected toward hit.wo (MIS weighted against BRDF
+// sampling), assuming the point is not occluded. Uses the DIM_LIGHT and
+// DIM_LIGHT_SELECTION dimensions of the current bounce.
+///////////////////////////////////////////////////////////////////////////
+vec3 emissiveLightContribution(const Intersection& hit, Ray& shadow_ray);
+
+///////////////////////////////////////////////////////////////////////////
+// The MIS weight of emission hit by a ray that was sampled from a BRDF
+// with the given pdf. Primary rays, which no light sample could have
+// found, pass zero and get weight one.
+///////////////////////////////////////////////////////////////////////////
+float emissionWeight(const Ray& ray, float brdf_pdf);
+
+///////////////////////////////////////////////////////////////////////////
+// Pick a direction toward the environment map, in proportion to its
+// brightness, set up a shadow ray in that direction and return the
+// radiance reflected toward hit.wo (MIS weighted against BRDF sampling),
+// assuming the ray escapes. Returns zero at vertices that filter the
+// environment. Uses DIM_ENVIRONMENT of the current bounce.
+///////////////////////////////////////////////////////////////////////////
+vec3 environmentLightContribution(const Intersection& hit, Ray& shadow_ray);
+
+///////////////////////////////////////////////////////////////////////////
+// The MIS weight of the environment seen by a ray in direction wi that was
+// sampled from a BRDF with the given pdf (zero for primary rays), at a
+// vertex that filters the environment or not.
+///////////////////////////////////////////////////////////////////////////
+float environmentWeight(const vec3& wi, float brdf_pdf, bool filtered);
+
+///////////////////////////////////////////////////////////////////////////
+// Sample a direction to continue the path in. Returns the factor the path
+// throughput should be multiplied with (brdf * cos / pdf), which is zero
+// if the path should be terminated, and the pdf of the direction.
+///////////////////////////////////////////////////////////////////////////
+vec3 sampleNextRay(const Intersection& hit, Ray& next_ray, float& pdf);
+
+///////////////////////////////////////////////////////////////////////////
+// How many paths to trace for a pixel in the current pass. Zero if
+// adaptive sampling considers the pixel converged.
+///////////////////////////////////////////////////////////////////////////
+int pathsThisPass(int x, int y);
+
+///////////////////////////////////////////////////////////////////////////
+// True if restart() has been called since the current pass started. The
+// rest of the pass should then be skipped.
+///////////////////////////////////////////////////////////////////////////
+bool passCancelled();
+
+///////////////////////////////////////////////////////////////////////////
+// Add a new sample, and what its path adds to the AOVs, to the running
+// averages of a pixel
+///////////////////////////////////////////////////////////////////////////
+void accumulatePixel(int x, int y, const vec3& color, const PathAOVs& aovs);
+} // namespace pathtracer
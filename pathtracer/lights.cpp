@@ -0,0 +1,74 @@
+#include "lights.h"
+#include <memory>
+#include <algorithm>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The lights are replaced as a whole. The GUI may publish a new list at
+// any time, and each pass takes its own reference to the latest one, so a
+// list is never changed or freed while a pass still uses it.
+///////////////////////////////////////////////////////////////////////////
+struct LightList
+{
+	vector<EmissiveTriangle> triangles;
+	vector<int> geometry_offset;
+	AliasTable table;
+};
+static shared_ptr<const LightList> published_lights = make_shared<LightList>();
+static shared_ptr<const LightList> pass_lights = published_lights;
+
+void setEmissiveTriangles(vector<EmissiveTriangle> triangles, vector<int> geometry_offset)
+{
+	shared_ptr<LightList> lights = make_shared<LightList>();
+	vector<float> power(triangles.size());
+	for(size_t i = 0; i < triangles.size(); i++)
+	{
+		power[i] = dot(triangles[i].radiance, vec3(0.2126f, 0.7152f, 0.0722f)) * triangles[i].area;
+	}
+	lights->table.build(power);
+	lights->triangles = std::move(triangles);
+	lights->geometry_offset = std::move(geometry_offset);
+	atomic_store(&published_lights, shared_ptr<const LightList>(lights));
+}
+
+void updatePassLights()
+{
+	pass_lights = atomic_load(&published_lights);
+}
+
+size_t getNumberOfEmissiveTriangles()
+{
+	return pass_lights->table.empty() ? 0 : pass_lights->triangles.size();
+}
+
+EmissiveSample sampleEmissiveTriangle(const vec3& u)
+{
+	const LightList& lights = *pass_lights;
+	const uint32_t index = lights.table.sample(u.z);
+	const EmissiveTriangle& triangle = lights.triangles[index];
+	// Uniformly distributed barycentrics
+	const float su = sqrt(u.x);
+	EmissiveSample sample;
+	sample.position = triangle.p0 + su * (1.0f - u.y) * triangle.e1 + su * u.y * triangle.e2;
+	sample.normal = triangle.normal;
+	sample.radiance = triangle.radiance;
+	sample.pdf_area = lights.table.pmf[index] / triangle.area;
+	return sample;
+}
+
+float emissiveTrianglePdf(uint32_t geometry, uint32_t primID, const vec3& d, float t)
+{
+	const LightList& lights = *pass_lights;
+	if(lights.table.empty() || geometry >= lights.geometry_offset.size() || lights.geometry_offset[geometry] < 0)
+		return 0.0f;
+	const uint32_t index = uint32_t(lights.geometry_offset[geometry]) + primID;
+	const float cos_light = abs(dot(d, lights.triangles[index].normal));
+	if(cos_light <= 0.0f)
+		return 0.0f;
+	return lights.table.pmf[index] / lights.triangles[index].area * t * t / cos_light;
+}
+} // namespace pathtracer
@@ -0,0 +1,60 @@
+#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+#include "sampling.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A triangle of a mesh whose material emits light, in world space
+///////////////////////////////////////////////////////////////////////////
+struct EmissiveTriangle
+{
+	glm::vec3 p0, e1, e2;
+	glm::vec3 normal;
+	float area;
+	glm::vec3 radiance;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Replace the emissive triangles of the scene. geometry_offset holds, for
+// each geometry index (see getGeometryIndex()), the index of the geometry's first triangle in
+// triangles (the rest follow in primitive ID order), or -1 if the geometry
+// does not emit. The lights are picked in proportion to their power, with
+// an alias table. Takes effect from the next pass, so this can be called
+// while rendering.
+///////////////////////////////////////////////////////////////////////////
+void setEmissiveTriangles(std::vector<EmissiveTriangle> triangles, std::vector<int> geometry_offset);
+
+///////////////////////////////////////////////////////////////////////////
+// Pick up the lights set since the last pass. Called at the start of each
+// pass, so that the lights stay the same throughout it.
+///////////////////////////////////////////////////////////////////////////
+void updatePassLights();
+
+///////////////////////////////////////////////////////////////////////////
+// Number of emissive triangles in the current pass
+///////////////////////////////////////////////////////////////////////////
+size_t getNumberOfEmissiveTriangles();
+
+///////////////////////////////////////////////////////////////////////////
+// Pick an emissive triangle and a point on it. u.x and u.y place the
+// point, u.z picks the triangle. Returns the pdf of the point with respect
+// to area.
+///////////////////////////////////////////////////////////////////////////
+struct EmissiveSample
+{
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec3 radiance;
+	float pdf_area;
+};
+EmissiveSample sampleEmissiveTriangle(const glm::vec3& u);
+
+///////////////////////////////////////////////////////////////////////////
+// The solid angle pdf with which sampleEmissiveTriangle() would have
+// picked a point seen from distance t in direction d, on triangle primID
+// of the geometry with the given index. Zero if it does not emit.
+///////////////////////////////////////////////////////////////////////////
+float emissiveTrianglePdf(uint32_t geometry, uint32_t primID, const glm::vec3& d, float t);
+} // namespace pathtracer
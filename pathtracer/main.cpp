@@ -12,6 +12,10 @@
 #include <string>
 #include "Pathtracer.h"
 #include "embree.h"
+#include "scheduler.h"
+#include "headless.h"
+#include "wavefront.h"
+#include "renderthread.h"
 
 using namespace glm;
 using namespace std;
@@ -35,9 +39,12 @@ bool g_isMouseDragging = false;
 GLuint shaderProgram;
 
 ///////////////////////////////////////////////////////////////////////////////
-// GL texture to put pathtracing result into
+// The pathtracing result is shown through the texture of display.h
 ///////////////////////////////////////////////////////////////////////////////
-uint32_t pathtracer_result_txt_id;
+// Show how many paths each pixel got instead of the image
+bool show_sample_heatmap = false;
+// The last pass handed to us by the render thread
+const pathtracer::DisplayImage* displayed_image = nullptr;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Camera parameters.
@@ -50,6 +57,14 @@ vec3 worldUp(0.0f, 1.0f, 0.0f);
 // Models
 ///////////////////////////////////////////////////////////////////////////////
 vector<pair<labhelper::Model*, mat4>> models;
+// The pathtracer instance each model was placed as
+vector<uint32_t> model_instances;
+
+///////////////////////////////////////////////////////////////////////////////
+// The settings the GUI edits. The render thread traces from its own copy,
+// handed over with setRenderView() every frame.
+///////////////////////////////////////////////////////////////////////////////
+pathtracer::RenderSettings render_settings;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Load shaders, environment maps, models and so on
@@ -64,26 +79,50 @@ void initialize()
 	///////////////////////////////////////////////////////////////////////////
 	// Initial path-tracer settings
 	///////////////////////////////////////////////////////////////////////////
-	pathtracer::settings.max_bounces = 8;
-	pathtracer::settings.max_paths_per_pixel = 0; // 0 = Infinite
+	render_settings.settings.max_bounces = 8;
+	render_settings.settings.max_paths_per_pixel = 0; // 0 = Infinite
+	render_settings.settings.tile_size = 16;
+	render_settings.settings.packet_size = 8;
+	render_settings.settings.integrator = pathtracer::Integrator::Megakernel;
+	render_settings.settings.sampler = pathtracer::Sampler::Sobol;
+	render_settings.settings.adaptive_sampling = false;
+	render_settings.settings.adaptive_threshold = 0.02f;
+	render_settings.settings.adaptive_min_samples = 16;
+	render_settings.settings.filter_environment = true;
+	render_settings.settings.bvh_high_quality = false;
+	render_settings.settings.bvh_compact = false;
+	render_settings.settings.bvh_robust = false;
+	render_settings.settings.geometry_usage = pathtracer::GeometryUsage::Static;
+	render_settings.settings.denoise = false;
+	render_settings.settings.denoise_iterations = 5;
+	render_settings.settings.denoise_color_sigma = 4.0f;
+	// The viewer always writes the denoiser's guides, so that switching the
+	// denoiser on or off shows the image it has instead of restarting it
+	render_settings.settings.aovs = pathtracer::DENOISER_AOVS;
+	render_settings.settings.russian_roulette = true;
+	render_settings.settings.roulette_min_bounces = 3;
+	render_settings.settings.path_splitting = false;
+	render_settings.settings.split_threshold = 1.0f;
+	render_settings.settings.dynamic_resolution = true;
+	render_settings.settings.target_frame_time = 15.0f;
 #ifdef _DEBUG
-	pathtracer::settings.subsampling = 16;
+	render_settings.settings.subsampling = 16;
 #else
-	pathtracer::settings.subsampling = 4;
+	render_settings.settings.subsampling = 4;
 #endif
 
 	///////////////////////////////////////////////////////////////////////////
 	// Set up light
 	///////////////////////////////////////////////////////////////////////////
-	pathtracer::point_light.intensity_multiplier = 2500.0f;
-	pathtracer::point_light.color = vec3(1.f, 1.f, 1.f);
-	pathtracer::point_light.position = vec3(10.0f, 40.0f, 10.0f);
+	render_settings.point_light.intensity_multiplier = 2500.0f;
+	render_settings.point_light.color = vec3(1.f, 1.f, 1.f);
+	render_settings.point_light.position = vec3(10.0f, 40.0f, 10.0f);
 
 	///////////////////////////////////////////////////////////////////////////
 	// Load environment map
 	///////////////////////////////////////////////////////////////////////////
-	pathtracer::environment.map.load("../scenes/envmaps/001.hdr");
-	pathtracer::environment.multiplier = 1.0f;
+	pathtracer::environment.load("../scenes/envmaps/001.hdr");
+	render_settings.environment_multiplier = 1.0f;
 
 	///////////////////////////////////////////////////////////////////////////
 	// Load .obj models to scene
@@ -95,65 +134,56 @@ void initialize()
 	//models.push_back(make_pair(labhelper::loadModelFromOBJ("../scenes/BigSphere.obj"), mat4(1.0f)));
 
 	///////////////////////////////////////////////////////////////////////////
-	// Add models to pathtracer scene
+	// Add models to pathtracer scene. The BVH is built with the initial
+	// settings, from then on the render thread gets them each frame.
 	///////////////////////////////////////////////////////////////////////////
+	pathtracer::settings = render_settings.settings;
+	pathtracer::point_light = render_settings.point_light;
+	pathtracer::environment.multiplier = render_settings.environment_multiplier;
 	for(auto m : models)
 	{
-		pathtracer::addModel(m.first, m.second);
+		model_instances.push_back(pathtracer::addModel(m.first, m.second));
 	}
 	pathtracer::buildBVH();
-
-	///////////////////////////////////////////////////////////////////////////
-	// Generate result texture
-	///////////////////////////////////////////////////////////////////////////
-	glGenTextures(1, &pathtracer_result_txt_id);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, pathtracer_result_txt_id);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-	///////////////////////////////////////////////////////////////////////////
-	// This is INCORRECT! But an easy way to get us a brighter image that
-	// just looks a little better...
-	///////////////////////////////////////////////////////////////////////////
-	//glEnable(GL_FRAMEBUFFER_SRGB);
+	pathtracer::startRenderThread();
 }
 
 void display(void)
 {
-	{ ///////////////////////////////////////////////////////////////////////
-		// If first frame, or window resized, or subsampling changes,
-		// inform the pathtracer
-		///////////////////////////////////////////////////////////////////////
-		int w, h;
-		SDL_GetWindowSize(g_window, &w, &h);
-		static int old_subsampling;
-		if(windowWidth != w || windowHeight != h || old_subsampling != pathtracer::settings.subsampling)
-		{
-			pathtracer::resize(w, h);
-			windowWidth = w;
-			windowWidth = h;
-			old_subsampling = pathtracer::settings.subsampling;
-		}
-	}
-
 	///////////////////////////////////////////////////////////////////////////
-	// Trace one path per pixel
+	// Tell the render thread what to trace. If the camera, the window size
+	// or the subsampling changes, the pathtracer restarts. With dynamic
+	// resolution the render thread picks the subsampling itself.
 	///////////////////////////////////////////////////////////////////////////
+	SDL_GetWindowSize(g_window, &windowWidth, &windowHeight);
 	mat4 viewMatrix = lookAt(cameraPosition, cameraPosition + cameraDirection, worldUp);
-	mat4 projMatrix = perspective(radians(45.0f),
-	                              float(pathtracer::rendered_image.width)
-	                                  / float(pathtracer::rendered_image.height),
-	                              0.1f, 100.0f);
-	pathtracer::tracePaths(viewMatrix, projMatrix);
+	mat4 projMatrix = perspective(radians(45.0f), float(windowWidth) / float(windowHeight), 0.1f, 100.0f);
+	pathtracer::setRenderView(viewMatrix, projMatrix, windowWidth, windowHeight, render_settings);
 
 	///////////////////////////////////////////////////////////////////////////
-	// Copy pathtraced image to texture for display
+	// Stream the tiles of the latest pathtraced image that changed since
+	// they were last shown to the display texture. The heatmap is made and
+	// uploaded as a whole when there is a new pass or it is switched on.
 	///////////////////////////////////////////////////////////////////////////
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, pathtracer::rendered_image.width,
-	             pathtracer::rendered_image.height, 0, GL_RGB, GL_FLOAT, pathtracer::rendered_image.getPtr());
+	bool is_new;
+	displayed_image = pathtracer::latestImage(is_new);
+	static bool showed_sample_heatmap = false;
+	if(displayed_image != nullptr && show_sample_heatmap)
+	{
+		static vector<vec3> heatmap;
+		if(is_new || !showed_sample_heatmap)
+		{
+			pathtracer::sampleCountHeatmap(displayed_image->sample_count, heatmap);
+			pathtracer::uploadDisplayImage(displayed_image->width, displayed_image->height, heatmap.data(),
+			                               nullptr, true);
+		}
+	}
+	else if(displayed_image != nullptr)
+	{
+		pathtracer::uploadDisplayImage(displayed_image->width, displayed_image->height,
+		                               displayed_image->data.data(), displayed_image->tile_version.data(), false);
+	}
+	showed_sample_heatmap = show_sample_heatmap;
 
 	///////////////////////////////////////////////////////////////////////////
 	// Render a fullscreen quad, textured with our pathtraced image.
@@ -163,8 +193,9 @@ void display(void)
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
-	SDL_GetWindowSize(g_window, &windowWidth, &windowHeight);
 	glUseProgram(shaderProgram);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, pathtracer::getDisplayTexture());
 	labhelper::drawFullScreenQuad();
 }
 
@@ -304,9 +335,122 @@ void gui()
 	///////////////////////////////////////////////////////////////////////////
 	if(ImGui::CollapsingHeader("Pathtracer", "pathtracer_ch", true, true))
 	{
-		ImGui::SliderInt("Subsampling", &pathtracer::settings.subsampling, 1, 16);
-		ImGui::SliderInt("Max Bounces", &pathtracer::settings.max_bounces, 0, 16);
-		ImGui::SliderInt("Max Paths Per Pixel", &pathtracer::settings.max_paths_per_pixel, 0, 1024);
+		ImGui::Checkbox("Dynamic Resolution", &render_settings.settings.dynamic_resolution);
+		if(render_settings.settings.dynamic_resolution)
+		{
+			ImGui::SliderFloat("Target Frame Time (ms)", &render_settings.settings.target_frame_time, 5.0f, 100.0f);
+			if(displayed_image != nullptr)
+			{
+				ImGui::Text("Subsampling %d, last pass %.1f ms", displayed_image->subsampling,
+				            displayed_image->pass_time);
+			}
+		}
+		else
+		{
+			ImGui::SliderInt("Subsampling", &render_settings.settings.subsampling, 1, 16);
+		}
+		ImGui::SliderInt("Max Bounces", &render_settings.settings.max_bounces, 0, 16);
+		ImGui::SliderInt("Max Paths Per Pixel", &render_settings.settings.max_paths_per_pixel, 0, 1024);
+		int integrator = int(render_settings.settings.integrator);
+		if(ImGui::Combo("Integrator", &integrator, "Megakernel\0Wavefront\0\0"))
+		{
+			render_settings.settings.integrator = pathtracer::Integrator(integrator);
+			pathtracer::restart();
+		}
+		int sampler = int(render_settings.settings.sampler);
+		if(ImGui::Combo("Sampler", &sampler, "Independent\0Sobol (Owen scrambled)\0\0"))
+		{
+			render_settings.settings.sampler = pathtracer::Sampler(sampler);
+			pathtracer::restart();
+		}
+		if(render_settings.settings.integrator == pathtracer::Integrator::Wavefront && displayed_image != nullptr)
+		{
+			const pathtracer::WavefrontStats& ws = displayed_image->wavefront_stats;
+			ImGui::Text("Stages (ms): generate %.1f, extend %.1f, shade %.1f", ws.generate, ws.extend, ws.shade);
+			ImGui::Text("             connect %.1f, accumulate %.1f", ws.connect, ws.accumulate);
+			ImGui::Text("Rays: %d extension, %d shadow", ws.extension_rays, ws.shadow_rays);
+		}
+		if(ImGui::Checkbox("Russian Roulette", &render_settings.settings.russian_roulette))
+			pathtracer::restart();
+		if(render_settings.settings.russian_roulette
+		   && ImGui::SliderInt("Roulette After Bounces", &render_settings.settings.roulette_min_bounces, 0, 16))
+		{
+			pathtracer::restart();
+		}
+		if(ImGui::Checkbox("Path Splitting", &render_settings.settings.path_splitting))
+			pathtracer::restart();
+		if(render_settings.settings.path_splitting
+		   && ImGui::SliderFloat("Split Threshold", &render_settings.settings.split_threshold, 0.25f, 8.0f))
+		{
+			pathtracer::restart();
+		}
+		if(displayed_image != nullptr)
+		{
+			const pathtracer::PathStats& ps = displayed_image->path_stats;
+			ImGui::Text("Path length %.2f, rays per sample %.2f", ps.average_path_length, ps.rays_per_sample);
+			ImGui::Text("Per path: %.3f splits, %.3f ended by roulette", ps.splits_per_path,
+			            ps.roulette_terminations_per_path);
+		}
+		ImGui::Checkbox("Adaptive Sampling", &render_settings.settings.adaptive_sampling);
+		if(render_settings.settings.adaptive_sampling)
+		{
+			ImGui::SliderFloat("Relative Error Threshold", &render_settings.settings.adaptive_threshold, 0.001f, 0.2f,
+			                   "%.3f", 2.0f);
+			ImGui::SliderInt("Min Paths Per Pixel", &render_settings.settings.adaptive_min_samples, 2, 256);
+			if(displayed_image != nullptr)
+			{
+				ImGui::Text("Pixels still refining: %d / %d", displayed_image->active_pixels,
+				            displayed_image->width * displayed_image->height);
+			}
+		}
+		ImGui::Checkbox("Show Sample Count Heatmap", &show_sample_heatmap);
+		int tonemap = int(pathtracer::display_settings.tonemap);
+		if(ImGui::Combo("Tonemap", &tonemap, "Clamp\0Reinhard\0ACES\0\0"))
+			pathtracer::display_settings.tonemap = pathtracer::Tonemap(tonemap);
+		ImGui::SliderFloat("Exposure", &pathtracer::display_settings.exposure, -8.0f, 8.0f);
+		ImGui::Checkbox("sRGB", &pathtracer::display_settings.srgb);
+		int format = int(pathtracer::display_settings.format);
+		if(ImGui::Combo("Display Format", &format, "RGBA8\0RGBA16F\0\0"))
+			pathtracer::display_settings.format = pathtracer::DisplayFormat(format);
+		const pathtracer::DisplayStats& ds = pathtracer::display_stats;
+		ImGui::Text("Display: %d / %d tiles, %.1f MB uploaded, packed in %.2f ms%s", ds.uploaded_tiles,
+		            ds.total_tiles, ds.uploaded_bytes / (1024.0f * 1024.0f), ds.pack_time,
+		            ds.persistent ? "" : " (no persistent mapping)");
+		ImGui::Checkbox("Denoise", &render_settings.settings.denoise);
+		if(render_settings.settings.denoise)
+		{
+			ImGui::SliderInt("Denoise Iterations", &render_settings.settings.denoise_iterations, 1, 8);
+			ImGui::SliderFloat("Denoise Color Sigma", &render_settings.settings.denoise_color_sigma, 0.5f, 32.0f,
+			                   "%.1f", 2.0f);
+			if(displayed_image != nullptr && displayed_image->denoised)
+				ImGui::Text("Denoised in %.1f ms", displayed_image->denoise_stats.time);
+		}
+		const pathtracer::BVHStats bvh = pathtracer::getBVHStats();
+		ImGui::Text("BVH: %d triangles, %d instances, %.1f MB, built in %.0f ms", int(bvh.triangles),
+		            int(bvh.instances), bvh.bvh_bytes / (1024.0f * 1024.0f), bvh.build_ms);
+		ImGui::Text("Embree memory: %.1f MB (peak %.1f MB)", bvh.embree_bytes / (1024.0f * 1024.0f),
+		            bvh.embree_peak_bytes / (1024.0f * 1024.0f));
+		ImGui::SliderInt("Tile Size", &render_settings.settings.tile_size, 4, 64);
+		static const int packet_sizes[] = { 1, 4, 8, 16 };
+		int packet_index = 0;
+		while(packet_index < 3 && packet_sizes[packet_index] < render_settings.settings.packet_size)
+			packet_index++;
+		if(ImGui::Combo("Primary Ray Packets", &packet_index, "Off\0" "4 (2x2)\0" "8 (4x2)\0" "16 (4x4)\0\0"))
+		{
+			render_settings.settings.packet_size = packet_sizes[packet_index];
+		}
+		static const pathtracer::TileStats no_stats;
+		const pathtracer::TileStats& stats = displayed_image != nullptr ? displayed_image->tile_stats : no_stats;
+		ImGui::Text("Pass: %.1f ms, %d tiles, %d steals", stats.pass_time, int(stats.tile_cost.size()),
+		            stats.number_of_steals);
+		ImGui::Text("Tile cost (ms): min %.3f, mean %.3f, max %.3f", stats.min_tile_cost, stats.mean_tile_cost,
+		            stats.max_tile_cost);
+		ImGui::Text("Thread load imbalance: %.2fx", stats.imbalance);
+		if(!stats.tile_cost.empty())
+		{
+			ImGui::PlotHistogram("Tile cost", stats.tile_cost.data(), int(stats.tile_cost.size()), 0, NULL,
+			                     0.0f, stats.max_tile_cost, ImVec2(0, 60));
+		}
 		if(ImGui::Button("Restart Pathtracing"))
 		{
 			pathtracer::restart();
@@ -354,6 +498,8 @@ void gui()
 			                int(model->m_materials.size())))
 			{
 				mesh.m_material_idx = material_index;
+				pathtracer::updateMaterials();
+				pathtracer::restart();
 			}
 		}
 
@@ -371,13 +517,20 @@ void gui()
 			{
 				material.m_name = name;
 			}
-			ImGui::ColorEdit3("Color", &material.m_color.x);
-			ImGui::SliderFloat("Reflectivity", &material.m_reflectivity, 0.0f, 1.0f);
-			ImGui::SliderFloat("Metalness", &material.m_metalness, 0.0f, 1.0f);
-			ImGui::SliderFloat("Fresnel", &material.m_fresnel, 0.0f, 1.0f);
-			ImGui::SliderFloat("shininess", &material.m_shininess, 0.0f, 25000.0f);
-			ImGui::SliderFloat("Emission", &material.m_emission, 0.0f, 10.0f);
-			ImGui::SliderFloat("Transparency", &material.m_transparency, 0.0f, 1.0f);
+			bool material_changed = false;
+			material_changed |= ImGui::ColorEdit3("Color", &material.m_color.x);
+			material_changed |= ImGui::SliderFloat("Reflectivity", &material.m_reflectivity, 0.0f, 1.0f);
+			material_changed |= ImGui::SliderFloat("Metalness", &material.m_metalness, 0.0f, 1.0f);
+			material_changed |= ImGui::SliderFloat("Fresnel", &material.m_fresnel, 0.0f, 1.0f);
+			material_changed |= ImGui::SliderFloat("shininess", &material.m_shininess, 0.0f, 25000.0f);
+			material_changed |= ImGui::SliderFloat("Emission", &material.m_emission, 0.0f, 10.0f);
+			material_changed |= ImGui::SliderFloat("Transparency", &material.m_transparency, 0.0f, 1.0f);
+			if(material_changed)
+			{
+				// The pathtracer works on compiled copies of the materials
+				pathtracer::updateMaterials();
+				pathtracer::restart();
+			}
 
 			///////////////////////////////////////////////////////////////////////////
 			// A button for saving your results
@@ -389,14 +542,47 @@ void gui()
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// Move the ship around, to try out updating the scene while rendering
+	///////////////////////////////////////////////////////////////////////////
+	if(ImGui::CollapsingHeader("Animation", "animation_ch", true, false))
+	{
+		static bool spin_ship = false;
+		static float ship_angle = 0.0f;
+		static float ship_height = 10.0f;
+		bool ship_moved = ImGui::Checkbox("Spin ship", &spin_ship);
+		ship_moved |= ImGui::SliderFloat("Ship angle", &ship_angle, 0.0f, 360.0f);
+		ship_moved |= ImGui::SliderFloat("Ship height", &ship_height, 0.0f, 30.0f);
+		if(spin_ship)
+		{
+			ship_angle = fmodf(ship_angle + 45.0f * ImGui::GetIO().DeltaTime, 360.0f);
+			ship_moved = true;
+		}
+		if(ship_moved)
+		{
+			models[0].second =
+			    translate(vec3(0.0f, ship_height, 0.0f)) * rotate(radians(ship_angle), vec3(0.0f, 1.0f, 0.0f));
+			pathtracer::updateInstanceTransform(model_instances[0], models[0].second);
+			pathtracer::restart();
+		}
+		if(displayed_image != nullptr)
+		{
+			const pathtracer::SceneUpdateStats& us = displayed_image->scene_update_stats;
+			ImGui::Text("Last scene update: %d instances, BVH %.2f ms, lights %.2f ms", us.moved_instances,
+			            us.bvh_ms, us.lights_ms);
+		}
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// Light and environment map
 	///////////////////////////////////////////////////////////////////////////
 	if(ImGui::CollapsingHeader("Light sources", "lights_ch", true, true))
 	{
-		ImGui::SliderFloat("Environment multiplier", &pathtracer::environment.multiplier, 0.0f, 10.0f);
-		ImGui::ColorEdit3("Point light color", &pathtracer::point_light.color.x);
-		ImGui::SliderFloat("Point light intensity multiplier", &pathtracer::point_light.intensity_multiplier,
+		ImGui::SliderFloat("Environment multiplier", &render_settings.environment_multiplier, 0.0f, 10.0f);
+		if(ImGui::Checkbox("Prefiltered environment on diffuse bounces", &render_settings.settings.filter_environment))
+			pathtracer::restart();
+		ImGui::ColorEdit3("Point light color", &render_settings.point_light.color.x);
+		ImGui::SliderFloat("Point light intensity multiplier", &render_settings.point_light.intensity_multiplier,
 		                   0.0f, 10000.0f);
 	}
 
@@ -408,6 +594,12 @@ void gui()
 
 int main(int argc, char* argv[])
 {
+	// Batch rendering on machines without a display
+	if(isHeadless(argc, argv))
+	{
+		return runHeadless(argc, argv);
+	}
+
 	g_window = labhelper::init_window_SDL("Pathtracer", 1280, 720);
 
 	initialize();
@@ -435,6 +627,10 @@ int main(int argc, char* argv[])
 		stopRendering = handleEvents();
 	}
 
+	// Stop tracing before the scene goes away
+	pathtracer::stopRenderThread();
+	pathtracer::destroyDisplay();
+
 	// Delete Models
 	for(auto& m : models)
 	{
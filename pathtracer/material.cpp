@@ -3,88 +3,158 @@
 
 namespace pathtracer
 {
+MaterialRecord compileMaterial(const labhelper::Material& material)
+{
+	MaterialRecord m;
+	m.color = material.m_color;
+	m.emission = material.m_emission * material.m_color;
+	m.reflectivity = material.m_reflectivity;
+	m.metalness = material.m_metalness;
+	m.fresnel = material.m_fresnel;
+	m.shininess = material.m_shininess;
+	m.type = m.reflectivity > 0.0f ? MATERIAL_LAYERED : MATERIAL_DIFFUSE;
+	// The metal only has a microfacet lobe, the dielectric samples its
+	// microfacet lobe and its diffuse base half of the time each.
+	m.specular_probability =
+	    m.type == MATERIAL_LAYERED ? m.reflectivity * (m.metalness + 0.5f * (1.0f - m.metalness)) : 0.0f;
+	return m;
+}
+
 ///////////////////////////////////////////////////////////////////////////
-// A Lambertian (diffuse) material
+// A Lambertian (diffuse) lobe
 ///////////////////////////////////////////////////////////////////////////
-vec3 Diffuse::f(const vec3& wi, const vec3& wo, const vec3& n)
+static vec3 diffuseF(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n)
 {
 	if(dot(wi, n) <= 0.0f)
 		return vec3(0.0f);
 	if(!sameHemisphere(wi, wo, n))
 		return vec3(0.0f);
-	return (1.0f / M_PI) * color;
+	return (1.0f / M_PI) * m.color;
 }
 
-vec3 Diffuse::sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p)
+static float cosinePdf(const vec3& wi, const vec3& n)
 {
-	vec3 tangent = normalize(perpendicular(n));
-	vec3 bitangent = normalize(cross(tangent, n));
-	vec3 sample = cosineSampleHemisphere();
-	wi = normalize(sample.x * tangent + sample.y * bitangent + sample.z * n);
-	if(dot(wi, n) <= 0.0f)
-		p = 0.0f;
-	else
-		p = max(0.0f, dot(n, wi)) / M_PI;
-	return f(wi, wo, n);
+	return max(0.0f, dot(n, wi)) / M_PI;
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// A Blinn Phong Dielectric Microfacet BRFD
+// A Blinn Phong microfacet lobe
 ///////////////////////////////////////////////////////////////////////////
-vec3 BlinnPhong::refraction_brdf(const vec3& wi, const vec3& wo, const vec3& n)
+static float fresnel(const MaterialRecord& m, const vec3& wi, const vec3& wh)
 {
-	return vec3(0.0f);
+	return m.fresnel + (1.0f - m.fresnel) * pow(1.0f - max(0.0f, dot(wh, wi)), 5.0f);
 }
-vec3 BlinnPhong::reflection_brdf(const vec3& wi, const vec3& wo, const vec3& n)
+
+// The microfacet reflection (F * D * G / (4 * (n.wo) * (n.wi))) without
+// any color
+static float blinnPhongReflection(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n)
 {
-	return vec3(0.0f);
+	const float ndotwi = dot(n, wi);
+	const float ndotwo = dot(n, wo);
+	if(ndotwi <= 0.0f || ndotwo <= 0.0f)
+		return 0.0f;
+	const vec3 wh = normalize(wi + wo);
+	const float ndotwh = max(0.0f, dot(n, wh));
+	const float wodotwh = max(EPSILON, dot(wo, wh));
+	const float D = (m.shininess + 2.0f) / (2.0f * M_PI) * pow(ndotwh, m.shininess);
+	const float G = min(1.0f, min(2.0f * ndotwh * ndotwo / wodotwh, 2.0f * ndotwh * ndotwi / wodotwh));
+	return fresnel(m, wi, wh) * D * G / (4.0f * ndotwo * ndotwi);
 }
 
-vec3 BlinnPhong::f(const vec3& wi, const vec3& wo, const vec3& n)
+static float blinnPhongPdf(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n)
 {
-	return reflection_brdf(wi, wo, n) + refraction_brdf(wi, wo, n);
+	if(dot(n, wi) <= 0.0f)
+		return 0.0f;
+	const vec3 wh = normalize(wi + wo);
+	const float pdf_wh = (m.shininess + 1.0f) / (2.0f * M_PI) * pow(max(0.0f, dot(n, wh)), m.shininess);
+	return pdf_wh / (4.0f * max(EPSILON, dot(wo, wh)));
 }
 
-vec3 BlinnPhong::sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p)
+static vec3 layeredF(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n)
 {
-	vec3 tangent = normalize(perpendicular(n));
-	vec3 bitangent = normalize(cross(tangent, n));
-	vec3 sample = cosineSampleHemisphere();
-	wi = normalize(sample.x * tangent + sample.y * bitangent + sample.z * n);
-	if(dot(wi, n) <= 0.0f)
-		p = 0.0f;
-	else
-		p = max(0.0f, dot(n, wi)) / M_PI;
-	return f(wi, wo, n);
+	const float reflection = blinnPhongReflection(m, wi, wo, n);
+	const vec3 diffuse = diffuseF(m, wi, wo, n);
+	const vec3 metal = reflection * m.color;
+	const vec3 dielectric = vec3(reflection) + (1.0f - fresnel(m, wi, normalize(wi + wo))) * diffuse;
+	return m.reflectivity * (m.metalness * metal + (1.0f - m.metalness) * dielectric)
+	       + (1.0f - m.reflectivity) * diffuse;
 }
 
-///////////////////////////////////////////////////////////////////////////
-// A Blinn Phong Metal Microfacet BRFD (extends the BlinnPhong class)
-///////////////////////////////////////////////////////////////////////////
-vec3 BlinnPhongMetal::refraction_brdf(const vec3& wi, const vec3& wo, const vec3& n)
+vec3 evaluateMaterial(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n)
 {
-	return vec3(0.0f);
+	switch(m.type)
+	{
+	case MATERIAL_DIFFUSE:
+		return diffuseF(m, wi, wo, n);
+	case MATERIAL_LAYERED:
+	default:
+		return layeredF(m, wi, wo, n);
+	}
 }
-vec3 BlinnPhongMetal::reflection_brdf(const vec3& wi, const vec3& wo, const vec3& n)
-{
-	return BlinnPhong::reflection_brdf(wi, wo, n) * color;
-};
 
 ///////////////////////////////////////////////////////////////////////////
-// A Linear Blend between two BRDFs
+// Sampling. Diffuse materials are sampled with a cosine distribution.
+// Layered materials pick either the cosine distribution or the microfacet
+// distribution, and return the full brdf and the pdf of the mixture of
+// both, so that every lobe is accounted for no matter which one was
+// picked.
 ///////////////////////////////////////////////////////////////////////////
-vec3 LinearBlend::f(const vec3& wi, const vec3& wo, const vec3& n)
+static vec3 sampleCosine(const vec3& n, const vec2& u)
 {
-	return vec3(0.0);
+	vec3 tangent = normalize(perpendicular(n));
+	vec3 bitangent = normalize(cross(tangent, n));
+	vec3 sample = cosineSampleHemisphere(u);
+	return normalize(sample.x * tangent + sample.y * bitangent + sample.z * n);
 }
 
-vec3 LinearBlend::sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p)
+static vec3 sampleBlinnPhong(const MaterialRecord& m, const vec3& wo, const vec3& n, const vec2& u)
 {
-	p = 0.0f;
-	return vec3(0.0f);
+	vec3 tangent = normalize(perpendicular(n));
+	vec3 bitangent = normalize(cross(tangent, n));
+	const float phi = 2.0f * M_PI * u.x;
+	const float cos_theta = pow(u.y, 1.0f / (m.shininess + 1.0f));
+	const float sin_theta = sqrt(max(0.0f, 1.0f - cos_theta * cos_theta));
+	const vec3 wh = normalize(sin_theta * cos(phi) * tangent + sin_theta * sin(phi) * bitangent + cos_theta * n);
+	return reflect(-wo, wh);
 }
 
-///////////////////////////////////////////////////////////////////////////
-// A perfect specular refraction.
-///////////////////////////////////////////////////////////////////////////
-} // namespace pathtracer
\ No newline at end of file
+vec3 sampleMaterial(const MaterialRecord& m, vec3& wi, const vec3& wo, const vec3& n, float& p)
+{
+	const vec2 u = sample2D(DIM_DIRECTION);
+	switch(m.type)
+	{
+	case MATERIAL_DIFFUSE:
+		wi = sampleCosine(n, u);
+		p = dot(wi, n) <= 0.0f ? 0.0f : cosinePdf(wi, n);
+		return diffuseF(m, wi, wo, n);
+	case MATERIAL_LAYERED:
+	default:
+		if(sample1D(DIM_LOBE) < m.specular_probability)
+			wi = sampleBlinnPhong(m, wo, n, u);
+		else
+			wi = sampleCosine(n, u);
+		if(dot(wi, n) <= 0.0f)
+		{
+			p = 0.0f;
+			return vec3(0.0f);
+		}
+		p = materialPdf(m, wi, wo, n);
+		return layeredF(m, wi, wo, n);
+	}
+}
+
+float materialPdf(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n)
+{
+	if(dot(wi, n) <= 0.0f)
+		return 0.0f;
+	switch(m.type)
+	{
+	case MATERIAL_DIFFUSE:
+		return cosinePdf(wi, n);
+	case MATERIAL_LAYERED:
+	default:
+		return m.specular_probability * blinnPhongPdf(m, wi, wo, n)
+		       + (1.0f - m.specular_probability) * cosinePdf(wi, n);
+	}
+}
+} // namespace pathtracer
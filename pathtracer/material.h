@@ -1,5 +1,6 @@
 #pragma once
 #include <glm/glm.hpp>
+#include <Model.h>
 #include "Pathtracer.h"
 #include "sampling.h"
 
@@ -8,77 +9,64 @@ using namespace glm;
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////
-// The interface for any BRDF.
+// The kinds of materials, from the cheapest to evaluate to the most
+// expensive. Every material record is evaluated with a switch on its type,
+// so integrators that group hits by type (as the wavefront integrator
+// does) run the same case over a whole batch.
 ///////////////////////////////////////////////////////////////////////////
-class BRDF
+enum MaterialType : uint32_t
 {
-public:
-	// Return the value of the brdf for specific directions
-	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) = 0;
-	// Sample a suitable direction and return the brdf in that direction as
-	// well as the pdf (~probability) that the direction was chosen.
-	virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) = 0;
+	// A Lambertian surface
+	MATERIAL_DIFFUSE,
+	// The full layered model: a blend of a Blinn Phong metal, a Blinn
+	// Phong dielectric on top of a diffuse base, and the diffuse base alone
+	MATERIAL_LAYERED,
+	NUMBER_OF_MATERIAL_TYPES
 };
 
 ///////////////////////////////////////////////////////////////////////////
-// A Lambertian (diffuse) material
+// A labhelper::Material compiled into a plain record that can be copied
+// around and evaluated without any allocations or virtual calls. The
+// layered model is
+//   f = reflectivity * (metalness * metal + (1 - metalness) * dielectric)
+//       + (1 - reflectivity) * diffuse
+// where the dielectric lets through what it does not reflect (1 - F) to
+// the diffuse base.
 ///////////////////////////////////////////////////////////////////////////
-class Diffuse : public BRDF
+struct MaterialRecord
 {
-public:
 	vec3 color;
-	Diffuse(vec3 c) : color(c)
-	{
-	}
-	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) override;
-	virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) override;
+	MaterialType type;
+	// Emitted radiance
+	vec3 emission;
+	float reflectivity;
+	float metalness;
+	float fresnel;
+	float shininess;
+	// How often sample() picks the microfacet lobe over the cosine lobe
+	float specular_probability;
 };
 
 ///////////////////////////////////////////////////////////////////////////
-// A Blinn Phong Dielectric Microfacet BRFD
+// Turn a material from a model into a record. Must be called again (see
+// updateMaterials()) if the material is edited.
 ///////////////////////////////////////////////////////////////////////////
-class BlinnPhong : public BRDF
-{
-public:
-	float shininess;
-	float R0;
-	BRDF* refraction_layer;
-	BlinnPhong(float _shininess, float _R0, BRDF* _refraction_layer = NULL)
-	    : shininess(_shininess), R0(_R0), refraction_layer(_refraction_layer)
-	{
-	}
-	virtual vec3 refraction_brdf(const vec3& wi, const vec3& wo, const vec3& n);
-	virtual vec3 reflection_brdf(const vec3& wi, const vec3& wo, const vec3& n);
-	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) override;
-	virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) override;
-};
+MaterialRecord compileMaterial(const labhelper::Material& material);
 
 ///////////////////////////////////////////////////////////////////////////
-// A Blinn Phong Metal Microfacet BRFD (extends the BlinnPhong class)
+// Return the value of the brdf for specific directions
 ///////////////////////////////////////////////////////////////////////////
-class BlinnPhongMetal : public BlinnPhong
-{
-public:
-	vec3 color;
-	BlinnPhongMetal(vec3 c, float _shininess, float _R0) : color(c), BlinnPhong(_shininess, _R0)
-	{
-	}
-	virtual vec3 refraction_brdf(const vec3& wi, const vec3& wo, const vec3& n);
-	virtual vec3 reflection_brdf(const vec3& wi, const vec3& wo, const vec3& n);
-};
+vec3 evaluateMaterial(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n);
 
 ///////////////////////////////////////////////////////////////////////////
-// A Linear Blend between two BRDFs
+// Sample a suitable direction and return the brdf in that direction as
+// well as the pdf (~probability) that the direction was chosen. Uses the
+// DIM_LOBE and DIM_DIRECTION dimensions of the current bounce.
 ///////////////////////////////////////////////////////////////////////////
-class LinearBlend : public BRDF
-{
-public:
-	float w;
-	BRDF* bsdf0;
-	BRDF* bsdf1;
-	LinearBlend(float _w, BRDF* a, BRDF* b) : w(_w), bsdf0(a), bsdf1(b){};
-	virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) override;
-	virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) override;
-};
+vec3 sampleMaterial(const MaterialRecord& m, vec3& wi, const vec3& wo, const vec3& n, float& p);
 
-} // namespace pathtracer
\ No newline at end of file
+///////////////////////////////////////////////////////////////////////////
+// The pdf with which sampleMaterial() would pick wi
+///////////////////////////////////////////////////////////////////////////
+float materialPdf(const MaterialRecord& m, const vec3& wi, const vec3& wo, const vec3& n);
+} // namespace pathtracer
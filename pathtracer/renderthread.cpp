@@ -0,0 +1,399 @@
+#include "renderthread.h"
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The view requested by the display, and the one currently rendered
+///////////////////////////////////////////////////////////////////////////
+struct RenderView
+{
+	mat4 V = mat4(1.0f), P = mat4(1.0f);
+	int window_width = 0, window_height = 0;
+	int subsampling = 0;
+	bool dynamic_resolution = false;
+	bool sameCamera(const RenderView& o) const
+	{
+		return V == o.V && P == o.P && window_width == o.window_width && window_height == o.window_height;
+	}
+	bool operator==(const RenderView& o) const
+	{
+		return sameCamera(o) && subsampling == o.subsampling && dynamic_resolution == o.dynamic_resolution;
+	}
+};
+static mutex requested_view_lock;
+static RenderView requested_view;
+static RenderSettings requested_settings;
+// When the camera (or window size) last changed, and how long it went
+// unchanged before that, in ms
+static chrono::steady_clock::time_point camera_changed_time;
+static float camera_change_interval = 0.0f;
+
+static thread render_thread;
+static atomic<bool> stop_rendering{ false };
+
+///////////////////////////////////////////////////////////////////////////
+// Completed passes are handed to the display through a triple buffer:
+// the render thread fills one buffer, the display reads another, and the
+// third holds the latest completed pass. Finishing or picking up a pass
+// is a single atomic exchange, so neither side ever waits for the other.
+///////////////////////////////////////////////////////////////////////////
+static DisplayImage display_buffers[3];
+static const int NEW_IMAGE_BIT = 4;
+static int write_index = 0;
+static atomic<int> ready_index{ 1 };
+static int read_index = 2;
+static bool has_image = false;
+
+///////////////////////////////////////////////////////////////////////////
+// The denoiser settings the last published image was made with, so that
+// a finished image can be published again when they change
+///////////////////////////////////////////////////////////////////////////
+struct DenoiseView
+{
+	bool denoise = false;
+	int iterations = 0;
+	float color_sigma = 0.0f;
+	bool operator==(const DenoiseView& o) const
+	{
+		return denoise == o.denoise && iterations == o.iterations && color_sigma == o.color_sigma;
+	}
+};
+static DenoiseView published_denoise_view;
+
+///////////////////////////////////////////////////////////////////////////
+// Dynamic resolution. The time tracePaths() takes per pixel is measured
+// on every pass, and while the camera moves each pass is traced at the
+// subsampling that should make it take settings.target_frame_time. Once
+// the camera has stopped, the subsampling is halved after every completed
+// pass, each step starting the accumulation over, until the image is at
+// full resolution.
+//
+// A pass often finishes before the display sends the next camera, so the
+// camera only counts as stopped once it has gone unchanged for
+// STILL_FRAMES frames: target frame times, or the time between the last
+// two camera changes if the display is slower than that. Refining while
+// the camera still moves would trace passes four times as costly that the
+// next camera change throws away.
+///////////////////////////////////////////////////////////////////////////
+static const int MAX_SUBSAMPLING = 16;
+static const float STILL_FRAMES = 4.0f;
+// The longest frame that stopping is judged by, in ms, so that a camera
+// that moved once after a long pause refines soon after
+static const float MAX_STILL_FRAME_TIME = 250.0f;
+struct ResolutionController
+{
+	// Smoothed time per pixel of a pass, in ms (0 until measured)
+	float pixel_time = 0.0f;
+	// The subsampling of the current pass, 0 before the first one
+	int subsampling = 0;
+
+	void measure(float pass_time, int pixels, bool completed)
+	{
+		const float time = pass_time / float(std::max(pixels, 1));
+		if(completed)
+			pixel_time = pixel_time == 0.0f ? time : 0.5f * (pixel_time + time);
+		else
+			// A cancelled pass only tells that a whole one would have taken
+			// longer than this
+			pixel_time = std::max(pixel_time, time);
+	}
+
+	static int startSubsampling()
+	{
+		return std::min(std::max(settings.subsampling, 1), MAX_SUBSAMPLING);
+	}
+
+	// The predicted time of a pass traced at the given subsampling
+	float passTime(const RenderView& view, int s) const
+	{
+		return pixel_time * float((view.window_width / s) * (view.window_height / s));
+	}
+
+	// The smallest subsampling whose passes are predicted to take at most
+	// the given time
+	int fit(const RenderView& view, float time) const
+	{
+		int s = 1;
+		while(s < MAX_SUBSAMPLING && passTime(view, s) > time)
+			s++;
+		return s;
+	}
+
+	// The subsampling of the next pass while the camera moves. It only goes
+	// finer when there is some headroom, so that noise in the measured times
+	// does not make it flip between two factors from one pass to the next.
+	int moving(const RenderView& view)
+	{
+		if(pixel_time == 0.0f)
+		{
+			if(subsampling == 0)
+				subsampling = startSubsampling();
+			return subsampling;
+		}
+		const float target = std::max(settings.target_frame_time, 1.0f);
+		const int fast_enough = fit(view, target);
+		const int with_headroom = fit(view, 0.8f * target);
+		if(fast_enough > subsampling)
+			subsampling = fast_enough;
+		else if(with_headroom < subsampling)
+			subsampling = with_headroom;
+		return subsampling;
+	}
+
+	// How long the camera must go unchanged to count as stopped, in ms
+	static float stillTime(float change_interval)
+	{
+		const float frame = std::max(settings.target_frame_time, change_interval);
+		return STILL_FRAMES * std::min(frame, MAX_STILL_FRAME_TIME);
+	}
+
+	// The subsampling of the next pass once the camera has stopped. refine
+	// is set if the last pass was completed.
+	int still(bool refine)
+	{
+		if(subsampling == 0)
+			subsampling = startSubsampling();
+		else if(refine)
+			subsampling = std::max(1, subsampling / 2);
+		return subsampling;
+	}
+};
+static ResolutionController resolution;
+static int pass_subsampling = 1;
+static float pass_time = 0.0f;
+
+///////////////////////////////////////////////////////////////////////////
+// The current version of every display tile, and the sample counts and
+// size of the last published pass to find the tiles that changed since
+///////////////////////////////////////////////////////////////////////////
+static vector<uint32_t> tile_versions;
+static uint32_t next_tile_version = 1;
+static vector<int> published_sample_count;
+static int published_width = 0, published_height = 0, published_samples = 0;
+
+static void updateTileVersions()
+{
+	const int width = rendered_image.width, height = rendered_image.height;
+	const int tiles_x = (width + DISPLAY_TILE_SIZE - 1) / DISPLAY_TILE_SIZE;
+	const int tiles_y = (height + DISPLAY_TILE_SIZE - 1) / DISPLAY_TILE_SIZE;
+	// After a restart or resize, or through the denoiser, any pixel may
+	// have changed. Otherwise only the pixels that got more paths did.
+	const bool all = width != published_width || height != published_height
+	                 || rendered_image.number_of_samples <= published_samples || settings.denoise;
+	tile_versions.resize(tiles_x * tiles_y);
+	for(int t = 0; t < tiles_x * tiles_y; t++)
+	{
+		bool changed = all;
+		const int x0 = (t % tiles_x) * DISPLAY_TILE_SIZE, y0 = (t / tiles_x) * DISPLAY_TILE_SIZE;
+		const int x1 = std::min(x0 + DISPLAY_TILE_SIZE, width), y1 = std::min(y0 + DISPLAY_TILE_SIZE, height);
+		for(int y = y0; y < y1 && !changed; y++)
+		{
+			for(int x = x0; x < x1 && !changed; x++)
+				changed = rendered_image.sample_count[y * width + x] != published_sample_count[y * width + x];
+		}
+		if(changed)
+			tile_versions[t] = next_tile_version++;
+	}
+	published_sample_count = rendered_image.sample_count;
+	published_width = width;
+	published_height = height;
+	published_samples = rendered_image.number_of_samples;
+}
+
+static DenoiseView currentDenoiseView()
+{
+	DenoiseView view;
+	view.denoise = settings.denoise;
+	view.iterations = settings.denoise_iterations;
+	view.color_sigma = settings.denoise_color_sigma;
+	return view;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Hand the rendered image to the display. The denoiser runs here, on the
+// render thread, so the next pass starts only once it is done. It already
+// keeps every core busy with OpenMP, so running it beside the next pass
+// would not finish either sooner. Its time is not part of the pass time
+// that dynamic resolution measures (see denoise_stats instead).
+///////////////////////////////////////////////////////////////////////////
+static void publish()
+{
+	DisplayImage& image = display_buffers[write_index];
+	image.width = rendered_image.width;
+	image.height = rendered_image.height;
+	image.number_of_samples = rendered_image.number_of_samples;
+	image.active_pixels = rendered_image.active_pixels;
+	published_denoise_view = currentDenoiseView();
+	image.denoised = published_denoise_view.denoise;
+	if(image.denoised)
+	{
+		denoise(rendered_image, image.data);
+		image.denoise_stats = denoise_stats;
+	}
+	else
+	{
+		image.data = rendered_image.data;
+	}
+	image.sample_count = rendered_image.sample_count;
+	updateTileVersions();
+	image.tile_version = tile_versions;
+	image.tile_stats = tile_stats;
+	image.wavefront_stats = wavefront_stats;
+	image.path_stats = path_stats;
+	image.scene_update_stats = getSceneUpdateStats();
+	image.subsampling = pass_subsampling;
+	image.pass_time = pass_time;
+	write_index = ready_index.exchange(write_index | NEW_IMAGE_BIT) & ~NEW_IMAGE_BIT;
+}
+
+const DisplayImage* latestImage(bool& is_new)
+{
+	is_new = (ready_index.load() & NEW_IMAGE_BIT) != 0;
+	if(is_new)
+	{
+		read_index = ready_index.exchange(read_index) & ~NEW_IMAGE_BIT;
+		has_image = true;
+	}
+	return has_image ? &display_buffers[read_index] : nullptr;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Whether two sets of settings make the same image. Settings that only
+// decide how fast it converges or how it is shown are left out, as are the
+// BVH options, which are only read when the scene is built.
+///////////////////////////////////////////////////////////////////////////
+static bool sameImage(const RenderSettings& a, const RenderSettings& b)
+{
+	const Settings& s = a.settings;
+	const Settings& t = b.settings;
+	return s.max_bounces == t.max_bounces && s.integrator == t.integrator && s.sampler == t.sampler
+	       && s.filter_environment == t.filter_environment && s.russian_roulette == t.russian_roulette
+	       && s.roulette_min_bounces == t.roulette_min_bounces && s.path_splitting == t.path_splitting
+	       && s.split_threshold == t.split_threshold && s.aovs == t.aovs
+	       && a.point_light.intensity_multiplier == b.point_light.intensity_multiplier
+	       && a.point_light.color == b.point_light.color && a.point_light.position == b.point_light.position
+	       && a.environment_multiplier == b.environment_multiplier;
+}
+
+void setRenderView(const mat4& V, const mat4& P, int window_width, int window_height,
+                   const RenderSettings& render_settings)
+{
+	RenderView view;
+	view.V = V;
+	view.P = P;
+	view.window_width = window_width;
+	view.window_height = window_height;
+	view.subsampling = render_settings.settings.subsampling;
+	view.dynamic_resolution = render_settings.settings.dynamic_resolution;
+	lock_guard<mutex> guard(requested_view_lock);
+	// A pass may have started with the old settings after the display
+	// called restart(), so changing them restarts again
+	if(!sameImage(render_settings, requested_settings))
+		restart();
+	requested_settings = render_settings;
+	if(!view.sameCamera(requested_view))
+	{
+		const auto now = chrono::steady_clock::now();
+		camera_change_interval = chrono::duration<float, milli>(now - camera_changed_time).count();
+		camera_changed_time = now;
+	}
+	if(!(view == requested_view))
+	{
+		requested_view = view;
+		restart();
+	}
+}
+
+static void renderLoop()
+{
+	RenderView current_view;
+	// Whether the last pass was completed, or the image was already done
+	bool finished_pass = false;
+	while(!stop_rendering)
+	{
+		RenderView view;
+		RenderSettings render_settings;
+		float unchanged_time, change_interval;
+		{
+			lock_guard<mutex> guard(requested_view_lock);
+			view = requested_view;
+			render_settings = requested_settings;
+			unchanged_time =
+			    chrono::duration<float, milli>(chrono::steady_clock::now() - camera_changed_time).count();
+			change_interval = camera_change_interval;
+		}
+		if(view.window_width == 0 || view.window_height == 0)
+		{
+			// No view requested yet
+			this_thread::sleep_for(chrono::milliseconds(1));
+			continue;
+		}
+		// No pass is running, so the settings can be put in place
+		settings = render_settings.settings;
+		point_light = render_settings.point_light;
+		environment.multiplier = render_settings.environment_multiplier;
+		int subsampling = view.subsampling;
+		if(view.dynamic_resolution)
+		{
+			const bool stopped = view.sameCamera(current_view)
+			                     && unchanged_time >= ResolutionController::stillTime(change_interval);
+			subsampling = stopped ? resolution.still(finished_pass) : resolution.moving(view);
+		}
+		else
+		{
+			resolution.subsampling = 0;
+		}
+		if(view.window_width != current_view.window_width || view.window_height != current_view.window_height
+		   || subsampling != pass_subsampling)
+		{
+			resize(view.window_width, view.window_height, subsampling);
+		}
+		current_view = view;
+		pass_subsampling = subsampling;
+		const auto start_time = chrono::steady_clock::now();
+		const bool traced = tracePaths(view.V, view.P);
+		const bool cancelled = !traced && passCancelled();
+		if(traced || cancelled)
+		{
+			pass_time = chrono::duration<float, milli>(chrono::steady_clock::now() - start_time).count();
+			resolution.measure(pass_time, rendered_image.width * rendered_image.height, traced);
+		}
+		finished_pass = !cancelled;
+		if(traced)
+		{
+			publish();
+		}
+		else if(rendered_image.number_of_samples > 0)
+		{
+			// The image is done, or the pass was cancelled. Don't spin, but
+			// show a finished image again if the denoiser was changed.
+			if(!passCancelled() && !(currentDenoiseView() == published_denoise_view))
+				publish();
+			else
+				this_thread::sleep_for(chrono::milliseconds(1));
+		}
+	}
+}
+
+void startRenderThread()
+{
+	stop_rendering = false;
+	render_thread = thread(renderLoop);
+}
+
+void stopRenderThread()
+{
+	stop_rendering = true;
+	restart(); // Cancel the pass in progress
+	if(render_thread.joinable())
+		render_thread.join();
+}
+} // namespace pathtracer
@@ -0,0 +1,83 @@
+#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+#include "Pathtracer.h"
+#include "scheduler.h"
+#include "wavefront.h"
+#include "embree.h"
+#include "denoiser.h"
+#include "display.h"
+#include "termination.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A completed pass, as handed from the render thread to the display.
+// Holds copies of everything the GUI wants to show, so that the display
+// never reads state the render thread is writing to.
+///////////////////////////////////////////////////////////////////////////
+struct DisplayImage
+{
+	int width = 0, height = 0;
+	int number_of_samples = 0;
+	int active_pixels = 0;
+	// Denoised if settings.denoise was set when the pass was published
+	std::vector<glm::vec3> data;
+	std::vector<int> sample_count;
+	// A version for each DISPLAY_TILE_SIZE tile of data, in scanline order.
+	// A tile gets a new version whenever its pixels change, so the display
+	// only has to upload the tiles whose version it has not seen.
+	std::vector<uint32_t> tile_version;
+	TileStats tile_stats;
+	WavefrontStats wavefront_stats;
+	PathStats path_stats;
+	SceneUpdateStats scene_update_stats;
+	// The subsampling the image was traced at, and how long its last pass
+	// took in ms (see settings.dynamic_resolution)
+	int subsampling = 1;
+	float pass_time = 0.0f;
+	bool denoised = false;
+	DenoiseStats denoise_stats;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Run tracePaths() continuously on a thread of its own, so that the
+// display loop never has to wait for a pass to finish. Must be started
+// after the scene has been built and stopped before it is destroyed.
+///////////////////////////////////////////////////////////////////////////
+void startRenderThread();
+void stopRenderThread();
+
+///////////////////////////////////////////////////////////////////////////
+// What the display edits that the passes read. The display keeps its own
+// copy and hands it over with setRenderView(), and the render thread puts
+// it in place between passes, so that a pass never sees it change.
+///////////////////////////////////////////////////////////////////////////
+struct RenderSettings
+{
+	Settings settings;
+	PointLight point_light;
+	float environment_multiplier = 1.0f;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Set the camera, window size and settings used for the following passes.
+// If the camera, the window size, or a setting that changes what the image
+// converges to differs from the current ones, the rendering is restarted.
+// The other settings (the denoiser, adaptive sampling, the number of
+// paths) apply from the next pass on. With
+// settings.dynamic_resolution, the render thread picks the subsampling
+// of each pass itself: coarse enough to keep up with the frame time
+// target while the camera moves, then finer and finer until it is at
+// full resolution once the camera stops.
+///////////////////////////////////////////////////////////////////////////
+void setRenderView(const glm::mat4& V, const glm::mat4& P, int window_width, int window_height,
+                   const RenderSettings& render_settings);
+
+///////////////////////////////////////////////////////////////////////////
+// The most recently completed pass. Never blocks. is_new is set to true
+// if a pass has been completed since the last call. Returns nullptr until
+// the first pass is done.
+///////////////////////////////////////////////////////////////////////////
+const DisplayImage* latestImage(bool& is_new);
+} // namespace pathtracer
@@ -1,8 +1,9 @@
 #include "sampling.h"
-#include <random>
 #include "labhelper.h"
-#include <omp.h>
+#include "Pathtracer.h"
+#include "termination.h"
 #include <iostream>
+#include <algorithm>
 #include <glm/glm.hpp>
 
 using namespace glm;
@@ -10,13 +11,314 @@ using namespace glm;
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////////
-// Get a random float. Note that we need one "generator" per thread, or we
-// would need to lock everytime someone called randf().
+// The PCG hash (Jarzynski and Olano, "Hash Functions for GPU Rendering").
+// Cheap, and good enough that chaining it gives uncorrelated streams.
 ///////////////////////////////////////////////////////////////////////////////
-std::mt19937 generators[24]; // Assuming no more than 24 cores
+static inline uint32_t pcgHash(uint32_t v)
+{
+	uint32_t state = v * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+RandomStream randomStream(uint32_t pixel, uint32_t sample_index)
+{
+	RandomStream stream;
+	stream.pixel_key = pcgHash(pixel);
+	stream.sample_index = sample_index;
+	stream.bounce_offset = DIM_FIRST_BOUNCE;
+	return stream;
+}
+
+RandomStream splitStream(const RandomStream& stream, int branch)
+{
+	RandomStream split = stream;
+	// Keyed by the bounce too, or two splits of one path would give their
+	// branches the same streams
+	if(branch != 0)
+	{
+		const uint32_t key = stream.bounce_offset * MAX_SPLIT + uint32_t(branch);
+		split.pixel_key = pcgHash(stream.pixel_key ^ pcgHash(key));
+	}
+	return split;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The stream of the path each thread is currently working on. Only ever
+// touched by its own thread, so there is nothing to lock or share.
+///////////////////////////////////////////////////////////////////////////////
+static thread_local RandomStream current_stream;
+
+void setRandomStream(const RandomStream& stream)
+{
+	current_stream = stream;
+}
+
+const RandomStream& getRandomStream()
+{
+	return current_stream;
+}
+
+void startBounce(int bounce)
+{
+	current_stream.bounce_offset = DIM_FIRST_BOUNCE + bounce * DIMENSIONS_PER_BOUNCE;
+}
+
+static inline float toFloat(uint32_t bits)
+{
+	// The top 24 bits are exactly representable as a float in [0, 1)
+	return float(bits >> 8) * (1.0f / 16777216.0f);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Independent sampler: every dimension of every sample is hashed on its own
+///////////////////////////////////////////////////////////////////////////////
+static float independentSample(const RandomStream& stream, uint32_t dimension)
+{
+	const uint32_t key = pcgHash(stream.pixel_key + pcgHash(stream.sample_index));
+	return toFloat(pcgHash(key ^ pcgHash(dimension)));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sobol sampler with hash based Owen scrambling, after Burley, "Practical
+// Hash-based Owen Scrambling" (JCGT 2020). Only the first four Sobol
+// dimensions are used. Higher dimensions reuse them, with the sample index
+// shuffled and the points scrambled by a seed unique to each pixel and
+// group of four dimensions, which decorrelates the groups from each other.
+///////////////////////////////////////////////////////////////////////////////
+struct SobolDirections
+{
+	uint32_t v[4][32];
+	SobolDirections()
+	{
+		// Degree, coefficients and initial direction numbers of the
+		// primitive polynomials of dimensions 2-4 (Joe and Kuo)
+		const uint32_t degree[4] = { 0, 1, 2, 3 };
+		const uint32_t coefficients[4] = { 0, 0, 1, 1 };
+		const uint32_t initial[4][3] = { { 0, 0, 0 }, { 1, 0, 0 }, { 1, 3, 0 }, { 1, 3, 1 } };
+		for(int k = 0; k < 32; k++)
+			v[0][k] = 1u << (31 - k);
+		for(int d = 1; d < 4; d++)
+		{
+			const uint32_t s = degree[d];
+			uint32_t m[33];
+			for(uint32_t k = 1; k <= 32; k++)
+			{
+				if(k <= s)
+				{
+					m[k] = initial[d][k - 1];
+					continue;
+				}
+				m[k] = m[k - s] ^ (m[k - s] << s);
+				for(uint32_t j = 1; j < s; j++)
+				{
+					if((coefficients[d] >> (s - 1 - j)) & 1)
+						m[k] ^= m[k - j] << j;
+				}
+			}
+			for(uint32_t k = 1; k <= 32; k++)
+				v[d][k - 1] = m[k] << (32 - k);
+		}
+	}
+};
+static const SobolDirections sobol_directions;
+
+static inline uint32_t sobol(uint32_t index, int dimension)
+{
+	uint32_t x = 0;
+	for(int bit = 0; index != 0; index >>= 1, bit++)
+	{
+		if(index & 1)
+			x ^= sobol_directions.v[dimension][bit];
+	}
+	return x;
+}
+
+static inline uint32_t reverseBits(uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+	x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// A random permutation of the bits of x where each bit only depends on
+// the bits below it (Laine-Karras, with Burley's constants)
+static inline uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+// Owen scrambling: each bit is flipped depending on the bits above it
+static inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+{
+	return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+static float sobolSample(const RandomStream& stream, uint32_t dimension)
+{
+	const uint32_t seed = pcgHash(stream.pixel_key ^ pcgHash(dimension / 4));
+	const uint32_t index = nestedUniformScramble(stream.sample_index, seed);
+	const uint32_t x = sobol(index, dimension % 4);
+	return toFloat(nestedUniformScramble(x, pcgHash(seed + dimension % 4)));
+}
+
+static float sample(const RandomStream& stream, uint32_t dimension)
+{
+	switch(settings.sampler)
+	{
+	case Sampler::Sobol:
+		return sobolSample(stream, dimension);
+	case Sampler::Independent:
+	default:
+		return independentSample(stream, dimension);
+	}
+}
+
+float sample1D(BounceDimension dimension)
+{
+	return sample(current_stream, current_stream.bounce_offset + dimension);
+}
+
+vec2 sample2D(BounceDimension dimension)
+{
+	return vec2(sample(current_stream, current_stream.bounce_offset + dimension),
+	            sample(current_stream, current_stream.bounce_offset + dimension + 1));
+}
+
+vec2 pixelSample(const RandomStream& stream)
+{
+	return vec2(sample(stream, DIM_PIXEL), sample(stream, DIM_PIXEL + 1));
+}
+
 float randf()
 {
-	return float(generators[omp_get_thread_num()]() / double(generators[omp_get_thread_num()].max()));
+	const uint32_t key = pcgHash(current_stream.pixel_key + pcgHash(current_stream.sample_index));
+	// Counted from the top, so that these never coincide with a bounce
+	return toFloat(pcgHash(key ^ pcgHash(~current_stream.counter++)));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Vose's construction of the alias table: every bucket is filled up to
+// 1/n by its own item plus (if needed) part of one item with more weight.
+///////////////////////////////////////////////////////////////////////////
+void AliasTable::build(const std::vector<float>& weights)
+{
+	const size_t n = weights.size();
+	probability.assign(n, 1.0f);
+	alias.resize(n);
+	pmf.resize(n);
+	double total = 0.0;
+	for(float w : weights)
+		total += w;
+	if(n == 0 || total <= 0.0)
+	{
+		pmf.clear();
+		return;
+	}
+	std::vector<double> scaled(n);
+	std::vector<uint32_t> small, large;
+	for(size_t i = 0; i < n; i++)
+	{
+		pmf[i] = float(weights[i] / total);
+		scaled[i] = weights[i] * n / total;
+		alias[i] = uint32_t(i);
+		(scaled[i] < 1.0 ? small : large).push_back(uint32_t(i));
+	}
+	while(!small.empty() && !large.empty())
+	{
+		const uint32_t s = small.back();
+		const uint32_t l = large.back();
+		small.pop_back();
+		probability[s] = float(scaled[s]);
+		alias[s] = l;
+		scaled[l] -= 1.0 - scaled[s];
+		if(scaled[l] < 1.0)
+		{
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	// Whatever is left is (up to rounding) exactly full
+	for(uint32_t i : small)
+		probability[i] = 1.0f;
+	for(uint32_t i : large)
+		probability[i] = 1.0f;
+}
+
+uint32_t AliasTable::sample(float u) const
+{
+	// The integer part of u * n picks the bucket, the fraction decides
+	// between the bucket's item and its alias.
+	const float scaled = u * float(probability.size());
+	const uint32_t bucket = std::min(uint32_t(scaled), uint32_t(probability.size() - 1));
+	return scaled - float(bucket) < probability[bucket] ? bucket : alias[bucket];
+}
+
+void Distribution2D::build(const std::vector<float>& cell_weights, int w, int h)
+{
+	width = w;
+	height = h;
+	weights = cell_weights;
+	conditional_cdf.resize((width + 1) * height);
+	marginal_cdf.resize(height + 1);
+	std::vector<float> row_integral(height);
+	for(int y = 0; y < height; y++)
+	{
+		float* cdf = &conditional_cdf[(width + 1) * y];
+		cdf[0] = 0.0f;
+		for(int x = 0; x < width; x++)
+			cdf[x + 1] = cdf[x] + weights[y * width + x] / float(width);
+		row_integral[y] = cdf[width];
+		for(int x = 1; x <= width; x++)
+		{
+			// Rows without any weight are never picked, but keep them valid
+			cdf[x] = row_integral[y] > 0.0f ? cdf[x] / row_integral[y] : float(x) / float(width);
+		}
+	}
+	marginal_cdf[0] = 0.0f;
+	for(int y = 0; y < height; y++)
+		marginal_cdf[y + 1] = marginal_cdf[y] + row_integral[y] / float(height);
+	integral = marginal_cdf[height];
+	for(int y = 1; y <= height; y++)
+		marginal_cdf[y] = integral > 0.0f ? marginal_cdf[y] / integral : float(y) / float(height);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Invert a piecewise linear CDF with n segments, and return where in [0,1)
+// xi ends up
+///////////////////////////////////////////////////////////////////////////
+static float sampleCDF(const float* cdf, int n, float xi, int& segment)
+{
+	segment = int(std::upper_bound(cdf, cdf + n + 1, xi) - cdf) - 1;
+	segment = std::max(0, std::min(n - 1, segment));
+	const float width = cdf[segment + 1] - cdf[segment];
+	const float offset = width > 0.0f ? (xi - cdf[segment]) / width : 0.5f;
+	return std::min((float(segment) + offset) / float(n), 1.0f - 1e-7f);
+}
+
+vec2 Distribution2D::sample(const vec2& xi, float& p) const
+{
+	int x, y;
+	const float v = sampleCDF(marginal_cdf.data(), height, xi.y, y);
+	const float u = sampleCDF(&conditional_cdf[(width + 1) * y], width, xi.x, x);
+	p = weights[y * width + x] / integral;
+	return vec2(u, v);
+}
+
+float Distribution2D::pdf(const vec2& p) const
+{
+	if(integral <= 0.0f)
+		return 0.0f;
+	const int x = std::max(0, std::min(int(p.x * width), width - 1));
+	const int y = std::max(0, std::min(int(p.y * height), height - 1));
+	return weights[y * width + x] / integral;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -24,9 +326,16 @@ float randf()
 ///////////////////////////////////////////////////////////////////////////
 void concentricSampleDisk(float* dx, float* dy)
 {
-	float r, theta;
 	float u1 = randf();
 	float u2 = randf();
+	concentricSampleDisk(vec2(u1, u2), dx, dy);
+}
+
+void concentricSampleDisk(const vec2& u, float* dx, float* dy)
+{
+	float r, theta;
+	float u1 = u.x;
+	float u2 = u.y;
 	// Map uniform random numbers to $[-1,1]^2$
 	float sx = 2 * u1 - 1;
 	float sy = 2 * u2 - 1;
@@ -76,9 +385,16 @@ void concentricSampleDisk(float* dx, float* dy)
 // Generate points with a cosine distribution on the hemisphere
 ///////////////////////////////////////////////////////////////////////////
 glm::vec3 cosineSampleHemisphere()
+{
+	float u1 = randf();
+	float u2 = randf();
+	return cosineSampleHemisphere(vec2(u1, u2));
+}
+
+glm::vec3 cosineSampleHemisphere(const vec2& u)
 {
 	glm::vec3 ret;
-	concentricSampleDisk(&ret.x, &ret.y);
+	concentricSampleDisk(u, &ret.x, &ret.y);
 	ret.z = sqrt(max(0.f, 1.f - ret.x * ret.x - ret.y * ret.y));
 	return ret;
 }
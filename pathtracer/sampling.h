@@ -1,20 +1,136 @@
 #pragma once
+#include <cstdint>
+#include <vector>
 #include <glm/glm.hpp>
 
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////
-// Random number generation
+// Random number generation. Numbers are not drawn from a generator with
+// state, but computed from a key and a dimension. Each path gets its own
+// stream, keyed by its pixel and sample index, so the numbers a path sees
+// do not depend on which thread traces it or on how many threads there
+// are.
+///////////////////////////////////////////////////////////////////////////
+struct RandomStream
+{
+	uint32_t pixel_key = 0;
+	uint32_t sample_index = 0;
+	// First dimension of the current bounce
+	uint32_t bounce_offset = 0;
+	// Counter for randf()
+	uint32_t counter = 0;
+};
+RandomStream randomStream(uint32_t pixel, uint32_t sample_index);
+///////////////////////////////////////////////////////////////////////////
+// The stream of one of the branches a path splits into at its current
+// bounce. Branch 0 goes on with the path's own stream, the others get
+// streams that are decorrelated from it and from each other.
+///////////////////////////////////////////////////////////////////////////
+RandomStream splitStream(const RandomStream& stream, int branch);
+///////////////////////////////////////////////////////////////////////////
+// Select the stream the calling thread draws from, and get it back (with
+// its advanced state) to continue the path later.
+///////////////////////////////////////////////////////////////////////////
+void setRandomStream(const RandomStream& stream);
+const RandomStream& getRandomStream();
+
+///////////////////////////////////////////////////////////////////////////
+// The dimensions of a path. The first ones jitter the pixel position, and
+// every bounce then gets DIMENSIONS_PER_BOUNCE dimensions of its own, laid
+// out as below. With the Sobol sampler, dimensions are grouped four by
+// four into well stratified 4D patterns, so the two direction dimensions
+// and the lobe selection of a bounce are stratified with each other.
+///////////////////////////////////////////////////////////////////////////
+enum PathDimension
+{
+	DIM_PIXEL = 0, // 2D
+	DIM_FIRST_BOUNCE = 4
+};
+enum BounceDimension
+{
+	DIM_DIRECTION = 0, // 2D, for sampling the BRDF
+	DIM_LOBE = 2,      // Choosing between the lobes of a BRDF
+	DIM_LIGHT = 4,     // 2D, a point on a light source
+	DIM_LIGHT_SELECTION = 6, // Which light source to sample
+	DIM_ENVIRONMENT = 8, // 2D, a direction toward the environment map
+	DIM_ROULETTE = 10,   // Whether the path goes on (see termination.h)
+	DIMENSIONS_PER_BOUNCE = 12
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Move the current stream to the dimensions of a bounce
+///////////////////////////////////////////////////////////////////////////
+void startBounce(int bounce);
+///////////////////////////////////////////////////////////////////////////
+// Sample dimensions of the current bounce, in [0, 1). The values come from
+// the sampler selected in the settings.
+///////////////////////////////////////////////////////////////////////////
+float sample1D(BounceDimension dimension);
+glm::vec2 sample2D(BounceDimension dimension);
+///////////////////////////////////////////////////////////////////////////
+// The position within its pixel that a path starts at
+///////////////////////////////////////////////////////////////////////////
+glm::vec2 pixelSample(const RandomStream& stream);
+///////////////////////////////////////////////////////////////////////////
+// Get an independent random number in [0, 1) from the current stream,
+// outside of the dimensions above
 ///////////////////////////////////////////////////////////////////////////
 float randf();
 ///////////////////////////////////////////////////////////////////////////
+// Walker's alias method: pick one of n items, with probabilities
+// proportional to their weights, in constant time.
+///////////////////////////////////////////////////////////////////////////
+struct AliasTable
+{
+	// Each bucket keeps its own item with this probability, and picks its
+	// alias otherwise
+	std::vector<float> probability;
+	std::vector<uint32_t> alias;
+	// The normalized probability of picking each item
+	std::vector<float> pmf;
+	void build(const std::vector<float>& weights);
+	uint32_t sample(float u) const;
+	bool empty() const
+	{
+		return pmf.empty();
+	}
+};
+///////////////////////////////////////////////////////////////////////////
+// A piecewise constant distribution over [0,1)^2, split into width x
+// height cells with the given weights: a marginal CDF over the rows and a
+// conditional CDF over the cells of each row.
+///////////////////////////////////////////////////////////////////////////
+struct Distribution2D
+{
+	int width = 0, height = 0;
+	void build(const std::vector<float>& weights, int width, int height);
+	// Map xi, uniform in [0,1)^2, to a point and return its pdf
+	glm::vec2 sample(const glm::vec2& xi, float& pdf) const;
+	float pdf(const glm::vec2& p) const;
+	// False if all weights are zero, so there is nothing to sample
+	bool valid() const
+	{
+		return integral > 0.0f;
+	}
+
+private:
+	std::vector<float> weights;
+	// width + 1 entries per row
+	std::vector<float> conditional_cdf;
+	std::vector<float> marginal_cdf;
+	float integral = 0.0f;
+};
+///////////////////////////////////////////////////////////////////////////
 // Generate uniform points on a disc
 ///////////////////////////////////////////////////////////////////////////
 void concentricSampleDisk(float* dx, float* dy);
+void concentricSampleDisk(const glm::vec2& u, float* dx, float* dy);
 ///////////////////////////////////////////////////////////////////////////
 // Generate points with a cosine distribution on the hemisphere
 ///////////////////////////////////////////////////////////////////////////
 glm::vec3 cosineSampleHemisphere();
+glm::vec3 cosineSampleHemisphere(const glm::vec2& u);
 ///////////////////////////////////////////////////////////////////////////
 // Generate a vector that is perpendicular to another
 ///////////////////////////////////////////////////////////////////////////
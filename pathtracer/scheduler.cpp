@@ -0,0 +1,121 @@
+#include "scheduler.h"
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include <omp.h>
+
+using namespace std;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////////
+// Global variables
+///////////////////////////////////////////////////////////////////////////////
+TileStats tile_stats;
+
+///////////////////////////////////////////////////////////////////////////
+// One queue of tile indices per thread. The owner pops from the back and
+// thieves take from the front, so an owner keeps working on tiles that
+// are close to each other in the image for as long as possible. Padded so
+// that two queues never share a cache line.
+///////////////////////////////////////////////////////////////////////////
+struct TileQueue
+{
+	mutex lock;
+	deque<int> tiles;
+	bool popBack(int& tile)
+	{
+		lock_guard<mutex> guard(lock);
+		if(tiles.empty())
+			return false;
+		tile = tiles.back();
+		tiles.pop_back();
+		return true;
+	}
+	bool popFront(int& tile)
+	{
+		lock_guard<mutex> guard(lock);
+		if(tiles.empty())
+			return false;
+		tile = tiles.front();
+		tiles.pop_front();
+		return true;
+	}
+	char padding[64];
+};
+
+void renderTiles(int width, int height, int tile_size, const function<void(const Tile&)>& render_tile)
+{
+	tile_size = std::max(1, tile_size);
+	const int tiles_x = (width + tile_size - 1) / tile_size;
+	const int tiles_y = (height + tile_size - 1) / tile_size;
+	const int number_of_tiles = tiles_x * tiles_y;
+	if(number_of_tiles == 0)
+		return;
+
+	///////////////////////////////////////////////////////////////////////
+	// Hand each thread a contiguous run of tiles to start with
+	///////////////////////////////////////////////////////////////////////
+	const int number_of_threads = std::max(1, std::min(omp_get_max_threads(), number_of_tiles));
+	unique_ptr<TileQueue[]> queues(new TileQueue[number_of_threads]);
+	for(int i = 0; i < number_of_tiles; i++)
+	{
+		queues[(int64_t(i) * number_of_threads) / number_of_tiles].tiles.push_back(i);
+	}
+
+	tile_stats.tiles_x = tiles_x;
+	tile_stats.tiles_y = tiles_y;
+	tile_stats.tile_cost.assign(number_of_tiles, 0.0f);
+	vector<double> busy_time(number_of_threads, 0.0);
+	int number_of_steals = 0;
+	const double pass_start = omp_get_wtime();
+
+#pragma omp parallel num_threads(number_of_threads) reduction(+ : number_of_steals)
+	{
+		const int thread = omp_get_thread_num();
+		int tile;
+		for(;;)
+		{
+			bool found = queues[thread].popBack(tile);
+			// Our own queue is empty, try to steal from the others. Tiles are
+			// never added during a pass, so if every queue is empty we're done.
+			for(int i = 1; !found && i < number_of_threads; i++)
+			{
+				found = queues[(thread + i) % number_of_threads].popFront(tile);
+				number_of_steals += found ? 1 : 0;
+			}
+			if(!found)
+				break;
+
+			Tile t;
+			t.x0 = (tile % tiles_x) * tile_size;
+			t.y0 = (tile / tiles_x) * tile_size;
+			t.x1 = std::min(t.x0 + tile_size, width);
+			t.y1 = std::min(t.y0 + tile_size, height);
+			const double tile_start = omp_get_wtime();
+			render_tile(t);
+			const double cost = omp_get_wtime() - tile_start;
+			tile_stats.tile_cost[tile] = float(cost * 1000.0);
+			busy_time[thread] += cost;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Summarize the pass
+	///////////////////////////////////////////////////////////////////////
+	tile_stats.pass_time = float((omp_get_wtime() - pass_start) * 1000.0);
+	tile_stats.number_of_steals = number_of_steals;
+	tile_stats.min_tile_cost = *std::min_element(tile_stats.tile_cost.begin(), tile_stats.tile_cost.end());
+	tile_stats.max_tile_cost = *std::max_element(tile_stats.tile_cost.begin(), tile_stats.tile_cost.end());
+	double total_cost = 0.0;
+	for(float c : tile_stats.tile_cost)
+		total_cost += c;
+	tile_stats.mean_tile_cost = float(total_cost / number_of_tiles);
+	const double max_busy = *std::max_element(busy_time.begin(), busy_time.end());
+	double mean_busy = 0.0;
+	for(double b : busy_time)
+		mean_busy += b / number_of_threads;
+	tile_stats.imbalance = mean_busy > 0.0 ? float(max_busy / mean_busy) : 1.0f;
+}
+} // namespace pathtracer
@@ -0,0 +1,43 @@
+#pragma once
+#include <vector>
+#include <functional>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A rectangular block of pixels, [x0, x1) x [y0, y1)
+///////////////////////////////////////////////////////////////////////////
+struct Tile
+{
+	int x0, y0, x1, y1;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Statistics from the last pass run through the tile scheduler. Costs are
+// wall clock times in milliseconds.
+///////////////////////////////////////////////////////////////////////////
+extern struct TileStats
+{
+	int tiles_x = 0, tiles_y = 0;
+	// Cost of each tile, in scanline order
+	std::vector<float> tile_cost;
+	float min_tile_cost = 0.0f;
+	float mean_tile_cost = 0.0f;
+	float max_tile_cost = 0.0f;
+	// Time from start of the pass until the last thread finished
+	float pass_time = 0.0f;
+	// Busiest thread's working time divided by the average thread's
+	// working time. 1.0 means perfectly balanced.
+	float imbalance = 1.0f;
+	int number_of_steals = 0;
+} tile_stats;
+
+///////////////////////////////////////////////////////////////////////////
+// Split the image into tile_size x tile_size tiles and call render_tile
+// once for every tile on all available threads. Each thread starts with
+// its own deque of neighbouring tiles, and threads that run out of work
+// steal tiles from the others, so that expensive regions of the image
+// don't leave cores idle at the end of a pass.
+///////////////////////////////////////////////////////////////////////////
+void renderTiles(int width, int height, int tile_size, const std::function<void(const Tile&)>& render_tile);
+} // namespace pathtracer
@@ -0,0 +1,128 @@
+#include "termination.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cmath>
+#include "Pathtracer.h"
+#include "sampling.h"
+#include "embree.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////////
+// Global variables
+///////////////////////////////////////////////////////////////////////////////
+PathStats path_stats;
+
+static float maxComponent(const vec3& v)
+{
+	return std::max(v.x, std::max(v.y, v.z));
+}
+
+int splitCount(const vec3& throughput, int budget)
+{
+	if(!settings.path_splitting || budget <= 0)
+		return 1;
+	const float weight = maxComponent(throughput);
+	if(!(weight > settings.split_threshold))
+		return 1;
+	// Enough branches that each carries at most the threshold, if allowed
+	const int branches = int(ceil(weight / settings.split_threshold));
+	return std::max(1, std::min(std::min(branches, MAX_SPLIT), budget + 1));
+}
+
+int branchBudget(int budget, int branches, int branch)
+{
+	const int remaining = budget - (branches - 1);
+	return remaining / branches + (branch < remaining % branches ? 1 : 0);
+}
+
+bool russianRoulette(int bounces, vec3& throughput)
+{
+	if(!settings.russian_roulette || bounces < settings.roulette_min_bounces)
+		return true;
+	const float survival = maxComponent(throughput);
+	if(survival >= 1.0f)
+		return true;
+	if(sample1D(DIM_ROULETTE) >= survival)
+		return false;
+	throughput /= survival;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Path counting, with one counter per thread that only that thread ever
+// writes to
+///////////////////////////////////////////////////////////////////////////
+struct PathCounter
+{
+	std::atomic<uint64_t> counts[4];
+	char padding[64];
+	PathCounter()
+	{
+		for(auto& count : counts)
+			count = 0;
+	}
+};
+static std::mutex path_counters_lock;
+static vector<unique_ptr<PathCounter>> path_counters;
+
+void countPaths(const PathCounts& counts)
+{
+	thread_local PathCounter* counter = nullptr;
+	if(counter == nullptr)
+	{
+		lock_guard<std::mutex> guard(path_counters_lock);
+		path_counters.emplace_back(new PathCounter);
+		counter = path_counters.back().get();
+	}
+	const uint64_t added[4] = { counts.paths, counts.segments, counts.splits, counts.roulette_terminations };
+	for(int i = 0; i < 4; i++)
+	{
+		counter->counts[i].store(counter->counts[i].load(memory_order_relaxed) + added[i],
+		                         memory_order_relaxed);
+	}
+}
+
+PathCounts getPathCounts()
+{
+	lock_guard<std::mutex> guard(path_counters_lock);
+	PathCounts total;
+	for(auto& counter : path_counters)
+	{
+		total.paths += counter->counts[0].load(memory_order_relaxed);
+		total.segments += counter->counts[1].load(memory_order_relaxed);
+		total.splits += counter->counts[2].load(memory_order_relaxed);
+		total.roulette_terminations += counter->counts[3].load(memory_order_relaxed);
+	}
+	return total;
+}
+
+static PathCounts pass_start_counts;
+static uint64_t pass_start_rays = 0;
+
+void beginPathStats()
+{
+	pass_start_counts = getPathCounts();
+	pass_start_rays = getNumberOfRaysTraced();
+}
+
+void endPathStats()
+{
+	const PathCounts counts = getPathCounts();
+	const uint64_t paths = counts.paths - pass_start_counts.paths;
+	if(paths == 0)
+		return;
+	const double per_path = 1.0 / double(paths);
+	path_stats.average_path_length = float(double(counts.segments - pass_start_counts.segments) * per_path);
+	path_stats.rays_per_sample = float(double(getNumberOfRaysTraced() - pass_start_rays) * per_path);
+	path_stats.splits_per_path = float(double(counts.splits - pass_start_counts.splits) * per_path);
+	path_stats.roulette_terminations_per_path =
+	    float(double(counts.roulette_terminations - pass_start_counts.roulette_terminations) * per_path);
+}
+} // namespace pathtracer
@@ -0,0 +1,95 @@
+#pragma once
+#include <cstdint>
+#include <glm/glm.hpp>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// How paths end and split, shared by both integrators.
+//
+// Russian roulette: once a path has made settings.roulette_min_bounces
+// bounces, each new direction is kept with a probability equal to the
+// largest component of the path's throughput (if that is below one), and
+// the paths that are kept are weighted up by one over that probability.
+// Paths that can only add a little light are mostly ended, and the ones
+// that go on carry a throughput of about one.
+//
+// Splitting (settings.path_splitting): a path whose throughput has grown
+// above settings.split_threshold, which happens where the sampled
+// direction was less likely than the BRDF says it should be, continues as
+// several branches that each sample a direction of their own and carry
+// their share of the throughput. Both keep the estimate unbiased, and
+// settings.max_bounces still caps the length of every path.
+///////////////////////////////////////////////////////////////////////////
+
+// The most branches a path splits into at one vertex
+const int MAX_SPLIT = 4;
+
+///////////////////////////////////////////////////////////////////////////
+// A camera path may grow at most MAX_EXTRA_BRANCHES branches besides its
+// own. A branch's remaining budget is shared out among the branches it
+// splits into, so that no branch has to know about the others, and both
+// integrators split a path the same way.
+///////////////////////////////////////////////////////////////////////////
+const int MAX_EXTRA_BRANCHES = 15;
+
+///////////////////////////////////////////////////////////////////////////
+// The number of branches (1 if none) to continue a path with from its
+// current vertex, given its throughput up to the vertex and its budget of
+// extra branches
+///////////////////////////////////////////////////////////////////////////
+int splitCount(const glm::vec3& throughput, int budget);
+
+///////////////////////////////////////////////////////////////////////////
+// The budget of extra branches one of them gets after a path with the
+// given budget splits into branches
+///////////////////////////////////////////////////////////////////////////
+int branchBudget(int budget, int branches, int branch);
+
+///////////////////////////////////////////////////////////////////////////
+// Play Russian roulette with a path that has just sampled the direction
+// out of vertex number bounces and has the given throughput (including
+// that sample). Returns false if the path ends here, and otherwise
+// weights the throughput up. Uses DIM_ROULETTE of the current bounce.
+///////////////////////////////////////////////////////////////////////////
+bool russianRoulette(int bounces, glm::vec3& throughput);
+
+///////////////////////////////////////////////////////////////////////////
+// Counts of what the integrators did, summed over all threads since the
+// start. Every thread adds to a counter of its own, like the ray counts
+// in embree.cpp.
+///////////////////////////////////////////////////////////////////////////
+struct PathCounts
+{
+	// Camera paths
+	uint64_t paths = 0;
+	// Rays from one vertex to the next, over all branches, including the
+	// primary rays
+	uint64_t segments = 0;
+	// Branches added by splitting
+	uint64_t splits = 0;
+	// Branches ended by Russian roulette
+	uint64_t roulette_terminations = 0;
+};
+void countPaths(const PathCounts& counts);
+PathCounts getPathCounts();
+
+///////////////////////////////////////////////////////////////////////////
+// Per camera path, over the last pass (see beginPathStats())
+///////////////////////////////////////////////////////////////////////////
+extern struct PathStats
+{
+	// Segments per camera path
+	float average_path_length = 0.0f;
+	// All rays traced (segments and shadow rays) per camera path
+	float rays_per_sample = 0.0f;
+	float splits_per_path = 0.0f;
+	float roulette_terminations_per_path = 0.0f;
+} path_stats;
+
+///////////////////////////////////////////////////////////////////////////
+// Called by tracePaths() around each pass to fill in path_stats
+///////////////////////////////////////////////////////////////////////////
+void beginPathStats();
+void endPathStats();
+} // namespace pathtracer
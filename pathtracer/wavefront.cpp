@@ -0,0 +1,602 @@
+#include "wavefront.h"
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <numeric>
+#include <omp.h>
+#include "termination.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////////
+// Global variables
+///////////////////////////////////////////////////////////////////////////////
+WavefrontStats wavefront_stats;
+
+///////////////////////////////////////////////////////////////////////////
+// The maximum number of paths in flight at once. Larger images are
+// rendered in several waves, which bounds the memory used for path state.
+///////////////////////////////////////////////////////////////////////////
+static const int WAVE_SIZE = 1 << 18;
+
+///////////////////////////////////////////////////////////////////////////
+// The most shadow rays a path traces per bounce, one per kind of light
+///////////////////////////////////////////////////////////////////////////
+static const int MAX_SHADOW_RAYS = 3;
+
+///////////////////////////////////////////////////////////////////////////
+// The state of all paths in flight, one array per field
+///////////////////////////////////////////////////////////////////////////
+struct PathStates
+{
+	// Pixel index and length of each path
+	vector<int> pixel;
+	vector<int> bounces;
+	// The camera path a branch split from (itself for camera paths), and
+	// the extra branches it may still split into (see termination.h)
+	vector<int> root;
+	vector<int> split_budget;
+	// The extra branches a path continues as from the vertex being shaded,
+	// and the slot of the first of them (see reserveBranches())
+	vector<int> extra_branches;
+	vector<int> first_branch;
+	// The current ray of each path
+	vector<vec3> origin;
+	vector<vec3> direction;
+	// What the current ray hit, filled in by the extension stage
+	vector<float> t;
+	vector<vec3> hit_normal;
+	vector<vec2> hit_uv;
+	vector<uint32_t> geomID;
+	vector<uint32_t> primID;
+	vector<uint32_t> instID;
+	// Accumulated throughput and radiance
+	vector<vec3> throughput;
+	vector<vec3> L;
+	// Where each path is in its random number stream
+	vector<RandomStream> rng;
+	// The pdf of the BRDF sample the current ray came from (0 for primary
+	// rays), for weighting emission that it hits, and whether the vertex it
+	// came from filters the environment
+	vector<float> brdf_pdf;
+	vector<uint8_t> filtered_environment;
+	// What each path adds to the AOVs (see PathAOVs)
+	vector<vec3> albedo;
+	vector<vec3> normal;
+	vector<float> depth;
+	vector<float> material_id;
+	vector<vec3> direct;
+	// The pending shadow rays of each path (toward the point light, an
+	// emissive triangle and the environment, in slots MAX_SHADOW_RAYS * i
+	// and up) and the radiance they carry if unoccluded
+	vector<int> shadow_count;
+	// The bounce the pending shadow rays were traced from
+	vector<int> shadow_bounce;
+	vector<vec3> shadow_origin;
+	vector<vec3> shadow_direction;
+	vector<float> shadow_distance;
+	vector<vec3> shadow_contribution;
+
+	void resize(size_t n)
+	{
+		pixel.resize(n);
+		bounces.resize(n);
+		root.resize(n);
+		split_budget.resize(n);
+		extra_branches.resize(n);
+		first_branch.resize(n);
+		origin.resize(n);
+		direction.resize(n);
+		t.resize(n);
+		hit_normal.resize(n);
+		hit_uv.resize(n);
+		geomID.resize(n);
+		primID.resize(n);
+		instID.resize(n);
+		throughput.resize(n);
+		L.resize(n);
+		rng.resize(n);
+		brdf_pdf.resize(n);
+		filtered_environment.resize(n);
+		albedo.resize(n);
+		normal.resize(n);
+		depth.resize(n);
+		material_id.resize(n);
+		direct.resize(n);
+		shadow_count.resize(n);
+		shadow_bounce.resize(n);
+		shadow_origin.resize(MAX_SHADOW_RAYS * n);
+		shadow_direction.resize(MAX_SHADOW_RAYS * n);
+		shadow_distance.resize(MAX_SHADOW_RAYS * n);
+		shadow_contribution.resize(MAX_SHADOW_RAYS * n);
+	}
+	// Rebuild the embree ray of a path, including its hit
+	Ray hitRay(int i) const
+	{
+		Ray r(origin[i], direction[i], 0.0f, t[i]);
+		r.n = hit_normal[i];
+		r.u = hit_uv[i].x;
+		r.v = hit_uv[i].y;
+		r.geomID = geomID[i];
+		r.primID = primID[i];
+		r.instID = instID[i];
+		return r;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// A queue of path indices. Stages read one queue and write the paths that
+// need more work into other queues, so that later stages never have to
+// skip over terminated paths.
+///////////////////////////////////////////////////////////////////////////
+struct PathQueue
+{
+	vector<int> items;
+	atomic<int> size{ 0 };
+	void reset(size_t capacity)
+	{
+		items.resize(capacity);
+		size = 0;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Each thread collects indices locally and appends them to the shared
+// queue in blocks, so that the queue's counter is touched rarely.
+///////////////////////////////////////////////////////////////////////////
+struct PathQueueWriter
+{
+	PathQueue* queue = nullptr;
+	int buffer[256];
+	int count = 0;
+	void push(int i)
+	{
+		buffer[count++] = i;
+		if(count == 256)
+			flush();
+	}
+	void flush()
+	{
+		if(count == 0)
+			return;
+		int offset = queue->size.fetch_add(count);
+		std::copy(buffer, buffer + count, queue->items.begin() + offset);
+		count = 0;
+	}
+	~PathQueueWriter()
+	{
+		flush();
+	}
+};
+
+static PathStates paths;
+static PathQueue active_queue, next_queue, shadow_queue;
+// The branches that camera paths split into take the path slots from the
+// end of the wave's camera paths on. If a wave runs out of slots, paths
+// split into fewer branches, which keeps the estimate unbiased but differs
+// from what Li() computes.
+static int next_branch_slot = 0;
+// One shading queue per material type, so that each batch of hits runs
+// the same case of the material code
+static PathQueue shade_queues[NUMBER_OF_MATERIAL_TYPES];
+
+///////////////////////////////////////////////////////////////////////////
+// The pixel of every path to trace in this pass, in scanline order. A
+// pixel appears once per path it gets, so all paths of a pixel are next
+// to each other.
+///////////////////////////////////////////////////////////////////////////
+static vector<int> pass_pixels;
+
+///////////////////////////////////////////////////////////////////////////
+// Stage 1: Create primary rays for the paths [begin, begin + n)
+///////////////////////////////////////////////////////////////////////////
+static void generate(const PrimaryRayGenerator& camera, int begin, int n)
+{
+#pragma omp parallel
+	{
+		PathQueueWriter active;
+		active.queue = &active_queue;
+#pragma omp for schedule(static)
+		for(int i = 0; i < n; i++)
+		{
+			const int pixel = pass_pixels[begin + i];
+			// Number the paths of a pixel like the megakernel does, so that
+			// both integrators draw the same random numbers.
+			int first = begin + i;
+			while(first > begin && pass_pixels[first - 1] == pixel)
+				first--;
+			paths.rng[i] = randomStream(
+			    pixel, rendered_image.first_sample + rendered_image.sample_count[pixel] + (begin + i - first));
+			const int x = pixel % rendered_image.width, y = pixel / rendered_image.width;
+			Ray primary_ray = camera.generate(x, y, paths.rng[i]);
+			paths.pixel[i] = pixel;
+			paths.bounces[i] = 0;
+			paths.root[i] = i;
+			paths.split_budget[i] = MAX_EXTRA_BRANCHES;
+			paths.origin[i] = primary_ray.o;
+			paths.direction[i] = primary_ray.d;
+			paths.throughput[i] = vec3(1.0f);
+			paths.L[i] = vec3(0.0f);
+			paths.brdf_pdf[i] = 0.0f;
+			paths.filtered_environment[i] = 0;
+			paths.direct[i] = vec3(0.0f);
+			active.push(i);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Stage 2: Intersect the current ray of all active paths. Paths that miss
+// pick up the environment and terminate, the rest are sorted into one
+// shading queue per material type.
+///////////////////////////////////////////////////////////////////////////
+static void extend()
+{
+	const int n = active_queue.size;
+#pragma omp parallel
+	{
+		PathQueueWriter shade_writers[NUMBER_OF_MATERIAL_TYPES];
+		for(int type = 0; type < int(NUMBER_OF_MATERIAL_TYPES); type++)
+			shade_writers[type].queue = &shade_queues[type];
+#pragma omp for schedule(dynamic, 256)
+		for(int q = 0; q < n; q++)
+		{
+			const int i = active_queue.items[q];
+			Ray r(paths.origin[i], paths.direction[i]);
+			if(!intersect(r))
+			{
+				const bool filtered = paths.filtered_environment[i] != 0;
+				const vec3 Le = Lenvironment(r.d, paths.brdf_pdf[i], filtered);
+				const vec3 contribution =
+				    paths.throughput[i] * Le * environmentWeight(r.d, paths.brdf_pdf[i], filtered);
+				paths.L[i] += contribution;
+				// The environment seen directly, or through the first hit
+				if(paths.bounces[i] <= 1)
+					paths.direct[i] += contribution;
+				if(paths.bounces[i] == 0)
+				{
+					paths.albedo[i] = Le;
+					paths.normal[i] = vec3(0.0f);
+					paths.depth[i] = 0.0f;
+					paths.material_id[i] = -1.0f;
+				}
+				continue;
+			}
+			paths.t[i] = r.tfar;
+			paths.hit_normal[i] = r.n;
+			paths.hit_uv[i] = vec2(r.u, r.v);
+			paths.geomID[i] = r.geomID;
+			paths.primID[i] = r.primID;
+			paths.instID[i] = r.instID;
+			shade_writers[getMaterial(r)->type].push(i);
+		}
+	}
+	wavefront_stats.extension_rays += n;
+	PathCounts counts;
+	counts.segments = n;
+	countPaths(counts);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Between stages 2 and 3: Hand out the slots for the branches that the
+// paths about to be shaded split into. Whether a path splits only depends
+// on its throughput and budget, so it is known before shading. Slots are
+// given in the order of the paths' own slots, so when they run out, the
+// same paths split into fewer branches however the threads are scheduled.
+///////////////////////////////////////////////////////////////////////////
+static void reserveBranches()
+{
+	if(!settings.path_splitting)
+		return;
+	const int end = next_branch_slot;
+	const int number_of_slots = int(paths.pixel.size());
+#pragma omp parallel for schedule(static)
+	for(int i = 0; i < end; i++)
+		paths.extra_branches[i] = 0;
+	for(const PathQueue& queue : shade_queues)
+	{
+		const int n = queue.size;
+#pragma omp parallel for schedule(static)
+		for(int q = 0; q < n; q++)
+		{
+			const int i = queue.items[q];
+			if(paths.bounces[i] < settings.max_bounces)
+				paths.extra_branches[i] = splitCount(paths.throughput[i], paths.split_budget[i]) - 1;
+		}
+	}
+	int slot = next_branch_slot;
+	for(int i = 0; i < end; i++)
+	{
+		if(paths.extra_branches[i] == 0)
+			continue;
+		paths.extra_branches[i] = std::min(paths.extra_branches[i], number_of_slots - slot);
+		paths.first_branch[i] = slot;
+		slot += paths.extra_branches[i];
+	}
+	next_branch_slot = slot;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Stage 3: Shade all hits of one material type. Adds emission, queues up
+// a shadow ray toward the light and samples the next ray of the path, and
+// of each branch it splits into.
+///////////////////////////////////////////////////////////////////////////
+static void shade(PathQueue& queue)
+{
+	const int n = queue.size;
+#pragma omp parallel
+	{
+		PathQueueWriter next, shadow;
+		next.queue = &next_queue;
+		shadow.queue = &shadow_queue;
+		PathCounts counts;
+#pragma omp for schedule(dynamic, 256)
+		for(int q = 0; q < n; q++)
+		{
+			const int i = queue.items[q];
+			const Ray hit_ray = paths.hitRay(i);
+			Intersection hit = getIntersection(hit_ray);
+			if(paths.bounces[i] == 0)
+			{
+				paths.albedo[i] = hit.material->color;
+				paths.normal[i] = hit.shading_normal;
+				paths.depth[i] = hit_ray.tfar;
+				paths.material_id[i] = float(getMaterialIndex(hit.material));
+			}
+			setRandomStream(paths.rng[i]);
+			startBounce(paths.bounces[i]);
+
+			Ray shadow_ray;
+			int& shadows = paths.shadow_count[i];
+			shadows = 0;
+			paths.shadow_bounce[i] = paths.bounces[i];
+			auto addShadowRay = [&](const vec3& Ld) {
+				const int slot = MAX_SHADOW_RAYS * i + shadows++;
+				paths.shadow_origin[slot] = shadow_ray.o;
+				paths.shadow_direction[slot] = shadow_ray.d;
+				paths.shadow_distance[slot] = shadow_ray.tfar;
+				paths.shadow_contribution[slot] = paths.throughput[i] * Ld;
+			};
+			vec3 Ld = pointLightContribution(hit, shadow_ray);
+			if(Ld != vec3(0.0f))
+				addShadowRay(Ld);
+			Ld = emissiveLightContribution(hit, shadow_ray);
+			if(Ld != vec3(0.0f))
+				addShadowRay(Ld);
+			Ld = environmentLightContribution(hit, shadow_ray);
+			if(Ld != vec3(0.0f))
+				addShadowRay(Ld);
+			if(shadows > 0)
+				shadow.push(i);
+			if(hit.material->emission != vec3(0.0f))
+			{
+				const vec3 Le =
+				    paths.throughput[i] * hit.material->emission * emissionWeight(hit_ray, paths.brdf_pdf[i]);
+				paths.L[i] += Le;
+				if(paths.bounces[i] <= 1)
+					paths.direct[i] += Le;
+			}
+
+			if(paths.bounces[i] >= settings.max_bounces)
+				continue;
+			const int bounces = paths.bounces[i];
+			const int branches = settings.path_splitting ? 1 + paths.extra_branches[i] : 1;
+			const int first_slot = paths.first_branch[i];
+			// Branch 0 goes on in the path's own slot, and is sampled last
+			// like in Li()
+			const RandomStream vertex_stream = getRandomStream();
+			const vec3 branch_throughput = paths.throughput[i] / float(branches);
+			const bool filtered = filtersEnvironment(*hit.material);
+			for(int b = branches - 1; b >= 0; b--)
+			{
+				const int j = b == 0 ? i : first_slot + b - 1;
+				setRandomStream(splitStream(vertex_stream, b));
+				if(b > 0)
+				{
+					paths.pixel[j] = paths.pixel[i];
+					paths.root[j] = paths.root[i];
+					paths.L[j] = vec3(0.0f);
+					paths.direct[j] = vec3(0.0f);
+					paths.rng[j] = getRandomStream();
+				}
+				Ray next_ray;
+				float next_pdf;
+				vec3 throughput = branch_throughput * sampleNextRay(hit, next_ray, next_pdf);
+				if(throughput == vec3(0.0f))
+					continue;
+				if(!russianRoulette(bounces, throughput))
+				{
+					counts.roulette_terminations++;
+					continue;
+				}
+				counts.splits += b > 0 ? 1 : 0;
+				paths.split_budget[j] = branchBudget(paths.split_budget[i], branches, b);
+				paths.throughput[j] = throughput;
+				paths.brdf_pdf[j] = next_pdf;
+				paths.filtered_environment[j] = filtered ? 1 : 0;
+				paths.rng[j] = getRandomStream();
+				paths.origin[j] = next_ray.o;
+				paths.direction[j] = next_ray.d;
+				paths.bounces[j] = bounces + 1;
+				next.push(j);
+			}
+		}
+		countPaths(counts);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Stage 4: Trace all queued shadow rays and add the light they carry to
+// their path if they reach the light. The queue holds paths, so all
+// shadow rays of a path are handled by the same thread. Each thread
+// gathers the shadow rays of a run of paths into one batch.
+///////////////////////////////////////////////////////////////////////////
+static const int PATHS_PER_SHADOW_BATCH = 64;
+
+static void connect()
+{
+	const int n = shadow_queue.size;
+	const int number_of_batches = (n + PATHS_PER_SHADOW_BATCH - 1) / PATHS_PER_SHADOW_BATCH;
+	int shadow_rays = 0;
+#pragma omp parallel for schedule(dynamic, 4) reduction(+ : shadow_rays)
+	for(int batch = 0; batch < number_of_batches; batch++)
+	{
+		Ray rays[PATHS_PER_SHADOW_BATCH * MAX_SHADOW_RAYS];
+		uint64_t visible[(PATHS_PER_SHADOW_BATCH * MAX_SHADOW_RAYS + 63) / 64];
+		const int first = batch * PATHS_PER_SHADOW_BATCH;
+		const int last = std::min(n, first + PATHS_PER_SHADOW_BATCH);
+		int count = 0;
+		for(int q = first; q < last; q++)
+		{
+			const int i = shadow_queue.items[q];
+			const int first_slot = MAX_SHADOW_RAYS * i;
+			for(int slot = first_slot; slot < first_slot + paths.shadow_count[i]; slot++)
+			{
+				rays[count++] =
+				    Ray(paths.shadow_origin[slot], paths.shadow_direction[slot], 0.0f, paths.shadow_distance[slot]);
+			}
+		}
+		occludedBatch(rays, count, visible);
+		int ray = 0;
+		for(int q = first; q < last; q++)
+		{
+			const int i = shadow_queue.items[q];
+			const int first_slot = MAX_SHADOW_RAYS * i;
+			for(int slot = first_slot; slot < first_slot + paths.shadow_count[i]; slot++, ray++)
+			{
+				if(!isVisible(visible, ray))
+					continue;
+				paths.L[i] += paths.shadow_contribution[slot];
+				if(paths.shadow_bounce[i] == 0)
+					paths.direct[i] += paths.shadow_contribution[slot];
+			}
+		}
+		shadow_rays += count;
+	}
+	wavefront_stats.shadow_rays += shadow_rays;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add the radiance of every branch to the camera path it split from. The
+// branches are sorted by path and stream, so that they are summed in an
+// order that does not depend on which branch got which slot.
+///////////////////////////////////////////////////////////////////////////
+static vector<int> branch_order;
+
+static void mergeBranches(int n)
+{
+	const int end = next_branch_slot;
+	if(end <= n)
+		return;
+	branch_order.resize(end - n);
+	std::iota(branch_order.begin(), branch_order.end(), n);
+	std::sort(branch_order.begin(), branch_order.end(), [](int a, int b) {
+		if(paths.root[a] != paths.root[b])
+			return paths.root[a] < paths.root[b];
+		return paths.rng[a].pixel_key < paths.rng[b].pixel_key;
+	});
+	for(int j : branch_order)
+	{
+		const int root = paths.root[j];
+		paths.L[root] += paths.L[j];
+		paths.direct[root] += paths.direct[j];
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Stage 5: Add the radiance of every path to its pixel. The thread that
+// owns the first path of a pixel adds all of that pixel's paths.
+///////////////////////////////////////////////////////////////////////////
+static void accumulate(int n)
+{
+#pragma omp parallel for schedule(static)
+	for(int i = 0; i < n; i++)
+	{
+		const int pixel = paths.pixel[i];
+		if(i > 0 && paths.pixel[i - 1] == pixel)
+			continue;
+		for(int j = i; j < n && paths.pixel[j] == pixel; j++)
+		{
+			PathAOVs aovs;
+			aovs.albedo = paths.albedo[j];
+			aovs.normal = paths.normal[j];
+			aovs.depth = paths.depth[j];
+			aovs.material_id = paths.material_id[j];
+			aovs.direct = paths.direct[j];
+			accumulatePixel(pixel % rendered_image.width, pixel / rendered_image.width, paths.L[j], aovs);
+		}
+	}
+}
+
+void traceWavefront(const PrimaryRayGenerator& camera)
+{
+	wavefront_stats = WavefrontStats();
+	double start = omp_get_wtime();
+	pass_pixels.clear();
+	int max_paths_per_pixel = 0;
+	for(int y = 0; y < rendered_image.height; y++)
+	{
+		for(int x = 0; x < rendered_image.width; x++)
+		{
+			const int paths_for_pixel = pathsThisPass(x, y);
+			pass_pixels.insert(pass_pixels.end(), paths_for_pixel, y * rendered_image.width + x);
+			max_paths_per_pixel = std::max(max_paths_per_pixel, paths_for_pixel);
+		}
+	}
+	wavefront_stats.generate += float((omp_get_wtime() - start) * 1000.0);
+	const int number_of_paths = int(pass_pixels.size());
+	// A wave may grow past WAVE_SIZE to finish the paths of its last pixel.
+	// With splitting, there are as many slots again for the branches.
+	const int capacity = std::min(number_of_paths, WAVE_SIZE + max_paths_per_pixel);
+	const int number_of_slots = settings.path_splitting ? 2 * capacity : capacity;
+	paths.resize(number_of_slots);
+
+	for(int begin = 0, end; begin < number_of_paths && !passCancelled(); begin = end)
+	{
+		end = std::min(begin + WAVE_SIZE, number_of_paths);
+		while(end < number_of_paths && pass_pixels[end] == pass_pixels[end - 1])
+			end++;
+		const int n = end - begin;
+		start = omp_get_wtime();
+		active_queue.reset(number_of_slots);
+		next_branch_slot = n;
+		generate(camera, begin, n);
+		PathCounts counts;
+		counts.paths = n;
+		countPaths(counts);
+		wavefront_stats.generate += float((omp_get_wtime() - start) * 1000.0);
+
+		while(active_queue.size > 0 && !passCancelled())
+		{
+			start = omp_get_wtime();
+			for(auto& queue : shade_queues)
+				queue.reset(number_of_slots);
+			extend();
+			wavefront_stats.extend += float((omp_get_wtime() - start) * 1000.0);
+
+			start = omp_get_wtime();
+			next_queue.reset(number_of_slots);
+			shadow_queue.reset(number_of_slots);
+			reserveBranches();
+			for(auto& queue : shade_queues)
+				shade(queue);
+			wavefront_stats.shade += float((omp_get_wtime() - start) * 1000.0);
+
+			start = omp_get_wtime();
+			connect();
+			wavefront_stats.connect += float((omp_get_wtime() - start) * 1000.0);
+
+			std::swap(active_queue.items, next_queue.items);
+			active_queue.size = int(next_queue.size);
+		}
+
+		start = omp_get_wtime();
+		mergeBranches(n);
+		accumulate(n);
+		wavefront_stats.accumulate += float((omp_get_wtime() - start) * 1000.0);
+	}
+}
+} // namespace pathtracer
@@ -0,0 +1,34 @@
+#pragma once
+#include "integrator.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Time spent in each stage of the wavefront integrator during the last
+// pass, in milliseconds.
+///////////////////////////////////////////////////////////////////////////
+extern struct WavefrontStats
+{
+	float generate = 0.0f;
+	float extend = 0.0f;
+	float shade = 0.0f;
+	float connect = 0.0f;
+	float accumulate = 0.0f;
+	// Total number of extension rays and shadow rays traced
+	int extension_rays = 0;
+	int shadow_rays = 0;
+} wavefront_stats;
+
+///////////////////////////////////////////////////////////////////////////
+// Trace one path per pixel with the wavefront integrator and accumulate
+// the result in the rendered image. Instead of following one path at a
+// time, as Li() does, all paths in flight are advanced together one stage
+// at a time:
+//   generate -> [extend -> shade -> connect]* -> accumulate
+// Path state is kept in SoA buffers and each stage only touches the paths
+// in its (compacted) input queue. Shading is done for one material type
+// at a time, so that each stage runs the same code over many paths.
+// Computes the same estimator as Li().
+///////////////////////////////////////////////////////////////////////////
+void traceWavefront(const PrimaryRayGenerator& camera);
+} // namespace pathtracer